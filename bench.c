@@ -0,0 +1,596 @@
+//Microbenchmarks for the individual pipeline kernels. The renderer is
+//compiled straight in so every kernel runs exactly as it does in a
+//frame, just on synthetic data and without a window
+#define LESTER_NO_MAIN
+#include "main.c"
+
+#define BENCH_SAMPLES 25
+#define BENCH_SAMPLE_MS 2.0  //Iterations are doubled until a sample takes this long
+#define BENCH_DATA 4096      //Size of the synthetic vertex and triangle pools
+#define BENCH_KEY 0xFF00FF
+
+typedef struct benchmark {
+    char *name;
+    void (*run)(int param, int iterations);
+    int param;
+    int span; //Span kernel to run it with, -1 for whatever init picked
+} benchmark;
+
+vertex bench_vertices[BENCH_DATA];
+screen_point bench_points[BENCH_DATA];
+triangle bench_tris[3][BENCH_DATA]; //Indexed by how many vertices get clipped
+triangle bench_large_tris[BENCH_DATA];
+float bench_uv[BENCH_DATA * 2];
+sprite bench_sprites[BENCH_DATA];
+debug_line bench_lines[BENCH_DATA];
+particle_system *bench_particles;
+texture bench_texture;
+texture bench_keyed;
+unsigned int bench_keyed_data[100];
+color bench_color;
+camera bench_cam;
+object *bench_cube;
+vertex_stream bench_stream;
+stream_transform bench_view;
+volatile unsigned int bench_sink;
+unsigned int bench_seed = 1;
+
+//Deterministic so runs can be compared against each other
+float bench_random(float min, float max) {
+
+    bench_seed = bench_seed * 1103515245 + 12345;
+
+    return min + (max - min) * ((bench_seed >> 8) & 0xFFFF) / 65535.0;
+}
+
+//Small view space triangles a few pixels across so the per-triangle
+//work dominates, size 0.02 being about five pixels on each side. Clipped
+//ones get vertices pulled in along their view ray to behind the near
+//plane, keeping the clipped result just as small
+void make_bench_triangle(triangle *tri, int clipped, float size) {
+
+    int i;
+    float x = bench_random(-0.5, 0.5), y = bench_random(-0.5, 0.5), z = bench_random(1.0, 10.0);
+
+    for(i = 0; i < 3; i++) {
+
+        tri->v[i].z = i < clipped ? NEAR_PLANE / 2.0 : z;
+        tri->v[i].x = (x + (i == 1 ? size : 0.0)) * tri->v[i].z;
+        tri->v[i].y = (y - (i == 2 ? size : 0.0)) * tri->v[i].z;
+        tri->v[i].u = i == 1 ? 1.0 : 0.0;
+        tri->v[i].v = i == 2 ? 1.0 : 0.0;
+        tri->v[i].c = &bench_color;
+    }
+
+    tri->t = &bench_texture;
+    tri->has_plane = 0;
+    tri->state = STATE_DEFAULT;
+}
+
+void init_bench() {
+
+    int i, j;
+    emitter e;
+
+    init_screen(DEFAULT_WIDTH, DEFAULT_HEIGHT, DEPTH_LINEAR16);
+    init_profiler();
+    init_span_kernel(-1);
+    init_camera(&bench_cam, 50);
+    update_camera(&bench_cam);
+    bench_color.r = 50; bench_color.g = 200; bench_color.b = 255; bench_color.a = 255;
+    bench_texture.width = bench_texture.height = 10;
+    bench_texture.data = test_data;
+    
+    //The same texture with the right half of every row keyed out
+    for(i = 0; i < 100; i++)
+        bench_keyed_data[i] = i % 10 < 5 ? test_data[i] : BENCH_KEY;
+        
+    bench_keyed = bench_texture;
+    bench_keyed.data = bench_keyed_data;
+    key_texture(&bench_keyed, BENCH_KEY);
+    bench_cube = new_box(-0.5, -0.5, -0.5, 0.5, 0.5, 0.5, 0, &bench_texture, &bench_color);
+
+    for(i = 0; i < BENCH_DATA; i++) {
+
+        bench_vertices[i].x = bench_random(-1.0, 1.0);
+        bench_vertices[i].y = bench_random(-1.0, 1.0);
+        bench_vertices[i].z = bench_random(NEAR_PLANE, SCREEN_DEPTH);
+        bench_vertices[i].u = bench_uv[i * 2] = bench_random(0.0, 1.0);
+        bench_vertices[i].v = bench_uv[i * 2 + 1] = bench_random(0.0, 1.0);
+        bench_vertices[i].c = &bench_color;
+
+        for(j = 0; j < 3; j++)
+            make_bench_triangle(&bench_tris[j][i], j, 0.02);
+            
+        make_bench_triangle(&bench_large_tris[i], 0, 0.06);
+        
+        //View space, ten to twenty pixels across
+        bench_sprites[i].z = bench_random(1.0, 10.0);
+        bench_sprites[i].x = bench_random(-0.5, 0.5) * bench_sprites[i].z;
+        bench_sprites[i].y = bench_random(-0.5, 0.5) * bench_sprites[i].z;
+        bench_sprites[i].width = bench_sprites[i].height = bench_random(0.04, 0.08) * bench_sprites[i].z;
+        bench_sprites[i].t = &bench_keyed;
+        
+        //View space, some running off of the screen
+        bench_lines[i].z0 = bench_random(1.0, 10.0);
+        bench_lines[i].x0 = bench_random(-0.7, 0.7) * bench_lines[i].z0;
+        bench_lines[i].y0 = bench_random(-0.7, 0.7) * bench_lines[i].z0;
+        bench_lines[i].z1 = bench_random(1.0, 10.0);
+        bench_lines[i].x1 = bench_random(-0.7, 0.7) * bench_lines[i].z1;
+        bench_lines[i].y1 = bench_random(-0.7, 0.7) * bench_lines[i].z1;
+        bench_lines[i].color = 0xFFFFFF;
+    }
+    
+    //Long lived, and filled up in one go
+    memset((void*)&e, 0, sizeof(emitter));
+    e.z = 5.0;
+    e.vy = 1.0;
+    e.spread = 0.5;
+    e.rate = 100000.0;
+    e.lifetime = 1000.0;
+    e.gravity = 1.0;
+    e.size = 0.02;
+    bench_particles = new_particle_system(&e, 100000);
+    update_particles(bench_particles, 1.0);
+    
+    //The camera sits at the origin, so running the stream through its
+    //view over and over only ever rotates it
+    reserve_stream(&bench_stream, BENCH_DATA);
+    bench_stream.count = BENCH_DATA;
+    
+    for(i = 0; i < BENCH_DATA; i++) {
+        
+        bench_stream.x[i] = bench_vertices[i].x;
+        bench_stream.y[i] = bench_vertices[i].y;
+        bench_stream.z[i] = bench_vertices[i].z;
+    }
+    
+    memcpy((void*)bench_view.m, (void*)bench_cam.view, sizeof(bench_view.m));
+    bench_view.pre[0] = bench_cam.x;
+    bench_view.pre[1] = bench_cam.y;
+    bench_view.pre[2] = bench_cam.z;
+    bench_view.post[0] = bench_view.post[1] = bench_view.post[2] = 0.0;
+    bench_view.outcodes = 1;
+    bench_view.focal = bench_cam.focal;
+    bench_view.width = screen.width;
+    bench_view.height = screen.height;
+    bench_view.s = &bench_stream;
+}
+
+void bench_project(int param, int iterations) {
+
+    int i;
+
+    (void)param;
+    for(i = 0; i < iterations; i++)
+        project(&bench_vertices[i % BENCH_DATA], &bench_points[i % BENCH_DATA]);
+}
+
+void bench_transform(int param, int iterations) {
+
+    int i;
+    vertex out;
+
+    (void)param;
+    for(i = 0; i < iterations; i++) {
+
+        transform_vertex(&bench_cam, &bench_vertices[i % BENCH_DATA], &out);
+        bench_sink += (unsigned int)out.z;
+    }
+}
+
+//Timed per vertex to compare against transform_vertex
+void bench_transform_stream(int param, int iterations) {
+    
+    int done, count;
+    
+    (void)param;
+    for(done = 0; done < iterations; done += count) {
+        
+        count = iterations - done < BENCH_DATA ? iterations - done : BENCH_DATA;
+        transform_stream((void*)&bench_view, 0, count);
+    }
+    
+    bench_sink += bench_stream.outcode[0];
+}
+
+//The triangles only ever land on the same few pixels, so after the
+//first pass over the pool this is mostly setup and depth rejection
+void bench_clip(int param, int iterations) {
+
+    int i;
+#ifdef LESTER_FIXED
+    fixed_triangle tri;
+    int j;
+#endif
+
+    for(i = 0; i < iterations; i++) {
+
+#ifdef LESTER_FIXED
+        for(j = 0; j < 3; j++)
+            transform_vertex_fixed(&bench_cam, &bench_tris[param][i % BENCH_DATA].v[j], &tri.v[j]);
+
+        tri.t = &bench_texture;
+        tri.has_plane = 0;
+        clip_and_render_fixed(NULL, &tri, bench_cam.fixed_focal);
+#else
+        clip_and_render(NULL, &bench_tris[param][i % BENCH_DATA]);
+#endif
+    }
+}
+
+//The default triangles are small enough for draw_triangle to skip the
+//edge setup, param 1 runs ones three times the size that go through it
+void bench_triangle(int param, int iterations) {
+
+    int i;
+    triangle *pool = param ? bench_large_tris : bench_tris[0];
+#ifdef LESTER_FIXED
+    fixed_triangle tri;
+    int j;
+#endif
+
+    (void)param;
+    for(i = 0; i < iterations; i++) {
+
+#ifdef LESTER_FIXED
+        for(j = 0; j < 3; j++)
+            transform_vertex_fixed(&bench_cam, &pool[i % BENCH_DATA].v[j], &tri.v[j]);
+
+        tri.t = &bench_texture;
+        tri.has_plane = 0;
+        draw_triangle_fixed(NULL, &tri, bench_cam.fixed_focal);
+#else
+        draw_triangle(NULL, &pool[i % BENCH_DATA]);
+#endif
+    }
+}
+
+#ifndef LESTER_FIXED
+//Planes running z from 1000 to 2000 and u and v from 0 to 1 across
+//param pixels of a row
+void make_bench_gradients(gradients *g, span *s, int param) {
+
+    memset((void*)g, 0, sizeof(gradients));
+    g->x = 0.5;
+    g->z = 1000;
+    g->w = 1.0;
+    g->dzdx = 1000.0 / (param - 1);
+    g->dudx = g->dvdx = 1.0 / (param - 1);
+    s->mz = g->dzdx;
+    s->mw = 0.0;
+    s->tex = &bench_texture;
+    s->state = STATE_DEFAULT;
+}
+#endif
+
+//Each iteration gets a fresh row of the depth buffer to write into,
+//clearing the whole buffer once every row has been used
+void bench_scanline(int param, int iterations) {
+
+    int i, row;
+#ifndef LESTER_FIXED
+    span s;
+    gradients g;
+
+    make_bench_gradients(&g, &s, param);
+#endif
+
+    for(i = 0; i < iterations; i++) {
+
+        row = i % screen.height;
+
+        if(!row)
+            clear_zbuf();
+
+#ifdef LESTER_FIXED
+        draw_scanline_fixed(NULL, row, 0, 1000, 0, 0, param - 1, 2000, FIXED_ONE, FIXED_ONE, &bench_texture, 0);
+#else
+        draw_scanline(NULL, row, 0, param - 1, &s, &g, span_fillers[DEPTH_LINEAR16][STATE_DEFAULT]);
+#endif
+    }
+}
+
+//Same spans against a depth buffer everything fails
+void bench_scanline_reject(int param, int iterations) {
+
+    int i;
+#ifndef LESTER_FIXED
+    span s;
+    gradients g;
+
+    make_bench_gradients(&g, &s, param);
+#endif
+
+    memset((void*)screen.zbuf, 0, screen.pixels*2);
+
+    for(i = 0; i < iterations; i++) {
+
+#ifdef LESTER_FIXED
+        draw_scanline_fixed(NULL, i % screen.height, 0, 1000, 0, 0, param - 1, 2000, FIXED_ONE, FIXED_ONE, &bench_texture, 0);
+#else
+        draw_scanline(NULL, i % screen.height, 0, param - 1, &s, &g, span_fillers[DEPTH_LINEAR16][STATE_DEFAULT]);
+#endif
+    }
+}
+
+#ifndef LESTER_FIXED
+//scanline_640's spans over the half keyed texture
+void bench_scanline_keyed(int param, int iterations) {
+
+    int i, row;
+    span s;
+    gradients g;
+
+    make_bench_gradients(&g, &s, param);
+    s.tex = &bench_keyed;
+    s.state = STATE_DEFAULT | STATE_KEYED;
+
+    for(i = 0; i < iterations; i++) {
+
+        row = i % screen.height;
+
+        if(!row)
+            clear_zbuf();
+
+        draw_scanline(NULL, row, 0, param - 1, &s, &g, span_fillers[DEPTH_LINEAR16][STATE_DEFAULT | STATE_KEYED]);
+    }
+}
+#endif
+
+//One keyed sprite at a time out of the pool, the depth buffer cleared
+//each time through it
+void bench_sprite(int param, int iterations) {
+
+    int i;
+
+    (void)param;
+    for(i = 0; i < iterations; i++) {
+
+        if(!(i % BENCH_DATA))
+            clear_zbuf();
+
+        draw_sprite(&bench_sprites[i % BENCH_DATA]);
+    }
+}
+
+//One debug line at a time out of the pool, tested against a cleared
+//depth buffer since lines never write to it
+void bench_line(int param, int iterations) {
+
+    int i;
+
+    (void)param;
+    clear_zbuf();
+
+    for(i = 0; i < iterations; i++)
+        draw_line(&bench_lines[i % BENCH_DATA]);
+}
+
+//A whole system of particles moved on a step at a time, with lifetimes
+//too long for any to die
+void bench_particle_update(int param, int iterations) {
+
+    int i;
+
+    (void)param;
+    for(i = 0; i < iterations; i++)
+        update_particles(bench_particles, 0.001);
+
+    bench_sink += bench_particles->count;
+}
+
+//The span kernels straight, without draw_scanline's setup, over the
+//same spans as scanline_640
+void bench_span(int param, int iterations) {
+
+    int i, row;
+    span s;
+
+    s.x1 = param - 1;
+    s.z1 = 2000;
+    s.u1 = s.v1 = 1.0;
+    s.mz = 1000.0 / (param - 1);
+    s.mu = s.mv = 1.0 / (param - 1);
+    s.tex = &bench_texture;
+    s.state = STATE_DEFAULT;
+
+    for(i = 0; i < iterations; i++) {
+
+        row = i % screen.height;
+
+        if(!row)
+            clear_zbuf();
+
+        s.color = &screen.fbuf[row * screen.width];
+        s.depth = &((unsigned short*)screen.zbuf)[row * screen.width];
+        bench_sink += span_kernels[DEPTH_LINEAR16][span_kernel](&s, 0, param - 1);
+    }
+}
+
+//The texel lookup from draw_scanline on its own
+void bench_texture_fetch(int param, int iterations) {
+
+    int i;
+    unsigned int newu, newv, sum = 0;
+    float *uv;
+
+    (void)param;
+    for(i = 0; i < iterations; i++) {
+
+        uv = &bench_uv[(i % BENCH_DATA) * 2];
+        newu = (unsigned int)lround(uv[0] * (bench_texture.width - 1));
+        newv = (unsigned int)lround(uv[1] * (bench_texture.height - 1));
+        sum += bench_texture.data[newv * bench_texture.width + newu];
+    }
+
+    bench_sink += sum;
+}
+
+//Reading a pixel back after every clear stops the compiler from
+//folding the repeated clears into one
+void bench_clear_zbuf(int param, int iterations) {
+
+    int i;
+
+    (void)param;
+    for(i = 0; i < iterations; i++) {
+
+        clear_zbuf();
+        bench_sink += ((unsigned short*)screen.zbuf)[i % screen.pixels];
+    }
+}
+
+void bench_clear_fbuf(int param, int iterations) {
+
+    int i;
+
+    (void)param;
+    for(i = 0; i < iterations; i++) {
+
+        clear_fbuf(0xFF000000 | i);
+        bench_sink += screen.fbuf[i % screen.pixels];
+    }
+}
+
+void (*bench_rotations[])(object*, float) = {
+    rotate_object_x_global, rotate_object_y_global, rotate_object_z_global,
+    rotate_object_x_local, rotate_object_y_local, rotate_object_z_local
+};
+
+void bench_rotate(int param, int iterations) {
+
+    int i;
+
+    for(i = 0; i < iterations; i++)
+        bench_rotations[param](bench_cube, 1.0);
+}
+
+benchmark benchmarks[] = {
+    { "project", bench_project, 0, -1 },
+    { "transform_vertex", bench_transform, 0, -1 },
+    { "transform_stream", bench_transform_stream, 0, -1 },
+    { "clip_none", bench_clip, 0, -1 },
+    { "clip_one", bench_clip, 1, -1 },
+    { "clip_two", bench_clip, 2, -1 },
+    { "triangle_setup", bench_triangle, 0, -1 },
+    { "triangle_setup_large", bench_triangle, 1, -1 },
+    { "scanline_8", bench_scanline, 8, -1 },
+    { "scanline_64", bench_scanline, 64, -1 },
+    { "scanline_640", bench_scanline, 640, -1 },
+    { "scanline_reject_64", bench_scanline_reject, 64, -1 },
+#ifndef LESTER_FIXED
+    { "scanline_keyed_640", bench_scanline_keyed, 640, -1 },
+#endif
+    { "sprite", bench_sprite, 0, -1 },
+    { "line", bench_line, 0, -1 },
+    { "particle_update_100k", bench_particle_update, 0, -1 },
+    { "span_scalar_640", bench_span, 640, SPAN_SCALAR },
+    { "span_sse2_640", bench_span, 640, SPAN_SSE2 },
+    { "span_avx2_640", bench_span, 640, SPAN_AVX2 },
+    { "texture_fetch", bench_texture_fetch, 0, -1 },
+    { "clear_zbuf", bench_clear_zbuf, 0, -1 },
+    { "clear_fbuf", bench_clear_fbuf, 0, -1 },
+    { "rotate_x_global", bench_rotate, 0, -1 },
+    { "rotate_y_global", bench_rotate, 1, -1 },
+    { "rotate_z_global", bench_rotate, 2, -1 },
+    { "rotate_x_local", bench_rotate, 3, -1 },
+    { "rotate_y_local", bench_rotate, 4, -1 },
+    { "rotate_z_local", bench_rotate, 5, -1 }
+};
+
+double bench_seconds(Uint64 ticks) {
+
+    return (double)ticks / SDL_GetPerformanceFrequency();
+}
+
+int compare_doubles(const void *a, const void *b) {
+
+    return *(double*)a < *(double*)b ? -1 : *(double*)a > *(double*)b ? 1 : 0;
+}
+
+//Find an iteration count that fills a sample, warming the caches up
+//along the way, then time BENCH_SAMPLES samples of it
+void run_benchmark(benchmark *b, int samples) {
+
+    int i, iterations = 1;
+    double ns[BENCH_SAMPLES], elapsed, mean = 0, variance = 0;
+    Uint64 start;
+
+    while(1) {
+
+        start = SDL_GetPerformanceCounter();
+        b->run(b->param, iterations);
+        elapsed = bench_seconds(SDL_GetPerformanceCounter() - start);
+
+        if(elapsed * 1000.0 >= BENCH_SAMPLE_MS || iterations >= (1 << 30))
+            break;
+
+        iterations *= 2;
+    }
+
+    for(i = 0; i < samples; i++) {
+
+        start = SDL_GetPerformanceCounter();
+        b->run(b->param, iterations);
+        ns[i] = (bench_seconds(SDL_GetPerformanceCounter() - start) * 1e9) / iterations;
+        mean += ns[i];
+    }
+
+    mean /= samples;
+
+    for(i = 0; i < samples; i++)
+        variance += (ns[i] - mean) * (ns[i] - mean);
+
+    variance /= samples > 1 ? samples - 1 : 1;
+    qsort(ns, samples, sizeof(double), compare_doubles);
+    printf("%-20s %12.2f %12.2f %12.2f %8.2f%% %10d\n", b->name, ns[0], ns[samples / 2], mean, mean ? (sqrt(variance) * 100.0) / mean : 0, iterations);
+}
+
+//Usage: bench [-samples n] [name filter]...
+//Every benchmark whose name contains one of the filters is run, or
+//all of them when there are none. Times are nanoseconds per operation
+int main(int argc, char* argv[]) {
+
+    int i, j, matched, filters = 0, samples = BENCH_SAMPLES, kernel;
+    int count = sizeof(benchmarks) / sizeof(benchmark);
+
+    for(i = 1; i < argc; i++) {
+
+        if(!strcmp(argv[i], "-samples") && i + 1 < argc) {
+
+            samples = atoi(argv[++i]);
+            samples = samples < 1 ? 1 : samples > BENCH_SAMPLES ? BENCH_SAMPLES : samples;
+            argv[i - 1] = argv[i] = NULL;
+        } else {
+
+            filters++;
+        }
+    }
+
+    init_bench();
+    printf("%-20s %12s %12s %12s %9s %10s\n", "kernel", "min ns", "median ns", "mean ns", "cv", "iters");
+
+    for(i = 0; i < count; i++) {
+
+        for(j = 1, matched = !filters; j < argc && !matched; j++)
+            matched = argv[j] && strstr(benchmarks[i].name, argv[j]);
+
+        if(!matched)
+            continue;
+
+        //Kernels this CPU can't run are left out of the table
+        if(benchmarks[i].span >= 0 && !span_kernel_supported(benchmarks[i].span))
+            continue;
+
+        kernel = span_kernel;
+        span_kernel = benchmarks[i].span >= 0 ? benchmarks[i].span : span_kernel;
+        run_benchmark(&benchmarks[i], samples);
+        span_kernel = kernel;
+    }
+
+    delete_object(bench_cube);
+    delete_stream(&bench_stream);
+
+    return 0;
+}
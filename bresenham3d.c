@@ -46,125 +46,74 @@ void scanline3d(SDL_Renderer *r, int scanline, int x0, int z0, int x1, int z1) {
 //This could be more elegantly done by creating a raster-interpolate 'class' which
 //can keep track of its own bresenham values internally and run it's internals in steps 
 //via a 'member function'
-void render_triangle(triangle* tri, SDL_Renderer *rend) {
+void triangle3d(SDL_Renderer *r, int x1, int y1, int z1, int x2, int y2, int z2, int x3, int y3, int z3) {
 	
 	int temp;
-	int dx_x1, sx_x1, dy_x1, sy_x1,	err_x1,	te_x1;
-	int dx_z1, sx_z1, dy_z1, sy_z1,	err_z1,	te_z1;
-	int dx_x2, sx_x2, dy_x2, sy_x2,	err_x2,	te_x2;
-	int dx_z2, sx_z2, dy_z2, sy_z2,	err_z2,	te_z2;
-	int dx_x3, sx_x3, dy_x3, sy_x3,	err_x3,	te_x3;
-	int dx_z3, sx_z3, dy_z3, sy_z3,	err_z3,	te_z3;
+	int dx_x1, sx_x1, dy_x1,	err_x1,	te_x1;
+	int dx_z1, sx_z1, dy_z1,	err_z1,	te_z1;
+	int dx_x2, sx_x2, dy_x2,	err_x2,	te_x2;
+	int dx_z2, sx_z2, dy_z2,	err_z2,	te_z2;
+	int dx_x3, sx_x3, dy_x3,	err_x3,	te_x3;
+	int dx_z3, sx_z3, dy_z3,	err_z3,	te_z3;
 	int current_s;
 	int cur_x1, cur_x2, cur_x3;
 	int cur_z1, cur_z2, cur_z3;
 	
-
-    
-    int i;
-    int x[3], y[3], z[3];
-    float zval[2];
-    float vec_a[3];
-    float vec_b[3];
-    float cross[3];
-    float mag;
-    float normal_angle;
-    float lighting_pct;
-    float r, g, b;
-    unsigned char f, s, t, e, done_1, done_2;
-    
-    //Calculate the surface normal
-    //subtract 3 from 2 and 1, translating it to the origin
-    vec_a[0] = tri->v[0].x - tri->v[2].x;
-    vec_a[1] = tri->v[0].y - tri->v[2].y;
-    vec_a[2] = tri->v[0].z - tri->v[2].z;
-    vec_b[0] = tri->v[1].x - tri->v[2].x;
-    vec_b[1] = tri->v[1].y - tri->v[2].y;
-    vec_b[2] = tri->v[1].z - tri->v[2].z;
-    
-    //calculate the cross product using 1 as vector a and 2 as vector b
-    cross[0] = vec_a[1]*vec_b[2] - vec_a[2]*vec_b[1];
-    cross[1] = vec_a[2]*vec_b[0] - vec_a[0]*vec_b[2];
-    cross[2] = vec_a[0]*vec_b[1] - vec_a[1]*vec_b[0]; 
-    
-    //normalize the result vector
-    mag = sqrt(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
-    cross[0] /= mag;
-    cross[1] /= mag;
-    cross[2] /= mag;
-        
-    //Calculate the normal's angle vs the camera view direction
-    normal_angle = acos(-cross[2]);
-    
-    //If the normal is facing away from the camera, don't bother drawing it
-    if(normal_angle >= (PI/2))
-        return;
-    
-    lighting_pct = ((2.0*(PI - normal_angle)) / PI) - 1.0;
-    r = tri->v[0].c->r * lighting_pct;
-    r = r > 255.0 ? 255 : r;     
-    g = tri->v[0].c->g * lighting_pct;
-    g = g > 255.0 ? 255 : g;
-    b = tri->v[0].c->b * lighting_pct;
-    b = b > 255.0 ? 255 : b;
-    
-    //Also perform a TO_SCREEN_Z of the z-value to be used in z-buffer calculations
-    for(i = 0; i < 3; i++) {
-        
-        project(&(tri->v[i]), &p[i]);
-        zval[i] = TO_SCREEN_Z(tri->v[i].z);
-        p[i].x = TO_SCREEN_X(p[i].x);
-        p[i].y = TO_SCREEN_Y(p[i].y);
-    }
+	//Sort the vertices by ascending y
+	if(y1 > y2) {
+		temp = x1; x1 = x2; x2 = temp;
+		temp = y1; y1 = y2; y2 = temp;
+		temp = z1; z1 = z2; z2 = temp;
+	}
+	
+	if(y2 > y3) {
+		temp = x2; x2 = x3; x3 = temp;
+		temp = y2; y2 = y3; y3 = temp;
+		temp = z2; z2 = z3; z3 = temp;
+	}
+	
+	if(y1 > y2) {
+		temp = x1; x1 = x2; x2 = temp;
+		temp = y1; y1 = y2; y2 = temp;
+		temp = z1; z1 = z2; z2 = temp;
+	}
 	
 	//Now that they're sorted, calculate the bresenham values for each line
 	//For the x of the first line ([x1, y1, z1] -> [x2, y2, z2])
 	dx_x1 = abs(x2 - x1);
 	sx_x1 = x1 < x2 ? 1 : -1;
 	dy_x1 = abs(y2 - y1);
-	sy_x1 = y1 < y2 ? 1 : -1; 
 	err_x1 = (dx_x1 > dy_x1 ? dx_x1 : -dy_x1) / 2;
-	te_x1;
 	
 	//For the z of the first line ([x1, y1, z1] -> [x2, y2, z2])
 	dx_z1 = abs(z2 - z1);
 	sx_z1 = z1 < z2 ? 1 : -1;
 	dy_z1 = abs(y2 - y1);
-	sy_z1 = y1 < y2 ? 1 : -1; 
 	err_z1 = (dx_z1 > dy_z1 ? dx_z1 : -dy_z1) / 2;
-	te_z1;
 	
 	//For the x of the second line ([x2, y2, z2] -> [x3, y3, z3])
 	dx_x2 = abs(x3 - x2);
 	sx_x2 = x2 < x3 ? 1 : -1;
 	dy_x2 = abs(y3 - y2);
-	sy_x2 = y2 < y3 ? 1 : -1; 
 	err_x2 = (dx_x2 > dy_x2 ? dx_x2 : -dy_x2) / 2;
-	te_x2;
 	
 	//For the z of the second line ([x2, y2, z2] -> [x3, y3, z3])
 	dx_z2 = abs(z3 - z2);
 	sx_z2 = z2 < z3 ? 1 : -1;
 	dy_z2 = abs(y3 - y2);
-	sy_z2 = y2 < y3 ? 1 : -1; 
 	err_z2 = (dx_z2 > dy_z2 ? dx_z2 : -dy_z2) / 2;
-	te_z2;
 	
 	//For the x of the third line ([x1, y1, z1] -> [x3, y3, z3])
 	dx_x3 = abs(x3 - x1);
 	sx_x3 = x1 < x3 ? 1 : -1;
 	dy_x3 = abs(y3 - y1);
-	sy_x3 = y1 < y3 ? 1 : -1; 
 	err_x3 = (dx_x3 > dy_x3 ? dx_x3 : -dy_x3) / 2;
-	te_x3;
 	
 	//For the z of the third line ([x1, y1, z1] -> [x3, y3, z3])
 	dx_z3 = abs(z3 - z1);
 	sx_z3 = z1 < z3 ? 1 : -1;
 	dy_z3 = abs(y3 - y1);
-	sy_z3 = y1 < y3 ? 1 : -1; 
 	err_z3 = (dx_z3 > dy_z3 ? dx_z3 : -dy_z3) / 2;
-	te_z3;
 	
 	//Set the important scanlines
 	current_s = y1;
@@ -354,12 +303,10 @@ int main(int argc, char* argv[]) {
     SDL_Renderer* renderer = NULL;
     SDL_Event e;
     int done = 0;
-    int xa = 10;
-    int ya = 10;
-    int za = 0;
-    int xb = 100;
-    int yb = 75;
-    int zb = 255;
+    
+    //SDL_main needs the arguments declared either way
+    (void)argc;
+    (void)argv;
     
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
 
@@ -2,22 +2,110 @@
 #include <stdio.h>
 #include <math.h>
 #include <memory.h>
+#include <string.h>
 
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 480
-#define SCREEN_PIXELS SCREEN_WIDTH * SCREEN_HEIGHT
+//Batched vertex work goes 8 or 4 wide with whatever the compiler was
+//told it can use, with a scalar fallback for everything else
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+typedef __m256 simd_float;
+#define simd_load(p) _mm256_loadu_ps(p)
+#define simd_store(p, a) _mm256_storeu_ps(p, a)
+#define simd_set(f) _mm256_set1_ps(f)
+#define simd_add(a, b) _mm256_add_ps(a, b)
+#define simd_sub(a, b) _mm256_sub_ps(a, b)
+#define simd_mul(a, b) _mm256_mul_ps(a, b)
+#define simd_less(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define simd_and(a, b) _mm256_and_ps(a, b)
+#define simd_or(a, b) _mm256_or_ps(a, b)
+#define simd_bits(n) _mm256_castsi256_ps(_mm256_set1_epi32(n))
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+typedef __m128 simd_float;
+#define simd_load(p) _mm_loadu_ps(p)
+#define simd_store(p, a) _mm_storeu_ps(p, a)
+#define simd_set(f) _mm_set1_ps(f)
+#define simd_add(a, b) _mm_add_ps(a, b)
+#define simd_sub(a, b) _mm_sub_ps(a, b)
+#define simd_mul(a, b) _mm_mul_ps(a, b)
+#define simd_less(a, b) _mm_cmplt_ps(a, b)
+#define simd_and(a, b) _mm_and_ps(a, b)
+#define simd_or(a, b) _mm_or_ps(a, b)
+#define simd_bits(n) _mm_castsi128_ps(_mm_set1_epi32(n))
+#endif
+
+//Span filling picks its instruction set at runtime instead, with the
+//kernels for the wider ones compiled for their target on their own
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define LESTER_X86
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(isa) __attribute__((target(isa)))
+#define FORCE_INLINE static __inline__ __attribute__((always_inline))
+#else
+#define TARGET(isa)
+#define FORCE_INLINE static
+#endif
+
+#define DEFAULT_WIDTH 640
+#define DEFAULT_HEIGHT 480
 #define SCREEN_DEPTH 20.0
+#define NEAR_PLANE 0.1 //This is how far in front of camera the front clipping plane is
 
 //Convert a point scaled such that 1.0, 1.0 is at the upper right-hand
 //corner of the screen and -1.0, -1.0 is at the bottom right to pixel coords
 #define PI 3.141592653589793
-#define TO_SCREEN_Y(y) ((int)((SCREEN_HEIGHT-(y*SCREEN_HEIGHT))/2.0))
-#define TO_SCREEN_X(x) ((int)((SCREEN_WIDTH+(x*SCREEN_HEIGHT))/2.0))
+#define SUBPIXEL_BITS 4 //Fractional bits screen x and y get snapped to
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE >> 1)
+#define TO_SCREEN_Y(y) ((int)floor((screen.height-(y*screen.height))*(SUBPIXEL_ONE/2.0) + 0.5))
+#define TO_SCREEN_X(x) ((int)floor((screen.width+(x*screen.height))*(SUBPIXEL_ONE/2.0) + 0.5))
 #define TO_SCREEN_Z(z) ((unsigned short)((z) > SCREEN_DEPTH || z < 0 ? 65535 : ((z*65535.0)/SCREEN_DEPTH)))
 #define DEG_TO_RAD(a) ((((float)a)*PI)/180.0)
+#define FLOOR_DIV(n, d) ((n) >= 0 ? (n) / (d) : -((d) - 1 - (n)) / (d)) //d has to be positive
+#define CEIL_DIV(n, d) (-FLOOR_DIV(-(n), d))
+
+//Depth buffer formats. linear16 is TO_SCREEN_Z, float32 is view z as
+//is and reversed is NEAR_PLANE/z as a float, which keeps its precision
+//up close and, unlike z, interpolates exactly in screen space. Nearer
+//is less for the first two and greater for reversed
+#define DEPTH_LINEAR16 0
+#define DEPTH_FLOAT32  1
+#define DEPTH_REVERSED 2
+#define DEPTH_FORMATS  3
+
+//Dynamic resolution holds frame time under a budget by shrinking the 
+//drawn size in steps, going back up once there's headroom again
+#define DYNRES_MIN_SCALE 0.5
+#define DYNRES_STEP 0.05     //Most the scale moves in one frame
+#define DYNRES_HEADROOM 0.8  //Share of the budget below which it grows again
+#define DYNRES_SMOOTHING 0.1 //Weight of the latest frame in the average
+
+//Where frames get rasterized. The buffers are allocated for the full
+//size, the window's, and a frame can be drawn at any size up to that,
+//packed at the start of the buffers, to be stretched onto the window
+typedef struct render_target {
+    int width;
+    int height;
+    int pixels;        //width * height
+    int full_width;
+    int full_height;
+    float scale;       //Of the full size along each axis
+    float budget;      //Milliseconds per frame, 0 for a fixed size
+    float average_ms;
+    int depth_format;
+    void *zbuf;
+    unsigned int *fbuf; //ARGB8888, uploaded to the window once per frame
+} render_target;
 
 float focal_length;
-unsigned short *zbuf;
+render_target screen;
+const char *depth_names[DEPTH_FORMATS] = { "linear16", "float32", "reversed" };
+const int depth_bytes[DEPTH_FORMATS] = { 2, 4, 4 };
 
 typedef struct point {
     float x;
@@ -29,11 +117,12 @@ typedef struct point {
 //until we're actually drawing on the screen
 //and thereby improve speed and precision
 typedef struct screen_point {
-    int x;
+    int x;   //In 1/SUBPIXEL_ONE pixels
     int y;
     float u;
     float v;
-    unsigned short z;
+    float z; //Already in the screen's depth format
+    float w; //1/z for perspective correction
 } screen_point;
 
 typedef struct color {
@@ -57,13 +146,91 @@ typedef struct texture {
     int height;
     int width;
     unsigned int* data;
+    unsigned int key;      //Texels of this color are see-through, when keyed
+    unsigned short *runs;  //Per texel, the first and last u of its row's see-through run, NULL when not keyed
 } texture;
 
+//A plane in the form x*px + y*py + z*pz + d = 0, with the
+//normal pointing to the inside (visible) half-space
+typedef struct plane {
+    float x;
+    float y;
+    float z;
+    float d;
+} plane;
+
+//Pipeline state a triangle is rasterized with. Every combination gets
+//its own span filler, so a span only does the work its state asks for
+#define STATE_DEPTH       1 //Test against and write the depth buffer
+#define STATE_TEXTURED    2 //Texels, or the first vertex's color when flat
+#define STATE_SHADED      4 //Scaled by the light falling on the triangle
+#define STATE_PERSPECTIVE 8 //Perspective correct texture coordinates
+#define STATE_BLEND       16 //Over what's drawn by the first vertex's alpha, leaving depth alone
+#define STATE_KEYED       32 //Skipping the key color, set at setup for keyed textures
+#define STATE_DEFAULT (STATE_DEPTH | STATE_TEXTURED)
+#define STATES 64
+
+//Static triangles carry their plane, precomputed once at load time,
+//so that per-frame work doesn't have to rederive the face normal
 typedef struct triangle {
     vertex v[3];
     texture *t;
+    plane p;
+    int has_plane;
+    int state; //STATE_* flags
 } triangle;
 
+//Building with -DLESTER_FIXED swaps the per-frame transform, projection,
+//clipping and rasterization over to integer-only code for CPUs without 
+//a (fast) FPU. World geometry stays float, it's only touched at load 
+//time or when objects are animated
+#ifdef LESTER_FIXED
+typedef int fixed;
+
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_HALF (1 << (FIXED_SHIFT - 1))
+#define FIXED_CONST(f) ((fixed)((f) * FIXED_ONE)) //Compile-time constants only
+#define FIXED_MUL(a, b) ((fixed)(((long long)(a) * (b)) >> FIXED_SHIFT))
+#define FIXED_DIV(a, b) ((fixed)(((long long)(a) * FIXED_ONE) / (b)))
+
+typedef struct fixed_vertex {
+    fixed x;
+    fixed y;
+    fixed z;
+    fixed u;
+    fixed v;
+    color *c;
+} fixed_vertex;
+
+//Triangles with has_plane set were backface culled before transforming
+typedef struct fixed_triangle {
+    fixed_vertex v[3];
+    texture *t;
+    int has_plane;
+} fixed_triangle;
+
+//Screen space x, y and z are plain integers since they easily outgrow
+//16.16 for vertices just past the near plane
+typedef struct fixed_screen_point {
+    int x;
+    int y;
+    int z;
+    fixed u;
+    fixed v;
+} fixed_screen_point;
+
+//Exact integer interpolation in the spirit of bresenham3d.c: value runs
+//from start to start + delta over den steps, carrying the remainder
+typedef struct dda {
+    int value;
+    int step;
+    int rem;
+    int err;
+    int den;
+} dda;
+#endif
+
 typedef struct node {
     void *payload;
     struct node *next;
@@ -73,877 +240,6725 @@ typedef struct list {
     node *root;
 } list;
 
+//The six planes bounding the visible volume
+#define FRUSTUM_LEFT   0
+#define FRUSTUM_RIGHT  1
+#define FRUSTUM_TOP    2
+#define FRUSTUM_BOTTOM 3
+#define FRUSTUM_NEAR   4
+#define FRUSTUM_FAR    5
+#define FRUSTUM_PLANES 6
+#define FRUSTUM_ALL_PLANES ((1 << FRUSTUM_PLANES) - 1)
+
+typedef struct frustum {
+    plane p[FRUSTUM_PLANES];
+} frustum;
+
+//Results of testing a volume against the frustum
+#define CULL_OUTSIDE   0
+#define CULL_INTERSECT 1
+#define CULL_INSIDE    2
+
+//Axis-aligned box plus the sphere enclosing it
+typedef struct bounds {
+    float min[3];
+    float max[3];
+    float center[3];
+    float radius;
+} bounds;
+
+//Meshes with more triangles than this get a BVH, and
+//leaves are split until they hold at most BVH_LEAF_SIZE
+#define BVH_MIN_TRIANGLES 64
+#define BVH_LEAF_SIZE 16
+
+//Children are indices into the object's node array, leaves
+//have left == -1 and own tri_count entries of the object's
+//tri_array starting at first
+typedef struct bvh_node {
+    bounds b;
+    int left;
+    int right;
+    int first;
+    int tri_count;
+} bvh_node;
+
 typedef struct object {
     list tri_list;
     float x;
     float y;
     float z;
+    bounds b;
+    int bounds_dirty;
+    int is_static;
+    int tri_count;
+    triangle **tri_array;
+    bvh_node *bvh;
+    int bvh_count;
 } object;
 
+//Node-storing BSP tree for static environment geometry. Triangles
+//lying in the splitting plane live on the node, split by which way
+//they face so that the side the eye is on picks the visible set
+typedef struct bsp_node {
+    plane p;
+    triangle **front_tris;
+    int front_count;
+    triangle **back_tris;
+    int back_count;
+    bounds b;
+    struct bsp_node *front;
+    struct bsp_node *back;
+} bsp_node;
+
+//A viewpoint in the world. Geometry stays in world space and is run
+//through view each frame, so moving the camera costs nothing per 
+//triangle. view is the world-to-view rotation and world_frustum the
+//view frustum expressed in world space for culling world bounds
+typedef struct camera {
+    float x;
+    float y;
+    float z;
+    float yaw;   //Degrees, positive turns right
+    float pitch; //Degrees, positive looks up
+    float fov;   //Degrees
+    float focal; //focal_length as of the last update
+    float view[3][3];
+    frustum world_frustum;
+#ifdef LESTER_FIXED
+    fixed fixed_view[3][3];
+    fixed fixed_pos[3];
+    fixed fixed_focal;
+#endif
+} camera;
+
+#define BSP_EPSILON 0.0001
+#define BSP_CANDIDATES 16 //How many potential splitters to score per node
+#define BSP_SPLIT_COST 8  //How much worse a split is than an unbalanced tree
+//Span fill kernels, best first from init_span_kernel's point of view
+#define SPAN_SCALAR 0
+#define SPAN_SSE2   1
+#define SPAN_AVX2   2
+#define SPAN_KERNELS 3
+
+//One onscreen run of a scanline. Everything is interpolated from the
+//right end, x1, the way draw_scanline always has. With perspective 
+//correction u and v come in divided by z and w is 1/z
+typedef struct span {
+    unsigned int *color;   //The scanline's first pixel
+    void *depth;           //In the screen's depth format
+    float x1;
+    float z1;
+    float u1;
+    float v1;
+    float w1;
+    float mz;
+    float mu;
+    float mv;
+    float mw;
+    texture *tex;
+    unsigned int flat;     //RGB for untextured triangles
+    int light;             //0 to 256, for shaded triangles
+    int alpha;             //0 to 256, for blended triangles
+    int state;             //Of the triangle it belongs to
+} span;
+
+//Fill pixels first through last of a span, returning how many passed
+//the depth test and weren't keyed out
+typedef int (*span_function)(span *s, int first, int last);
+
+//A triangle's z, u, v and w as planes over the screen: their values at
+//the first vertex, whose position is in pixels, and how much they change
+//per pixel across and down
+typedef struct gradients {
+    float x, y;
+    float z, u, v, w;
+    float dzdx, dudx, dvdx, dwdx;
+    float dzdy, dudy, dvdy, dwdy;
+} gradients;
+
+//A triangle edge stepped a row at a time. x is the first pixel whose
+//center is at or right of the edge on the current row, kept exact by
+//carrying the remainder of the division it comes from
+typedef struct edge {
+    int x;
+    int step;
+    long long err;
+    long long rem;
+    long long den;
+} edge;
+
+#define RASTER_BAND_HEIGHT 32 //Scanlines per rasterization job
+#define SMALL_TRIANGLE_SIZE 8 //Pixels across and down under which a triangle skips the edge setup
+#define RASTER_BANDS(height) (((height) + RASTER_BAND_HEIGHT - 1) / RASTER_BAND_HEIGHT)
+#define RASTER_ALL 0x7FFFFFFF //raster_bottom when a thread isn't limited to a band
+
+//Job system. Each worker thread owns a deque that it pushes to and pops
+//from at the bottom while idle workers steal from the top of everyone
+//else's. The main thread is worker 0 and runs jobs while it waits
+#define JOB_MAX_WORKERS 16
+#define JOB_DEQUE_SIZE 1024 //Per worker, has to be a power of two
+
+//Counts down as the jobs it was handed to finish
+typedef struct job_counter {
+    SDL_atomic_t pending;
+} job_counter;
+
+//Runs over the items from start up to end
+typedef void (*job_function)(void *data, int start, int end);
+
+typedef struct job {
+    job_function run;
+    void *data;
+    int start;
+    int end;
+    job_counter *counter;
+} job;
+
+typedef struct job_deque {
+    SDL_mutex *lock;
+    job jobs[JOB_DEQUE_SIZE];
+    int top;    //Next to be stolen
+    int bottom; //Next free slot
+} job_deque;
+
+//Frame profiler stages. Each frame gets one record holding how long
+//was spent in every stage, both including and excluding the stages
+//nested inside of it, and the last PROFILE_HISTORY records are kept
+#define PROF_FRAME     0
+#define PROF_CLEAR     1
+#define PROF_TRANSFORM 2
+#define PROF_CLIP      3
+#define PROF_SETUP     4
+#define PROF_SPAN      5
+#define PROF_PRESENT   6
+#define PROF_STAGES    7
+#define PROFILE_HISTORY 128
+#define PROFILE_MAX_DEPTH 16
+
+//Span markers sit on a per row path, where two counter reads cost more
+//than the work they time. Only one in this many of them gets timed, along
+//with everything inside it, and stands in for the calls that weren't.
+//The pick is random, since counting would line up with the rows of same
+//sized triangles
+#define PROFILE_SAMPLE_RATE 64
+#define PROFILE_SAMPLED(stage) ((stage) == PROF_SPAN)
+
+//Rasterization counters, kept in the same per-frame record
+#define STAT_CLIP_IN       0  //Triangles handed to the clipper
+#define STAT_REJECTED      1  //Clipped away entirely by the near or far plane
+#define STAT_SPLIT_ONE     2  //Clipped into a single smaller triangle
+#define STAT_SPLIT_TWO     3  //Clipped into two triangles
+#define STAT_CULLED        4  //Facing away from the camera
+#define STAT_DRAWN         5  //Made it to triangle setup
+#define STAT_SMALL         6  //Small enough to skip the edge setup
+#define STAT_SPANS         7
+#define STAT_PIXELS        8  //Every pixel a span walked over
+#define STAT_OFFSCREEN     9
+#define STAT_DEPTH_FAILED  10
+#define STAT_WRITTEN       11
+#define STAT_SPRITES       12 //In front of the camera and at least partly on the screen
+#define STAT_PARTICLES     13 //With their centers on the screen
+#define STAT_LINES         14 //Past the outcode test and near and far clipping
+#define STATS              15
+
+typedef struct profile_frame {
+    Uint64 start;
+    Uint64 total[PROF_STAGES];
+    Sint64 self[PROF_STAGES]; //Sampled markers only come out right on average, so can dip below zero
+    unsigned int calls[PROF_STAGES];
+    unsigned int stats[STATS];
+    Uint64 busy[JOB_MAX_WORKERS]; //Time each worker spent running jobs
+    unsigned int jobs_run[JOB_MAX_WORKERS];
+    unsigned int steals[JOB_MAX_WORKERS];
+} profile_frame;
+
+//Every thread that hits markers keeps its own nesting and the record 
+//it is adding to. Only the main thread's record is in the history, the
+//others get merged into it once their work for the frame is done
+typedef struct profile_context {
+    profile_frame *current;
+    int depth;
+    int stack[PROFILE_MAX_DEPTH];
+    Uint64 start[PROFILE_MAX_DEPTH];
+    Uint64 child[PROFILE_MAX_DEPTH];
+    unsigned int scale[PROFILE_MAX_DEPTH]; //Calls a marker's time counts for, 0 when it isn't timed
+    unsigned int seed; //Random state for picking which markers to time
+} profile_context;
+
+typedef struct profiler {
+    profile_frame history[PROFILE_HISTORY];
+    profile_context main_context;
+    unsigned int frame_count;
+    Uint64 frequency;
+    int show_overlay;
+} profiler;
+
+//Workers other than the main thread profile into a record of their own
+//that gets merged into the frame once they've gone idle
+typedef struct job_worker {
+    int index;
+    SDL_Thread *thread;
+    job_deque deque;
+    profile_context context;
+    profile_frame record;
+    unsigned int seed; //Picks who to steal from first
+} job_worker;
+
+typedef struct job_system {
+    job_worker workers[JOB_MAX_WORKERS];
+    int count;
+    int next; //Where threads outside of the pool push their jobs
+    SDL_sem *wake;
+    SDL_atomic_t quit;
+} job_system;
+
+//Overrides for the triangles of a command. A NULL texture leaves each
+//triangle its own, the state always applies
+typedef struct material {
+    texture *t;
+    int state;
+} material;
+
+//A rectangle of texture that always faces the camera, centered on a
+//point and sized in world units. The ones in a raster list have their
+//center in view space instead
+typedef struct sprite {
+    float x;
+    float y;
+    float z;
+    float width;
+    float height;
+    texture *t;
+} sprite;
+
+//Where particles come from and what they start out as
+typedef struct emitter {
+    float x;
+    float y;
+    float z;
+    float vx;           //Starting velocity in units per second...
+    float vy;
+    float vz;
+    float spread;       //...give or take up to this much on each axis
+    float rate;         //Particles per second
+    float lifetime;     //Seconds
+    float gravity;      //Units per second squared, pulling down y
+    float size;         //World units across
+    unsigned int color; //RGB for particles without a texture
+    texture *t;         //Drawn as sprites when set, as flat squares when not
+} emitter;
+
+//Live particles with one array per attribute so that they can be
+//updated and projected several at a time
+typedef struct particle_system {
+    emitter e;
+    float *x;
+    float *y;
+    float *z;
+    float *vx;
+    float *vy;
+    float *vz;
+    float *life; //Seconds left
+    int count;
+    int capacity;
+    float owed;  //Fraction of a particle the rate has built up
+    float step;  //Seconds the update in progress moves them on by
+    unsigned int seed;
+} particle_system;
+
+//A segment drawn on top of everything that's in front of it without
+//hiding anything itself. Submitted ones are in world space and the
+//ones in a raster list are in view space, clipped to the near and far
+//planes
+typedef struct debug_line {
+    float x0;
+    float y0;
+    float z0;
+    float x1;
+    float y1;
+    float z1;
+    unsigned int color;
+} debug_line;
+
+//Lines that go in with one command. Clear count once the frame is done
+//with them to start the next batch
+typedef struct line_list {
+    debug_line *lines;
+    int count;
+    int capacity;
+} line_list;
+
+//What build_frame adds lines for on top of whatever got submitted
+#define DEBUG_VIEW_NONE      0
+#define DEBUG_VIEW_WIREFRAME 1 //Every triangle's edges after clipping
+#define DEBUG_VIEW_BOUNDS    2 //Object and BVH node boxes that survived culling
+#define DEBUG_VIEWS          3
+#define LINE_DEPTH_BIAS 0.005 //Share of view z lines are pulled in by, so the edges of a face win against it
+#define LINE_SLOPE_BIAS 2.0 //Steps worth of a line's own change in depth it gets pulled in by as well
+#define LINE_LIMIT 16777216.0 //Pixels away from the origin projected line ends are held to
+
+const char *debug_names[DEBUG_VIEWS] = { "none", "wireframe", "bounds" };
+
+//Takes object space into world space, rotating before translating
+typedef struct transform {
+    float m[3][3];
+    float x;
+    float y;
+    float z;
+} transform;
+
+#define COMMAND_TRIANGLE 0
+#define COMMAND_OBJECT   1
+#define COMMAND_BSP      2
+#define COMMAND_SPRITE   3
+#define COMMAND_PARTICLES 4
+#define COMMAND_LINES    5
+
+typedef struct draw_command {
+    int type;
+    void *target;
+    transform xf;
+    int has_transform;
+    material *mat;
+} draw_command;
+
+//Vertex positions with one array per axis so that they can be run
+//through the transform kernel several at a time
+typedef struct vertex_stream {
+    float *x;
+    float *y;
+    float *z;
+    unsigned char *outcode;
+    int count;
+    int capacity;
+} vertex_stream;
+
+//Which edges of the view volume a view space vertex is past. A triangle
+//with all three vertices past the same one can't touch the screen
+#define OUT_NEAR   1
+#define OUT_FAR    2
+#define OUT_LEFT   4
+#define OUT_RIGHT  8
+#define OUT_TOP    16
+#define OUT_BOTTOM 32
+#define OUT_GUARD  2    //Pixels of slack for vertices that round onto the screen edge
+#define TRANSFORM_GRAIN 4096 //Vertices per job once a stream is worth splitting up
+
+//Takes a stream to m * (v - pre) + post in place. With outcodes set
+//the results are view space and get tested against the view volume
+//of a camera with the given focal length
+typedef struct stream_transform {
+    float m[3][3];
+    float pre[3];
+    float post[3];
+    int outcodes;
+    float focal;
+    int width;   //Of the screen the outcodes are taken against
+    int height;
+    vertex_stream *s;
+} stream_transform;
+
+//A triangle that survived culling, waiting to be sorted and drawn
+typedef struct queued_triangle {
+    triangle *tri;
+    texture *t;
+    int state;
+    int command;
+    int sequence;
+} queued_triangle;
+
+//A blended triangle held back until everything opaque has been clipped,
+//so that it lands after whatever it covers in the raster list
+typedef struct deferred_triangle {
+    int index;   //Into the world triangles
+    float depth; //Sum of its vertices' view space z
+} deferred_triangle;
+
+//Clipped view space triangles ready for setup and rasterization, along
+//with the camera they were built for
+#ifdef LESTER_FIXED
+typedef fixed_triangle raster_triangle;
+#else
+typedef triangle raster_triangle;
+#endif
+
+//Indices into a raster list's sprites or the like, sorted by the bands
+//of scanlines they touch so that each band only looks at its own
+typedef struct band_bins {
+    int *starts;        //Where each band's entries start, and where the last one's end
+    int start_capacity;
+    int *entries;       //By band, the ones that cross bands in each of them
+    int entry_capacity;
+} band_bins;
+
+//The rows, clamped to the screen, that item i covers. Returns 0 when
+//it's off the screen altogether
+typedef int (*band_rows)(void *items, int i, int *top, int *bottom);
+
+//A flat colored square particle, projected already since that doesn't
+//depend on the screen size
+typedef struct raster_point {
+    float x;      //In half screen heights from the center
+    float y;
+    float z;      //View space
+    float radius; //Half of its size, in half screen heights
+    unsigned int color;
+} raster_point;
+
+typedef struct raster_list {
+    raster_triangle *tris;
+    int count;
+    int capacity;
+    int opaque; //How many of the triangles come before the blended ones
+    sprite *sprites; //Drawn between the opaque and the blended triangles
+    int sprite_count;
+    int sprite_capacity;
+    band_bins sprite_bins;
+    raster_point *points; //Along with the sprites
+    int point_count;
+    int point_capacity;
+    band_bins point_bins;
+    debug_line *lines; //Last of all, over the blended triangles
+    int line_count;
+    int line_capacity;
+    camera cam;
+    unsigned int clear_color;
+} raster_list;
+
+//Everything submitted between begin_frame and end_frame. When pipelined,
+//a geometry thread turns the commands into one raster list while the 
+//previous frame's list gets rasterized, so frames come out one late
+typedef struct command_buffer {
+    camera cam;
+    unsigned int clear_color;
+    draw_command *commands;
+    int command_count;
+    int command_capacity;
+    queued_triangle *queue;
+    int queue_count;
+    int queue_capacity;
+    int sort_by_texture;
+    triangle *world;    //Queued triangles that survived backface culling, in world space
+    int world_capacity;
+    deferred_triangle *blended; //Of those, the ones drawn back to front once the rest are in
+    vertex_stream view; //Their vertices, three apiece, taken to view space in one batch
+    vertex_stream batch; //Particle positions and line ends, taken to view space a batch at a time
+    line_list debug_lines; //What the debug view adds, in world space
+    int debug_view;
+    raster_list lists[2];
+    int ready; //The list the next end_frame rasterizes
+    int pipelined;
+    int busy;
+    int quit;
+    SDL_Thread *geometry_thread;
+    SDL_sem *geometry_start;
+    SDL_sem *geometry_done;
+    raster_list *building;
+    profile_context geometry_context;
+    profile_frame geometry_record;
+} command_buffer;
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+//Build with -DLESTER_NO_PROFILE to compile the markers out entirely
+#ifdef LESTER_NO_PROFILE
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END()
+#define STAT_ADD(stat, n) ((void)(n)) //Keeps if bodies non-empty and counts used
+#else
+#define PROFILE_BEGIN(stage) profile_begin(stage)
+#define PROFILE_END() profile_end()
+#define STAT_ADD(stat, n) (prof_context->current->stats[stat] += (n))
+#endif
+
 #define list_for_each(l, i, n) for((i) = (l)->root, (n) = 0; (i) != NULL; (i) = (i)->next, (n)++)
 #define new(x) ((x*)malloc(sizeof(x)))
 
-void clear_zbuf() {
-    
-    memset((void*)zbuf, 255, SCREEN_PIXELS*2);  
-}
+frustum view_frustum;
+profiler prof;
+THREAD_LOCAL profile_context *prof_context;
+THREAD_LOCAL raster_list *raster_target; //Where clipping sends its output, drawn right away when NULL
+THREAD_LOCAL int raster_top = 0, raster_bottom = RASTER_ALL; //The scanlines the thread may draw to
+job_system jobs;
+THREAD_LOCAL int job_worker_index = -1; //-1 outside of the pool
 
-int init_zbuf() {
-    
-    zbuf = (unsigned short*)malloc(SCREEN_PIXELS*2);
-    
-    if(!zbuf)
-        return 0;
+const char *prof_names[PROF_STAGES] = { "FRAME", "CLEAR", "XFORM", "CLIP", "SETUP", "SPAN", "PRESENT" };
+const unsigned int prof_colors[PROF_STAGES] = { 0x808080, 0x4060FF, 0x40FF40, 0xFFFF40, 0xFF8020, 0xFF4040, 0xC040FF };
+const char *stat_names[STATS] = { "TRIS IN", "REJECTED", "SPLIT 1", "SPLIT 2", "CULLED", "DRAWN", "SMALL", "SPANS", "PIXELS", "OFFSCREEN", "ZFAIL", "WRITTEN", "SPRITES", "PARTICLES", "LINES" };
+
+//3x5 glyphs for the overlay, one octal digit per row with the
+//high bit on the left
+const char *font_chars = "0123456789.ACDEFHIJLMNOPRSTUVWXZ";
+const unsigned short font_glyphs[] = {
+    075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717, 
+    000002, 025755, 074447, 065556, 074647, 074644, 055755, 072227, 011157, 044447, 
+    057755, 065555, 075557, 065644, 065655, 074717, 072222, 055557, 055552, 055775, 
+    055255, 071247
+};
+
+//Point the calling thread's markers at ctx, which adds to record
+void profile_attach(profile_context *ctx, profile_frame *record) {
     
-    clear_zbuf();  
-        
-    return 1;
+    memset((void*)ctx, 0, sizeof(profile_context));
+    ctx->current = record;
+    prof_context = ctx;
 }
 
-void clone_color(color* src, color* dst) {
+void init_profiler() {
     
-    dst->r = src->r;
-    dst->g = src->g;
-    dst->b = src->b;
-    dst->a = src->a;
+    memset((void*)&prof, 0, sizeof(profiler));
+    prof.frequency = SDL_GetPerformanceFrequency();
+    profile_attach(&prof.main_context, &prof.history[0]);
 }
 
-node *list_get_last(list *target) {
+//Markers nest, so each one remembers how much of its time was spent
+//in the markers below it to be able to report its own time separately
+void profile_begin(int stage) {
     
-    int i;
-    node *list_node;
+    profile_context *ctx = prof_context;
+    unsigned int scale = ctx->depth > 0 && ctx->depth <= PROFILE_MAX_DEPTH ? ctx->scale[ctx->depth - 1] : 1;
     
-    list_for_each(target, list_node, i) {
+    if(ctx->depth < PROFILE_MAX_DEPTH) {
         
-        if(list_node->next == NULL)
-            return list_node;
+        //Markers inside a sampled one go along with its decision
+        if(scale == 1 && PROFILE_SAMPLED(stage)) {
+            
+            ctx->seed = ctx->seed * 1103515245 + 12345;
+            scale = (ctx->seed >> 16) % PROFILE_SAMPLE_RATE ? 0 : PROFILE_SAMPLE_RATE;
+        }
+            
+        ctx->stack[ctx->depth] = stage;
+        ctx->child[ctx->depth] = 0;
+        ctx->scale[ctx->depth] = scale;
+        
+        if(scale)
+            ctx->start[ctx->depth] = SDL_GetPerformanceCounter();
     }
     
-    return NULL;
+    ctx->depth++;
 }
 
-void list_push(list *target, void* item) {
+void profile_end() {
     
-    node *last     = list_get_last(target);
-    node *new_node = new(node);
-
-    if(!new_node) 
-         return;
+    profile_context *ctx = prof_context;
+    Uint64 elapsed;
+    profile_frame *f;
+    int stage;
+    unsigned int scale;
     
-
-    new_node->payload = item;
-    new_node->next = NULL;
+    ctx->depth--;
+    
+    if(ctx->depth >= PROFILE_MAX_DEPTH || ctx->depth < 0)
+        return;
+    
+    stage = ctx->stack[ctx->depth];
+    scale = ctx->scale[ctx->depth];
+    f = ctx->current;
+    f->calls[stage]++;
+    
+    if(!scale)
+        return;
         
-    if(!last) {
-     
-        target->root = new_node;
-    } else {      
-     
-        last->next = new_node;
-    }
+    elapsed = SDL_GetPerformanceCounter() - ctx->start[ctx->depth];
+    f->total[stage] += elapsed * scale;
+    f->self[stage] += ((Sint64)elapsed - (Sint64)ctx->child[ctx->depth]) * scale;
+    
+    //A parent timed on every call gets this one's share of the calls it
+    //stands in for, one timed along with it shares its scale
+    if(ctx->depth)
+        ctx->child[ctx->depth - 1] += elapsed * scale / ctx->scale[ctx->depth - 1];
 }
 
-void dump_list(list *target) {
+//Fold another thread's record into the calling thread's and reset it.
+//The other thread has to be idle while this happens
+void profile_merge(profile_frame *src) {
     
-    node *item;
+    profile_frame *dst = prof_context->current;
+    int i;
     
-    printf("list.root = 0x%08x\n", (unsigned int)target->root);
-    item = target->root;
+    for(i = 0; i < PROF_STAGES; i++) {
+        
+        dst->total[i] += src->total[i];
+        dst->self[i] += src->self[i];
+        dst->calls[i] += src->calls[i];
+    }
     
-    while(item) {
+    for(i = 0; i < STATS; i++)
+        dst->stats[i] += src->stats[i];
         
-        printf("   Item 0x%08x:\n", (unsigned int)item);
-        printf("      payload: 0x%08x\n", (unsigned int)item->payload);
-        printf("      next: 0x%08x\n", (unsigned int)item->next);
-        item = item->next;
+    for(i = 0; i < JOB_MAX_WORKERS; i++) {
+        
+        dst->busy[i] += src->busy[i];
+        dst->jobs_run[i] += src->jobs_run[i];
+        dst->steals[i] += src->steals[i];
     }
+        
+    memset((void*)src, 0, sizeof(profile_frame));
 }
 
-color *new_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+void profile_begin_frame() {
     
-    color *ret_color = new(color);
+    profile_context *ctx = &prof.main_context;
     
-    if(!ret_color)
-        return ret_color;
+    ctx->current = &prof.history[prof.frame_count % PROFILE_HISTORY];
+    memset((void*)ctx->current, 0, sizeof(profile_frame));
+    ctx->depth = 0;
+    ctx->current->start = SDL_GetPerformanceCounter();
+    PROFILE_BEGIN(PROF_FRAME);
+}
+
+void profile_end_frame() {
     
-    ret_color->r = r;
-    ret_color->g = g;
-    ret_color->b = b;
-    ret_color->a = a;
+    PROFILE_END();
+    prof.frame_count++;
+}
+
+float profile_ms(Uint64 ticks) {
     
-    return ret_color;
+    return prof.frequency ? (ticks * 1000.0) / prof.frequency : 0;
 }
 
-void clone_vertex(vertex *src, vertex* dst) {
+//How many finished frames are in the history. The slot after the
+//newest one is being filled in by the frame in progress
+int profile_frames() {
     
-    dst->x = src->x;
-    dst->y = src->y;
-    dst->z = src->z;
-    dst->c = src->c;
+    return prof.frame_count < PROFILE_HISTORY - 1 ? prof.frame_count : PROFILE_HISTORY - 1;
 }
 
-unsigned int test_data[] = {
-    0xFF8080, 0xFF6060, 0xFF4040, 0xFF2020, 0xFF0000, 0xD00000, 0xB00000, 0x900000, 0x700000, 0x500000,
-    0xFFFF80, 0xFFE060, 0xFFC040, 0xFFA020, 0xFF8000, 0xD06000, 0xB04000, 0x902000, 0x700000, 0x500000,
-    0xFFFF80, 0xFFFF60, 0xFFFF40, 0xFFFF20, 0xFFFF00, 0xD0D000, 0xB0B000, 0x909000, 0x707000, 0x505000,
-    0x80FF80, 0x60FF60, 0x40FF40, 0x20FF20, 0x00FF00, 0x00D000, 0x00B000, 0x009000, 0x007000, 0x005000,
-    0x8080FF, 0x6060FF, 0x4040FF, 0x2020FF, 0x0000FF, 0x0000D0, 0x0000B0, 0x000090, 0x000070, 0x000050,
-    0xFF80FF, 0xE060FF, 0xC040FF, 0xA020FF, 0x8000FF, 0x6000D0, 0x4000B0, 0x200090, 0x000070, 0x000050,
-    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020,
-    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020,
-    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020,
-    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020
-};
-texture *new_texture(unsigned char* texture_file) {
+//Finished frames, oldest first
+profile_frame *profile_history(int index) {
     
-    texture *ret_texture = new(texture);
+    return &prof.history[(prof.frame_count - profile_frames() + index) % PROFILE_HISTORY];
+}
+
+void draw_text(SDL_Renderer *r, int x, int y, int scale, char *str) {
     
-    if(!ret_texture)
-        return ret_texture;
-        
-    ret_texture->height = 10;
-    ret_texture->width = 10;
-    ret_texture->data = test_data;
+    int row, col;
+    const char *found;
+    unsigned short glyph;
+    SDL_Rect px;
     
-    return ret_texture;
+    px.w = px.h = scale;
+    
+    for(; *str; str++, x += 4 * scale) {
+        
+        if(*str == ' ' || !(found = strchr(font_chars, *str)))
+            continue;
+            
+        glyph = font_glyphs[found - font_chars];
+        
+        for(row = 0; row < 5; row++) {
+            
+            for(col = 0; col < 3; col++) {
+                
+                if(!(glyph & (1 << ((4 - row) * 3 + (2 - col)))))
+                    continue;
+                    
+                px.x = x + col * scale;
+                px.y = y + row * scale;
+                SDL_RenderFillRect(r, &px);
+            }
+        }
+    }
 }
 
-triangle *new_triangle(vertex *v1, vertex *v2, vertex *v3, texture *t) {
+//Draw each stage's own time and the raster counters averaged over
+//the history along with a graph of the total frame time, 16.6ms 
+//being the top of the graph
+void draw_profile_overlay(SDL_Renderer *r) {
     
-    triangle *ret_tri = new(triangle);
+    int i, stage, frames, height, y;
+    Sint64 self[PROF_STAGES];
+    Uint64 busy[JOB_MAX_WORKERS], elapsed = 0;
+    unsigned int jobs_run[JOB_MAX_WORKERS], steals[JOB_MAX_WORKERS];
+    double stats[STATS];
+    profile_frame *f;
+    SDL_Rect bar;
+    char line[64];
+    float ms, frame_ms;
     
-    if(!ret_tri)
-        return ret_tri;
+    if(!(frames = profile_frames()))
+        return;
+    
+    memset((void*)self, 0, sizeof(self));
+    memset((void*)stats, 0, sizeof(stats));
+    memset((void*)busy, 0, sizeof(busy));
+    memset((void*)jobs_run, 0, sizeof(jobs_run));
+    memset((void*)steals, 0, sizeof(steals));
+    
+    for(i = 0; i < frames; i++) {
         
-    clone_vertex(v1, &(ret_tri->v[0]));
-    clone_vertex(v2, &(ret_tri->v[1]));
-    clone_vertex(v3, &(ret_tri->v[2]));
-    ret_tri->t = t;    
+        f = profile_history(i);
+        elapsed += f->total[PROF_FRAME];
+        
+        for(stage = 0; stage < PROF_STAGES; stage++)
+            self[stage] += f->self[stage];
+            
+        for(stage = 0; stage < STATS; stage++)
+            stats[stage] += f->stats[stage];
+            
+        for(stage = 0; stage < JOB_MAX_WORKERS; stage++) {
+            
+            busy[stage] += f->busy[stage];
+            jobs_run[stage] += f->jobs_run[stage];
+            steals[stage] += f->steals[stage];
+        }
+    }
     
-    return ret_tri;
-}
-
-void purge_list(list *target) {
+    for(stage = 0; stage < STATS; stage++)
+        stats[stage] /= frames;
     
-    node *temp_node, *next_node;
+    SDL_SetRenderDrawColor(r, 0x00, 0x00, 0x00, 0xFF);
+    bar.x = 4; bar.y = 4; bar.w = 260; bar.h = (PROF_STAGES + STATS + jobs.count + 6) * 14 + 72;
+    SDL_RenderFillRect(r, &bar);
     
-    for(temp_node = target->root; temp_node != NULL;) {
-        next_node = temp_node->next;
-        free(temp_node);
-        temp_node = next_node;
+    for(stage = 0, y = 8; stage < PROF_STAGES; stage++, y += 14) {
+        
+        ms = profile_ms(self[stage] > 0 ? self[stage] : 0) / frames;
+        SDL_SetRenderDrawColor(r, prof_colors[stage] >> 16, (prof_colors[stage] >> 8) & 0xFF, prof_colors[stage] & 0xFF, 0xFF);
+        sprintf(line, "%-8s%6.2f MS", stage == PROF_FRAME ? "OTHER" : prof_names[stage], ms);
+        draw_text(r, 8, y, 2, line);
+        bar.x = 168; bar.y = y; bar.h = 10;
+        bar.w = (int)(ms * 6);
+        bar.w = bar.w > 92 ? 92 : bar.w;
+        SDL_RenderFillRect(r, &bar);
     }
-}
-
-void delete_object(object *obj) {
     
-    node *item;
-    int i;
+    //Overdraw is written pixels per screen pixel and clip amplification
+    //is how many triangles reach setup for every one handed to the clipper,
+    //followed by the size frames are being drawn at
+    SDL_SetRenderDrawColor(r, 0xFF, 0xFF, 0xFF, 0xFF);
+    y += 14;
     
-    list_for_each(&(obj->tri_list), item, i) {
+    for(stage = 0; stage < STATS; stage++, y += 14) {
         
-        free(item->payload);
+        sprintf(line, "%-10s%9.0f", stat_names[stage], stats[stage]);
+        draw_text(r, 8, y, 2, line);
     }
     
-    purge_list(&(obj->tri_list));
-    free(obj);
-}
-
-object *new_object() {
+    sprintf(line, "%-10s%9.2f", "OVERDRAW", stats[STAT_WRITTEN] / screen.pixels);
+    draw_text(r, 8, y, 2, line);
+    y += 14;
+    sprintf(line, "%-10s%9.2f", "CLIP AMP", stats[STAT_CLIP_IN] ? stats[STAT_DRAWN] / stats[STAT_CLIP_IN] : 0);
+    draw_text(r, 8, y, 2, line);
+    y += 14;
+    sprintf(line, "%-10s%4dX%-4d", "RES", screen.width, screen.height);
+    draw_text(r, 8, y, 2, line);
+    y += 28;
     
-    object *ret_obj = new(object);
+    //How busy each worker kept itself as a percentage of the frame, with
+    //the jobs it ran and how many of those it stole, per frame
+    if(jobs.count) {
+        
+        draw_text(r, 8, y, 2, "CPU   USE   RUN STOLEN");
+        y += 14;
+    }
     
-    if(!ret_obj)
-        return ret_obj;
+    for(i = 0; i < jobs.count; i++, y += 14) {
         
-    ret_obj->tri_list.root = NULL;
-    ret_obj->x = ret_obj->y = ret_obj->z = 0.0;
+        sprintf(line, "%-4d%6.1f%6.1f%7.1f", i, elapsed ? (busy[i] * 100.0) / elapsed : 0, (float)jobs_run[i] / frames, (float)steals[i] / frames);
+        draw_text(r, 8, y, 2, line);
+    }
     
-    return ret_obj;
-}
+    y += 64;
+    
+    //Oldest frame on the left
+    for(i = 0; i < frames; i++) {
+        
+        f = profile_history(i);
+        frame_ms = profile_ms(f->total[PROF_FRAME]);
+        height = (int)((frame_ms * 60) / 16.6);
+        height = height > 60 ? 60 : height;
+        SDL_SetRenderDrawColor(r, frame_ms > 16.6 ? 0xFF : 0x40, frame_ms > 16.6 ? 0x40 : 0xFF, 0x40, 0xFF);
+        SDL_RenderDrawLine(r, 8 + i * 2, y, 8 + i * 2, y - height);
+    }
+}
+
+//Write the history out in the Chrome trace event format. Every frame
+//is an event of its own and the stage times are attached as counters
+//since only their per-frame sums are recorded
+int dump_profile_trace(char *filename) {
+    
+    FILE *out;
+    int i, stage, frames;
+    profile_frame *f, *first;
+    
+    if(!(frames = profile_frames())) {
+        
+        printf("[dump_profile_trace] No frames have been profiled yet\n");
+        return 0;
+    }
+    
+    if(!(out = fopen(filename, "w"))) {
+        
+        printf("[dump_profile_trace] Could not open %s\n", filename);
+        return 0;
+    }
+    
+    first = profile_history(0);
+    fprintf(out, "{\"traceEvents\":[\n");
+    
+    for(i = 0; i < frames; i++) {
+        
+        f = profile_history(i);
+        fprintf(out, "{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f},\n", 
+                profile_ms(f->start - first->start) * 1000.0, profile_ms(f->total[PROF_FRAME]) * 1000.0);
+        fprintf(out, "{\"name\":\"stages\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{", profile_ms(f->start - first->start) * 1000.0);
+        
+        for(stage = 0; stage < PROF_STAGES; stage++)
+            fprintf(out, "%s\"%s\":%.4f", stage ? "," : "", stage == PROF_FRAME ? "OTHER" : prof_names[stage], profile_ms(f->self[stage] > 0 ? f->self[stage] : 0));
+        
+        fprintf(out, "}},\n{\"name\":\"raster\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{", profile_ms(f->start - first->start) * 1000.0);
+        
+        for(stage = 0; stage < STATS; stage++)
+            fprintf(out, "%s\"%s\":%u", stage ? "," : "", stat_names[stage], f->stats[stage]);
+        
+        fprintf(out, "}},\n{\"name\":\"workers\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{", profile_ms(f->start - first->start) * 1000.0);
+        
+        for(stage = 0; stage < jobs.count; stage++)
+            fprintf(out, "%s\"CPU %d\":%.4f", stage ? "," : "", stage, profile_ms(f->busy[stage]));
+        
+        fprintf(out, "}}%s\n", i == frames - 1 ? "" : ",");
+    }
+    
+    fprintf(out, "],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(out);
+    printf("Wrote %d frames of profile data to %s\n", frames, filename);
+    
+    return 1;
+}
+
+int job_push(job_deque *d, job *j) {
+    
+    int pushed = 0;
+    
+    SDL_LockMutex(d->lock);
+    
+    if(d->bottom - d->top < JOB_DEQUE_SIZE) {
+        
+        d->jobs[d->bottom & (JOB_DEQUE_SIZE - 1)] = *j;
+        d->bottom++;
+        pushed = 1;
+    }
+    
+    SDL_UnlockMutex(d->lock);
+    
+    return pushed;
+}
+
+//The owner takes the newest job, which is the likeliest to still be
+//in its cache
+int job_pop(job_deque *d, job *j) {
+    
+    int popped = 0;
+    
+    SDL_LockMutex(d->lock);
+    
+    if(d->bottom != d->top) {
+        
+        d->bottom--;
+        *j = d->jobs[d->bottom & (JOB_DEQUE_SIZE - 1)];
+        popped = 1;
+    }
+    
+    SDL_UnlockMutex(d->lock);
+    
+    return popped;
+}
+
+//Thieves take the oldest, which tends to be the biggest chunk of work
+int job_steal(job_deque *d, job *j) {
+    
+    int stolen = 0;
+    
+    SDL_LockMutex(d->lock);
+    
+    if(d->bottom != d->top) {
+        
+        *j = d->jobs[d->top & (JOB_DEQUE_SIZE - 1)];
+        d->top++;
+        stolen = 1;
+    }
+    
+    SDL_UnlockMutex(d->lock);
+    
+    return stolen;
+}
+
+//Look in the calling thread's own deque first, then go around everyone
+//else's starting from a random one so thieves don't pile onto the same
+int job_find(job *j, int *stolen) {
+    
+    int i, victim, first;
+    
+    *stolen = 0;
+    
+    if(job_worker_index >= 0 && job_pop(&jobs.workers[job_worker_index].deque, j))
+        return 1;
+    
+    if(job_worker_index >= 0) {
+        
+        jobs.workers[job_worker_index].seed = jobs.workers[job_worker_index].seed * 1103515245 + 12345;
+        first = (jobs.workers[job_worker_index].seed >> 16) % jobs.count;
+    } else {
+        
+        first = 0;
+    }
+    
+    for(i = 0; i < jobs.count; i++) {
+        
+        victim = (first + i) % jobs.count;
+        
+        if(victim != job_worker_index && job_steal(&jobs.workers[victim].deque, j)) {
+            
+            *stolen = 1;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+//Everything a job records has to happen before its counter drops, since
+//that is what lets whoever waited on it read the records
+void job_execute(job *j, int stolen) {
+    
+    Uint64 start = SDL_GetPerformanceCounter();
+    profile_frame *f;
+    
+    j->run(j->data, j->start, j->end);
+    
+    if(job_worker_index >= 0) {
+        
+        f = prof_context->current;
+        f->busy[job_worker_index] += SDL_GetPerformanceCounter() - start;
+        f->jobs_run[job_worker_index]++;
+        f->steals[job_worker_index] += stolen;
+    }
+    
+    if(j->counter)
+        SDL_AtomicAdd(&(j->counter->pending), -1);
+}
+
+int job_worker_thread(void *data) {
+    
+    job_worker *w = (job_worker*)data;
+    job j;
+    int stolen;
+    
+    job_worker_index = w->index;
+    profile_attach(&w->context, &w->record);
+    
+    while(1) {
+        
+        SDL_SemWait(jobs.wake);
+        
+        if(SDL_AtomicGet(&jobs.quit))
+            break;
+            
+        while(job_find(&j, &stolen))
+            job_execute(&j, stolen);
+    }
+    
+    return 0;
+}
+
+void shutdown_jobs() {
+    
+    int i;
+    
+    SDL_AtomicSet(&jobs.quit, 1);
+    
+    for(i = 1; i < jobs.count; i++)
+        SDL_SemPost(jobs.wake);
+        
+    //Everyone has to be gone before the deques go, since a worker on its
+    //way out may still be trying to steal
+    for(i = 0; i < JOB_MAX_WORKERS; i++)
+        if(jobs.workers[i].thread)
+            SDL_WaitThread(jobs.workers[i].thread, NULL);
+            
+    for(i = 0; i < JOB_MAX_WORKERS; i++)
+        if(jobs.workers[i].deque.lock)
+            SDL_DestroyMutex(jobs.workers[i].deque.lock);
+    
+    if(jobs.wake)
+        SDL_DestroySemaphore(jobs.wake);
+        
+    memset((void*)&jobs, 0, sizeof(job_system));
+}
+
+//Start a pool of threads workers, counting the calling thread, or one
+//per core when threads is 0
+int init_jobs(int threads) {
+    
+    int i;
+    
+    memset((void*)&jobs, 0, sizeof(job_system));
+    threads = threads > 0 ? threads : SDL_GetCPUCount();
+    threads = threads < 1 ? 1 : threads > JOB_MAX_WORKERS ? JOB_MAX_WORKERS : threads;
+    
+    if(!(jobs.wake = SDL_CreateSemaphore(0))) {
+        
+        printf("[init_jobs] Could not create a semaphore: %s\n", SDL_GetError());
+        return 0;
+    }
+    
+    for(i = 0; i < threads; i++) {
+        
+        jobs.workers[i].index = i;
+        jobs.workers[i].seed = i + 1;
+        
+        if(!(jobs.workers[i].deque.lock = SDL_CreateMutex())) {
+            
+            printf("[init_jobs] Could not create a mutex: %s\n", SDL_GetError());
+            shutdown_jobs();
+            return 0;
+        }
+    }
+    
+    jobs.count = threads;
+    job_worker_index = 0;
+    
+    for(i = 1; i < threads; i++) {
+        
+        if(!(jobs.workers[i].thread = SDL_CreateThread(job_worker_thread, "worker", &jobs.workers[i]))) {
+            
+            printf("[init_jobs] Could not create worker %d: %s\n", i, SDL_GetError());
+            shutdown_jobs();
+            job_worker_index = -1;
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+//Queue up a job that counts counter down once it's done. Without a 
+//pool, or when the deque is full, it gets run on the spot
+void run_job(job_function run, void *data, int start, int end, job_counter *counter) {
+    
+    job j;
+    job_deque *d;
+    
+    j.run = run;
+    j.data = data;
+    j.start = start;
+    j.end = end;
+    j.counter = counter;
+    
+    if(counter)
+        SDL_AtomicAdd(&(counter->pending), 1);
+    
+    if(!jobs.count) {
+        
+        job_execute(&j, 0);
+        return;
+    }
+    
+    if(job_worker_index >= 0)
+        d = &jobs.workers[job_worker_index].deque;
+    else
+        d = &jobs.workers[(jobs.next++) % jobs.count].deque;
+    
+    if(!job_push(d, &j)) {
+        
+        job_execute(&j, 0);
+        return;
+    }
+    
+    SDL_SemPost(jobs.wake);
+}
+
+//Help out with whatever jobs there are until counter runs out. Jobs can
+//wait on jobs of their own this way without tying up a worker
+void wait_for_counter(job_counter *counter) {
+    
+    job j;
+    int stolen;
+    
+    while(SDL_AtomicGet(&(counter->pending))) {
+        
+        if(job_find(&j, &stolen))
+            job_execute(&j, stolen);
+        else
+            SDL_Delay(0);
+    }
+}
+
+//Split count items into jobs of grain items each and wait for all of 
+//them to finish
+void parallel_for(job_function run, void *data, int count, int grain) {
+    
+    job_counter counter;
+    int start;
+    
+    SDL_AtomicSet(&(counter.pending), 0);
+    grain = grain < 1 ? 1 : grain;
+    
+    for(start = 0; start < count; start += grain)
+        run_job(run, data, start, start + grain > count ? count : start + grain, &counter);
+        
+    wait_for_counter(&counter);
+}
+
+//Fold the other workers' profile records into the calling thread's. No
+//jobs can be in flight while this happens
+void merge_job_profiles() {
+    
+    int i;
+    
+    for(i = 1; i < jobs.count; i++)
+        profile_merge(&jobs.workers[i].record);
+}
+
+//The size isn't known until runtime, so the fill goes through the 
+//vector macros rather than relying on the compiler to widen it
+void fill_words(unsigned int *dst, int count, unsigned int value) {
+    
+    int i = 0;
+#ifdef SIMD_WIDTH
+    simd_float fill = simd_bits(value);
+    
+    for(; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+        simd_store((float*)&dst[i], fill);
+#endif
+    
+    for(; i < count; i++)
+        dst[i] = value;
+}
+
+//Everything ends up as far away as the format can say
+void clear_zbuf() {
+    
+    float far = SCREEN_DEPTH;
+    unsigned int bits;
+    
+    switch(screen.depth_format) {
+        
+        case DEPTH_LINEAR16:
+            memset(screen.zbuf, 255, screen.pixels*2);
+            break;
+            
+        case DEPTH_FLOAT32:
+            memcpy((void*)&bits, (void*)&far, 4);
+            fill_words((unsigned int*)screen.zbuf, screen.pixels, bits);
+            break;
+            
+        case DEPTH_REVERSED:
+            memset(screen.zbuf, 0, screen.pixels*4);
+            break;
+    }
+}
+
+void clear_fbuf(unsigned int color) {
+    
+    fill_words(screen.fbuf, screen.pixels, color);
+}
+
+//Draw at width x height from here on, clamped to the full size
+void set_screen_size(int width, int height) {
+    
+    screen.width = width < 1 ? 1 : width > screen.full_width ? screen.full_width : width;
+    screen.height = height < 1 ? 1 : height > screen.full_height ? screen.full_height : height;
+    screen.pixels = screen.width * screen.height;
+}
+
+int init_screen(int width, int height, int depth_format) {
+    
+    if(width < 1 || height < 1) {
+        
+        printf("[init_screen] Bad resolution %dx%d\n", width, height);
+        return 0;
+    }
+    
+    if(depth_format < 0 || depth_format >= DEPTH_FORMATS) {
+        
+        printf("[init_screen] Unknown depth format, use one of linear16, float32 or reversed\n");
+        return 0;
+    }
+    
+#ifdef LESTER_FIXED
+    //The fixed point spans only know integer depth
+    if(depth_format != DEPTH_LINEAR16) {
+        
+        printf("[init_screen] The fixed point build only supports linear16 depth\n");
+        return 0;
+    }
+#endif
+    
+    screen.depth_format = depth_format;
+    screen.full_width = width;
+    screen.full_height = height;
+    screen.scale = 1.0;
+    screen.budget = 0.0;
+    set_screen_size(width, height);
+    screen.zbuf = malloc(screen.pixels * depth_bytes[depth_format]);
+    screen.fbuf = (unsigned int*)malloc(screen.pixels*4);
+    
+    if(!screen.zbuf || !screen.fbuf) {
+        
+        free(screen.zbuf);
+        free(screen.fbuf);
+        screen.zbuf = NULL;
+        screen.fbuf = NULL;
+        return 0;
+    }
+    
+    clear_zbuf();
+    clear_fbuf(0xFF000000);
+    
+    return 1;
+}
+
+//Swap the depth buffer for one in another format, cleared. Nothing can
+//be drawing into the old one
+int set_depth_format(int depth_format) {
+    
+    void *zbuf;
+    
+    if(depth_format == screen.depth_format)
+        return 1;
+        
+#ifdef LESTER_FIXED
+    if(depth_format != DEPTH_LINEAR16) {
+        
+        printf("[set_depth_format] The fixed point build only supports linear16 depth\n");
+        return 0;
+    }
+#endif
+    
+    if(depth_format < 0 || depth_format >= DEPTH_FORMATS) {
+        
+        printf("[set_depth_format] Unknown depth format %d\n", depth_format);
+        return 0;
+    }
+    
+    if(!(zbuf = realloc(screen.zbuf, screen.full_width * screen.full_height * depth_bytes[depth_format]))) {
+        
+        printf("[set_depth_format] Could not allocate the depth buffer\n");
+        return 0;
+    }
+    
+    screen.zbuf = zbuf;
+    screen.depth_format = depth_format;
+    clear_zbuf();
+    
+    return 1;
+}
+
+//Aim for budget ms a frame, or for the full size when it's 0
+void set_frame_budget(float budget) {
+    
+    screen.budget = budget;
+    screen.average_ms = budget;
+    screen.scale = 1.0;
+    set_screen_size(screen.full_width, screen.full_height);
+}
+
+//Feed in how long the last frame took. Pixels are most of the cost so
+//the time is taken to go with the square of the scale, and nothing 
+//changes while the average sits between the headroom and the budget
+//so the picture doesn't pump
+void update_dynamic_resolution(float frame_ms) {
+    
+    float ideal, step;
+    
+    if(screen.budget <= 0.0)
+        return;
+        
+    screen.average_ms += (frame_ms - screen.average_ms) * DYNRES_SMOOTHING;
+    
+    if(screen.average_ms <= screen.budget && (screen.average_ms >= screen.budget * DYNRES_HEADROOM || screen.scale >= 1.0))
+        return;
+        
+    ideal = screen.scale * sqrt((screen.budget * (1.0 + DYNRES_HEADROOM) / 2.0) / screen.average_ms);
+    step = ideal - screen.scale;
+    step = step > DYNRES_STEP ? DYNRES_STEP : step < -DYNRES_STEP ? -DYNRES_STEP : step;
+    screen.scale += step;
+    screen.scale = screen.scale < DYNRES_MIN_SCALE ? DYNRES_MIN_SCALE : screen.scale > 1.0 ? 1.0 : screen.scale;
+    set_screen_size((int)(screen.full_width * screen.scale + 0.5), (int)(screen.full_height * screen.scale + 0.5));
+}
+
+void raster_list_add(raster_list *list, raster_triangle *tri) {
+    
+    raster_triangle *grown;
+    int capacity;
+    
+    if(list->count == list->capacity) {
+        
+        capacity = list->capacity ? list->capacity * 2 : 1024;
+        
+        if(!(grown = (raster_triangle*)realloc(list->tris, capacity * sizeof(raster_triangle)))) {
+            
+            printf("[raster_list_add] Could not grow the raster list to %d triangles\n", capacity);
+            return;
+        }
+        
+        list->tris = grown;
+        list->capacity = capacity;
+    }
+    
+    list->tris[list->count++] = *tri;
+}
+
+void raster_list_add_sprite(raster_list *list, sprite *spr) {
+    
+    sprite *grown;
+    int capacity;
+    
+    if(list->sprite_count == list->sprite_capacity) {
+        
+        capacity = list->sprite_capacity ? list->sprite_capacity * 2 : 256;
+        
+        if(!(grown = (sprite*)realloc(list->sprites, capacity * sizeof(sprite)))) {
+            
+            printf("[raster_list_add_sprite] Could not grow the raster list to %d sprites\n", capacity);
+            return;
+        }
+        
+        list->sprites = grown;
+        list->sprite_capacity = capacity;
+    }
+    
+    list->sprites[list->sprite_count++] = *spr;
+}
+
+void raster_list_add_point(raster_list *list, raster_point *p) {
+    
+    raster_point *grown;
+    int capacity;
+    
+    if(list->point_count == list->point_capacity) {
+        
+        capacity = list->point_capacity ? list->point_capacity * 2 : 4096;
+        
+        if(!(grown = (raster_point*)realloc(list->points, capacity * sizeof(raster_point)))) {
+            
+            printf("[raster_list_add_point] Could not grow the raster list to %d points\n", capacity);
+            return;
+        }
+        
+        list->points = grown;
+        list->point_capacity = capacity;
+    }
+    
+    list->points[list->point_count++] = *p;
+}
+
+void raster_list_add_line(raster_list *list, debug_line *l) {
+    
+    debug_line *grown;
+    int capacity;
+    
+    if(list->line_count == list->line_capacity) {
+        
+        capacity = list->line_capacity ? list->line_capacity * 2 : 1024;
+        
+        if(!(grown = (debug_line*)realloc(list->lines, capacity * sizeof(debug_line)))) {
+            
+            printf("[raster_list_add_line] Could not grow the raster list to %d lines\n", capacity);
+            return;
+        }
+        
+        list->lines = grown;
+        list->line_capacity = capacity;
+    }
+    
+    list->lines[list->line_count++] = *l;
+}
+
+int add_line(line_list *list, float x0, float y0, float z0, float x1, float y1, float z1, unsigned int color) {
+    
+    debug_line *grown, *l;
+    int capacity;
+    
+    if(list->count == list->capacity) {
+        
+        capacity = list->capacity ? list->capacity * 2 : 256;
+        
+        if(!(grown = (debug_line*)realloc(list->lines, capacity * sizeof(debug_line)))) {
+            
+            printf("[add_line] Could not grow the line list to %d lines\n", capacity);
+            return 0;
+        }
+        
+        list->lines = grown;
+        list->capacity = capacity;
+    }
+    
+    l = &(list->lines[list->count++]);
+    l->x0 = x0;
+    l->y0 = y0;
+    l->z0 = z0;
+    l->x1 = x1;
+    l->y1 = y1;
+    l->z1 = z1;
+    l->color = color;
+    
+    return 1;
+}
+
+//The twelve edges of a box, taken through xf first unless it's NULL
+void add_box_lines(line_list *list, bounds *b, transform *xf, unsigned int color) {
+    
+    float corner[8][3], x, y, z;
+    int i, bit;
+    
+    for(i = 0; i < 8; i++) {
+        
+        x = i & 1 ? b->max[0] : b->min[0];
+        y = i & 2 ? b->max[1] : b->min[1];
+        z = i & 4 ? b->max[2] : b->min[2];
+        corner[i][0] = xf ? xf->m[0][0]*x + xf->m[0][1]*y + xf->m[0][2]*z + xf->x : x;
+        corner[i][1] = xf ? xf->m[1][0]*x + xf->m[1][1]*y + xf->m[1][2]*z + xf->y : y;
+        corner[i][2] = xf ? xf->m[2][0]*x + xf->m[2][1]*y + xf->m[2][2]*z + xf->z : z;
+    }
+    
+    //Each corner to the ones that differ from it in one more bit
+    for(i = 0; i < 8; i++)
+        for(bit = 1; bit < 8; bit <<= 1)
+            if(!(i & bit))
+                add_line(list, corner[i][0], corner[i][1], corner[i][2], corner[i | bit][0], corner[i | bit][1], corner[i | bit][2], color);
+}
+
+void clone_color(color* src, color* dst) {
+    
+    dst->r = src->r;
+    dst->g = src->g;
+    dst->b = src->b;
+    dst->a = src->a;
+}
+
+node *list_get_last(list *target) {
+    
+    int i;
+    node *list_node;
+    
+    list_for_each(target, list_node, i) {
+        
+        if(list_node->next == NULL)
+            return list_node;
+    }
+    
+    return NULL;
+}
+
+void list_push(list *target, void* item) {
+    
+    node *last     = list_get_last(target);
+    node *new_node = new(node);
+
+    if(!new_node) 
+         return;
+    
+
+    new_node->payload = item;
+    new_node->next = NULL;
+        
+    if(!last) {
+     
+        target->root = new_node;
+    } else {      
+     
+        last->next = new_node;
+    }
+}
+
+void dump_list(list *target) {
+    
+    node *item;
+    
+    printf("list.root = %p\n", (void*)target->root);
+    item = target->root;
+    
+    while(item) {
+        
+        printf("   Item %p:\n", (void*)item);
+        printf("      payload: %p\n", item->payload);
+        printf("      next: %p\n", (void*)item->next);
+        item = item->next;
+    }
+}
+
+color *new_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    
+    color *ret_color = new(color);
+    
+    if(!ret_color)
+        return ret_color;
+    
+    ret_color->r = r;
+    ret_color->g = g;
+    ret_color->b = b;
+    ret_color->a = a;
+    
+    return ret_color;
+}
+
+void clone_vertex(vertex *src, vertex* dst) {
+    
+    dst->x = src->x;
+    dst->y = src->y;
+    dst->z = src->z;
+    dst->u = src->u;
+    dst->v = src->v;
+    dst->c = src->c;
+}
+
+unsigned int test_data[] = {
+    0xFF8080, 0xFF6060, 0xFF4040, 0xFF2020, 0xFF0000, 0xD00000, 0xB00000, 0x900000, 0x700000, 0x500000,
+    0xFFFF80, 0xFFE060, 0xFFC040, 0xFFA020, 0xFF8000, 0xD06000, 0xB04000, 0x902000, 0x700000, 0x500000,
+    0xFFFF80, 0xFFFF60, 0xFFFF40, 0xFFFF20, 0xFFFF00, 0xD0D000, 0xB0B000, 0x909000, 0x707000, 0x505000,
+    0x80FF80, 0x60FF60, 0x40FF40, 0x20FF20, 0x00FF00, 0x00D000, 0x00B000, 0x009000, 0x007000, 0x005000,
+    0x8080FF, 0x6060FF, 0x4040FF, 0x2020FF, 0x0000FF, 0x0000D0, 0x0000B0, 0x000090, 0x000070, 0x000050,
+    0xFF80FF, 0xE060FF, 0xC040FF, 0xA020FF, 0x8000FF, 0x6000D0, 0x4000B0, 0x200090, 0x000070, 0x000050,
+    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020,
+    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020,
+    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020,
+    0xFFFFFF, 0xE0E0E0, 0xC0C0C0, 0xA0A0A0, 0x808080, 0x606060, 0x505050, 0x404040, 0x303030, 0x202020
+};
+//Every texture is the test texture until they get loaded from files
+texture *new_texture(char *texture_file) {
+    
+    texture *ret_texture = new(texture);
+    
+    (void)texture_file;
+    
+    if(!ret_texture)
+        return ret_texture;
+        
+    ret_texture->height = 10;
+    ret_texture->width = 10;
+    ret_texture->data = test_data;
+    ret_texture->key = 0;
+    ret_texture->runs = NULL;
+    
+    return ret_texture;
+}
+
+//Make a texture's texels of the key color see-through. Each row is cut
+//into runs of them, which spans step over whole instead of testing
+//every pixel
+int key_texture(texture *t, unsigned int key) {
+    
+    int x, y, i, start;
+    unsigned short *runs;
+    
+    if(!(runs = (unsigned short*)malloc(t->width * t->height * 2 * sizeof(unsigned short)))) {
+        
+        printf("[key_texture] Could not allocate runs for a %dx%d texture\n", t->width, t->height);
+        return 0;
+    }
+    
+    for(y = 0; y < t->height; y++) {
+        
+        for(x = 0; x < t->width;) {
+            
+            i = y * t->width + x;
+            
+            if(t->data[i] != key) {
+                
+                runs[i * 2] = runs[i * 2 + 1] = x++;
+                continue;
+            }
+            
+            for(start = x; x < t->width && t->data[y * t->width + x] == key; x++);
+            
+            for(; i < y * t->width + x; i++) {
+                
+                runs[i * 2] = start;
+                runs[i * 2 + 1] = x - 1;
+            }
+        }
+    }
+    
+    free(t->runs);
+    t->key = key;
+    t->runs = runs;
+    
+    return 1;
+}
+
+triangle *new_triangle(vertex *v1, vertex *v2, vertex *v3, texture *t) {
+    
+    triangle *ret_tri = new(triangle);
+    
+    if(!ret_tri)
+        return ret_tri;
+        
+    clone_vertex(v1, &(ret_tri->v[0]));
+    clone_vertex(v2, &(ret_tri->v[1]));
+    clone_vertex(v3, &(ret_tri->v[2]));
+    ret_tri->t = t;    
+    ret_tri->has_plane = 0;
+    ret_tri->state = STATE_DEFAULT;
+    
+    return ret_tri;
+}
+
+void purge_list(list *target) {
+    
+    node *temp_node, *next_node;
+    
+    for(temp_node = target->root; temp_node != NULL;) {
+        next_node = temp_node->next;
+        free(temp_node);
+        temp_node = next_node;
+    }
+}
+
+void delete_object(object *obj) {
+    
+    node *item;
+    int i;
+    
+    list_for_each(&(obj->tri_list), item, i) {
+        
+        free(item->payload);
+    }
+    
+    purge_list(&(obj->tri_list));
+    free(obj->tri_array);
+    free(obj->bvh);
+    free(obj);
+}
+
+object *new_object() {
+    
+    object *ret_obj = new(object);
+    
+    if(!ret_obj)
+        return ret_obj;
+        
+    ret_obj->tri_list.root = NULL;
+    ret_obj->x = ret_obj->y = ret_obj->z = 0.0;
+    ret_obj->bounds_dirty = 1;
+    ret_obj->is_static = 0;
+    ret_obj->tri_count = 0;
+    ret_obj->tri_array = NULL;
+    ret_obj->bvh = NULL;
+    ret_obj->bvh_count = 0;
+    
+    return ret_obj;
+}
+
+void object_add_triangle(object *obj, triangle *tri) {
+    
+    list_push(&(obj->tri_list), (void*)tri);
+    obj->bounds_dirty = 1;
+}
+
+void clear_bounds(bounds *b) {
+    
+    int i;
+    
+    for(i = 0; i < 3; i++) {
+        
+        b->min[i] = INFINITY;
+        b->max[i] = -INFINITY;
+    }
+}
+
+void bounds_add_triangle(bounds *b, triangle *tri) {
+    
+    int i;
+    
+    for(i = 0; i < 3; i++) {
+        
+        if(tri->v[i].x < b->min[0]) b->min[0] = tri->v[i].x;
+        if(tri->v[i].x > b->max[0]) b->max[0] = tri->v[i].x;
+        if(tri->v[i].y < b->min[1]) b->min[1] = tri->v[i].y;
+        if(tri->v[i].y > b->max[1]) b->max[1] = tri->v[i].y;
+        if(tri->v[i].z < b->min[2]) b->min[2] = tri->v[i].z;
+        if(tri->v[i].z > b->max[2]) b->max[2] = tri->v[i].z;
+    }
+}
+
+void bounds_add_bounds(bounds *b, bounds *src) {
+    
+    int i;
+    
+    for(i = 0; i < 3; i++) {
+        
+        if(src->min[i] < b->min[i]) b->min[i] = src->min[i];
+        if(src->max[i] > b->max[i]) b->max[i] = src->max[i];
+    }
+}
+
+//Derive the enclosing sphere once the box is final
+void finish_bounds(bounds *b) {
+    
+    int i;
+    float half[3];
+    
+    for(i = 0; i < 3; i++) {
+        
+        b->center[i] = (b->min[i] + b->max[i]) / 2.0;
+        half[i] = (b->max[i] - b->min[i]) / 2.0;
+    }
+    
+    b->radius = sqrt(half[0]*half[0] + half[1]*half[1] + half[2]*half[2]);
+}
+
+float triangle_centroid(triangle *tri, int axis) {
+    
+    if(axis == 0)
+        return (tri->v[0].x + tri->v[1].x + tri->v[2].x) / 3.0;
+        
+    if(axis == 1)
+        return (tri->v[0].y + tri->v[1].y + tri->v[2].y) / 3.0;
+        
+    return (tri->v[0].z + tri->v[1].z + tri->v[2].z) / 3.0;
+}
+
+//Recursively split tri_array[first, first + count) at the median
+//centroid of the longest axis until the clusters are small enough,
+//returns the index of the new node
+int build_bvh_node(object *obj, int first, int count) {
+    
+    int index = obj->bvh_count++;
+    bvh_node *n = &(obj->bvh[index]);
+    int i, j, axis, half;
+    float extent[3], pivot;
+    triangle *temp_tri;
+    
+    clear_bounds(&(n->b));
+    
+    for(i = first; i < first + count; i++)
+        bounds_add_triangle(&(n->b), obj->tri_array[i]);
+        
+    finish_bounds(&(n->b));
+    n->first = first;
+    n->tri_count = count;
+    n->left = n->right = -1;
+    
+    if(count <= BVH_LEAF_SIZE)
+        return index;
+    
+    for(i = 0; i < 3; i++)
+        extent[i] = n->b.max[i] - n->b.min[i];
+        
+    axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+    
+    //Partial quickselect so that everything left of half has a
+    //centroid no greater than everything right of it
+    half = first + count / 2;
+    i = first;
+    j = first + count - 1;
+    
+    while(i < j) {
+        
+        int lo = i, hi = j;
+        
+        pivot = triangle_centroid(obj->tri_array[half], axis);
+        
+        while(lo <= hi) {
+            
+            while(triangle_centroid(obj->tri_array[lo], axis) < pivot) lo++;
+            while(triangle_centroid(obj->tri_array[hi], axis) > pivot) hi--;
+            
+            if(lo <= hi) {
+                
+                temp_tri = obj->tri_array[lo];
+                obj->tri_array[lo] = obj->tri_array[hi];
+                obj->tri_array[hi] = temp_tri;
+                lo++;
+                hi--;
+            }
+        }
+        
+        if(hi < half) i = lo;
+        if(half < lo) j = hi;
+    }
+    
+    n->left = build_bvh_node(obj, first, half - first);
+    n->right = build_bvh_node(obj, half, first + count - half);
+    
+    return index;
+}
+
+//Recompute node volumes bottom-up after the vertices have moved,
+//the tree topology is kept as-is
+void refit_bvh_node(object *obj, int index) {
+    
+    bvh_node *n = &(obj->bvh[index]);
+    int i;
+    
+    clear_bounds(&(n->b));
+    
+    if(n->left < 0) {
+        
+        for(i = n->first; i < n->first + n->tri_count; i++)
+            bounds_add_triangle(&(n->b), obj->tri_array[i]);
+    } else {
+        
+        refit_bvh_node(obj, n->left);
+        refit_bvh_node(obj, n->right);
+        bounds_add_bounds(&(n->b), &(obj->bvh[n->left].b));
+        bounds_add_bounds(&(n->b), &(obj->bvh[n->right].b));
+    }
+    
+    finish_bounds(&(n->b));
+}
+
+//Bring the object's bounding volumes up to date with its geometry,
+//rebuilding the BVH if triangles were added and refitting otherwise
+void update_object_bounds(object *obj) {
+    
+    node *item;
+    int i, count;
+    
+    list_for_each(&(obj->tri_list), item, count);
+    
+    if(count != obj->tri_count) {
+        
+        free(obj->tri_array);
+        free(obj->bvh);
+        obj->tri_array = NULL;
+        obj->bvh = NULL;
+        obj->bvh_count = 0;
+        obj->tri_count = count;
+        
+        if(count >= BVH_MIN_TRIANGLES) {
+        
+            obj->tri_array = (triangle**)malloc(sizeof(triangle*) * count);
+            obj->bvh = (bvh_node*)malloc(sizeof(bvh_node) * 2 * count);
+            
+            if(!obj->tri_array || !obj->bvh) {
+                
+                printf("[update_object_bounds] could not allocate the BVH, falling back to object bounds\n");
+                free(obj->tri_array);
+                free(obj->bvh);
+                obj->tri_array = NULL;
+                obj->bvh = NULL;
+            } else {
+                
+                list_for_each(&(obj->tri_list), item, i)
+                    obj->tri_array[i] = (triangle*)item->payload;
+                    
+                build_bvh_node(obj, 0, count);
+            }
+        }
+    } else if(obj->bvh) {
+        
+        refit_bvh_node(obj, 0);
+    }
+    
+    if(obj->bvh) {
+        
+        obj->b = obj->bvh[0].b;
+    } else {
+        
+        clear_bounds(&(obj->b));
+        
+        list_for_each(&(obj->tri_list), item, i)
+            bounds_add_triangle(&(obj->b), (triangle*)item->payload);
+            
+        finish_bounds(&(obj->b));
+    }
+    
+    obj->bounds_dirty = 0;
+}
+
+/*
+//Needs to be updated to work with textures
+object *new_cube(float s, color *c) {
+    
+    object* ret_obj = new_object();
+    int i;
+        triangle *temp_tri;
+    vertex temp_v[3];
+    float half_s = s/2.0;
+    float points[][5] = {
+        {-half_s, half_s, -half_s, 1.0, 0.0}, //Adding U and V 
+        {half_s, half_s, -half_s, 0.0, 0.0},
+        {half_s, -half_s, -half_s, },
+        {-half_s, -half_s, -half_s},
+        {-half_s, half_s, half_s},
+        {half_s, half_s, half_s},
+        {half_s, -half_s, half_s},
+        {-half_s, -half_s, half_s},
+    };
+    const int order[][3] = {
+                  {7, 5, 4}, //3
+                  {6, 5, 7}, //3
+                  {3, 0, 1}, //1
+                  {3, 1, 2}, //1
+                  {4, 5, 0}, 
+                  {1, 0, 5},
+                  {6, 7, 3},
+                  {3, 2, 6},
+                  {6, 1, 5},
+                  {6, 2, 1},
+                  {7, 4, 0},
+                  {0, 3, 7}
+              };
+    
+    if(!ret_obj) {
+        
+        printf("[new_cube] object allocation failed\n");
+        return ret_obj;
+    }
+    
+    printf("[new_cube] new object allocated\n");
+        
+    if(!ret_obj)
+        return ret_obj;
+    
+    temp_v[0].c = c;
+    temp_v[1].c = c;
+    temp_v[2].c = c;
+    
+    for(i = 0; i < 12; i++) {
+     
+        temp_v[0].x = points[order[i][0]][0];
+        temp_v[0].y = points[order[i][0]][1];
+        temp_v[0].z = points[order[i][0]][2];
+        temp_v[0].u = 0.0;
+        temp_v[0].v = 0.0;
+        temp_v[1].x = points[order[i][1]][0];
+        temp_v[1].y = points[order[i][1]][1];
+        temp_v[1].z = points[order[i][1]][2];
+        temp_v[1].u = 0.0;
+        temp_v[1].v = 0.0;
+        temp_v[2].x = points[order[i][2]][0];
+        temp_v[2].y = points[order[i][2]][1];
+        temp_v[2].z = points[order[i][2]][2];
+        
+        printf("[new_cube] Creating new triangle (%f, %f, %f), (%f, %f, %f), (%f, %f, %f)\n", temp_v[0].x, temp_v[0].y, temp_v[0].z, temp_v[1].x, temp_v[1].y, temp_v[1].z,  temp_v[2].x, temp_v[2].y, temp_v[2].z);
+        
+        if(!(temp_tri = new_triangle(&temp_v[0], &temp_v[1], &temp_v[2], new_texture("none")))) {
+            
+            printf("[new_cube] failed to allocate triangle #%d\n", i+1);
+            delete_object(ret_obj);
+            return NULL;        
+        }
+        printf("[new_cube] generated triangle #%d\n", i+1);
+        
+        list_push(&(ret_obj->tri_list), (void*)temp_tri);
+        printf("[new_cube] inserted triangle #%d\n", i+1);
+    }
+    
+    return ret_obj;
+}
+*/
+
+//Plane through the triangle, facing the same way as its surface normal
+int triangle_plane(triangle *tri, plane *p) {
+    
+    float vec_a[3], vec_b[3], cross[3], mag;
+    
+    vec_a[0] = tri->v[0].x - tri->v[2].x;
+    vec_a[1] = tri->v[0].y - tri->v[2].y;
+    vec_a[2] = tri->v[0].z - tri->v[2].z;
+    vec_b[0] = tri->v[1].x - tri->v[2].x;
+    vec_b[1] = tri->v[1].y - tri->v[2].y;
+    vec_b[2] = tri->v[1].z - tri->v[2].z;
+    cross[0] = vec_a[1]*vec_b[2] - vec_a[2]*vec_b[1];
+    cross[1] = vec_a[2]*vec_b[0] - vec_a[0]*vec_b[2];
+    cross[2] = vec_a[0]*vec_b[1] - vec_a[1]*vec_b[0];
+    mag = sqrt(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
+    
+    //Degenerate triangles have no plane
+    if(mag == 0.0)
+        return 0;
+        
+    p->x = cross[0] / mag;
+    p->y = cross[1] / mag;
+    p->z = cross[2] / mag;
+    p->d = -(p->x*tri->v[2].x + p->y*tri->v[2].y + p->z*tri->v[2].z);
+    
+    return 1;
+}
+
+//Flag an object whose geometry will never move. Its face planes and
+//bounding volumes are worked out here once instead of every frame
+void make_object_static(object *obj) {
+    
+    node *item;
+    triangle *temp_tri;
+    int i;
+    
+    list_for_each(&(obj->tri_list), item, i) {
+        
+        temp_tri = (triangle*)item->payload;
+        temp_tri->has_plane = triangle_plane(temp_tri, &(temp_tri->p));
+    }
+    
+    update_object_bounds(obj);
+    obj->is_static = 1;
+}
+
+//Move all of src's triangles into dst and free src
+void merge_object(object *dst, object *src) {
+    
+    node *item;
+    int i;
+    
+    list_for_each(&(src->tri_list), item, i) {
+        
+        object_add_triangle(dst, (triangle*)item->payload);
+    }
+    
+    purge_list(&(src->tri_list));
+    free(src->tri_array);
+    free(src->bvh);
+    free(src);
+}
+
+//Add a textured quad to the object as two triangles. The corners
+//should be given clockwise as seen from the visible side
+int add_quad(object *obj, vertex *a, vertex *b, vertex *c, vertex *d, texture *t) {
+    
+    triangle *tri_a, *tri_b;
+    
+    if(!(tri_a = new_triangle(a, b, c, t)))
+        return 0;
+        
+    if(!(tri_b = new_triangle(a, c, d, t))) {
+        
+        free(tri_a);
+        return 0;
+    }
+    
+    object_add_triangle(obj, tri_a);
+    object_add_triangle(obj, tri_b);
+    
+    return 1;
+}
+
+//Build an axis-aligned box between the two corners, with its faces
+//pointing inward (a room) or outward (a solid block)
+object *new_box(float x0, float y0, float z0, float x1, float y1, float z1, int inward, texture *t, color *c) {
+    
+    object *ret_obj = new_object();
+    vertex corner[8];
+    vertex *quad[4];
+    int i, j;
+    const int faces[][4] = {
+        {0, 1, 2, 3}, //-z
+        {5, 4, 7, 6}, //+z
+        {4, 0, 3, 7}, //-x
+        {1, 5, 6, 2}, //+x
+        {4, 5, 1, 0}, //+y
+        {3, 2, 6, 7}  //-y
+    };
+    const float uv[][2] = {{0.0, 0.0}, {1.0, 0.0}, {1.0, 1.0}, {0.0, 1.0}};
+    
+    if(!ret_obj) {
+        
+        printf("[new_box] object allocation failed\n");
+        return ret_obj;
+    }
+    
+    for(i = 0; i < 8; i++) {
+        
+        corner[i].x = (i == 1 || i == 2 || i == 5 || i == 6) ? x1 : x0;
+        corner[i].y = (i == 0 || i == 1 || i == 4 || i == 5) ? y1 : y0;
+        corner[i].z = i < 4 ? z0 : z1;
+        corner[i].c = c;
+    }
+    
+    for(i = 0; i < 6; i++) {
+        
+        for(j = 0; j < 4; j++) {
+            
+            //Rooms are seen from the inside, so reverse the winding
+            quad[j] = &corner[faces[i][inward ? 3 - j : j]];
+            quad[j]->u = uv[j][0];
+            quad[j]->v = uv[j][1];
+        }
+        
+        //add_quad copies the vertices, so it's safe for the next
+        //face to overwrite the shared corners' u and v
+        if(!add_quad(ret_obj, quad[0], quad[1], quad[2], quad[3], t)) {
+            
+            printf("[new_box] failed to allocate face #%d\n", i+1);
+            delete_object(ret_obj);
+            return NULL;
+        }
+    }
+    
+    return ret_obj;
+}
+
+int reserve_stream(vertex_stream *s, int count) {
+    
+    float *x, *y, *z;
+    unsigned char *outcode;
+    int capacity;
+    
+    if(count <= s->capacity)
+        return 1;
+        
+    capacity = s->capacity ? s->capacity : 1024;
+    
+    while(capacity < count)
+        capacity *= 2;
+        
+    x = (float*)realloc(s->x, capacity * sizeof(float));
+    s->x = x ? x : s->x;
+    y = (float*)realloc(s->y, capacity * sizeof(float));
+    s->y = y ? y : s->y;
+    z = (float*)realloc(s->z, capacity * sizeof(float));
+    s->z = z ? z : s->z;
+    outcode = (unsigned char*)realloc(s->outcode, capacity);
+    s->outcode = outcode ? outcode : s->outcode;
+    
+    if(!x || !y || !z || !outcode) {
+        
+        printf("[reserve_stream] Could not grow the stream to %d vertices\n", capacity);
+        return 0;
+    }
+    
+    s->capacity = capacity;
+    
+    return 1;
+}
+
+void delete_stream(vertex_stream *s) {
+    
+    free(s->x);
+    free(s->y);
+    free(s->z);
+    free(s->outcode);
+    memset((void*)s, 0, sizeof(vertex_stream));
+}
+
+#ifdef SIMD_WIDTH
+//Narrow lanes holding values under 256 down to a byte apiece
+void store_bytes(unsigned char *dst, simd_float a) {
+    
+#if SIMD_WIDTH == 8
+    __m128i b = _mm_packs_epi32(_mm_castps_si128(_mm256_castps256_ps128(a)), _mm_castps_si128(_mm256_extractf128_ps(a, 1)));
+    
+    _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(b, b));
+#else
+    __m128i b = _mm_packs_epi32(_mm_castps_si128(a), _mm_castps_si128(a));
+    int packed = _mm_cvtsi128_si32(_mm_packus_epi16(b, b));
+    
+    memcpy((void*)dst, (void*)&packed, 4);
+#endif
+}
+#endif
+
+//Both the vector and the scalar loop evaluate in the same order as
+//transform_vertex does so every path lands on the same view space
+void transform_stream(void *data, int start, int end) {
+    
+    stream_transform *xf = (stream_transform*)data;
+    float *px = xf->s->x, *py = xf->s->y, *pz = xf->s->z;
+    unsigned char *outcode = xf->s->outcode;
+    int i, k, outcodes = xf->outcodes;
+    float dx, dy, dz, x, y, z;
+    float ax = 0.0, ay = 0.0;
+#ifdef SIMD_WIDTH
+    simd_float m[3][3], pre[3], post[3], vx, vy, vz, rx, ry, rz, sx, sy, near_z, far_z, zero, code;
+#endif
+    
+    //How far x and y get from the center line per unit z before they're
+    //off of the screen
+    if(outcodes) {
+        
+        ax = (xf->width + 2 * OUT_GUARD) / (xf->focal * xf->height);
+        ay = (xf->height + 2 * OUT_GUARD) / (xf->focal * xf->height);
+    }
+    
+#ifdef SIMD_WIDTH
+    for(i = 0; i < 3; i++) {
+        
+        for(k = 0; k < 3; k++)
+            m[i][k] = simd_set(xf->m[i][k]);
+            
+        pre[i] = simd_set(xf->pre[i]);
+        post[i] = simd_set(xf->post[i]);
+    }
+    
+    near_z = simd_set(NEAR_PLANE);
+    far_z = simd_set(SCREEN_DEPTH);
+    zero = simd_set(0.0);
+    
+    for(i = start; i + SIMD_WIDTH <= end; i += SIMD_WIDTH) {
+        
+        vx = simd_sub(simd_load(&(px[i])), pre[0]);
+        vy = simd_sub(simd_load(&(py[i])), pre[1]);
+        vz = simd_sub(simd_load(&(pz[i])), pre[2]);
+        rx = simd_add(simd_add(simd_add(simd_mul(m[0][0], vx), simd_mul(m[0][1], vy)), simd_mul(m[0][2], vz)), post[0]);
+        ry = simd_add(simd_add(simd_add(simd_mul(m[1][0], vx), simd_mul(m[1][1], vy)), simd_mul(m[1][2], vz)), post[1]);
+        rz = simd_add(simd_add(simd_add(simd_mul(m[2][0], vx), simd_mul(m[2][1], vy)), simd_mul(m[2][2], vz)), post[2]);
+        simd_store(&(px[i]), rx);
+        simd_store(&(py[i]), ry);
+        simd_store(&(pz[i]), rz);
+        
+        if(!outcodes)
+            continue;
+            
+        //Each test is all ones in the lanes that pass, which picks out 
+        //that test's bit
+        sx = simd_mul(rz, simd_set(ax));
+        sy = simd_mul(rz, simd_set(ay));
+        code = simd_and(simd_less(rz, near_z), simd_bits(OUT_NEAR));
+        code = simd_or(code, simd_and(simd_less(far_z, rz), simd_bits(OUT_FAR)));
+        code = simd_or(code, simd_and(simd_less(simd_add(rx, sx), zero), simd_bits(OUT_LEFT)));
+        code = simd_or(code, simd_and(simd_less(sx, rx), simd_bits(OUT_RIGHT)));
+        code = simd_or(code, simd_and(simd_less(sy, ry), simd_bits(OUT_TOP)));
+        code = simd_or(code, simd_and(simd_less(simd_add(ry, sy), zero), simd_bits(OUT_BOTTOM)));
+        store_bytes(&(outcode[i]), code);
+    }
+    
+    start = i;
+#endif
+    
+    for(i = start; i < end; i++) {
+        
+        dx = px[i] - xf->pre[0];
+        dy = py[i] - xf->pre[1];
+        dz = pz[i] - xf->pre[2];
+        x = px[i] = xf->m[0][0]*dx + xf->m[0][1]*dy + xf->m[0][2]*dz + xf->post[0];
+        y = py[i] = xf->m[1][0]*dx + xf->m[1][1]*dy + xf->m[1][2]*dz + xf->post[1];
+        z = pz[i] = xf->m[2][0]*dx + xf->m[2][1]*dy + xf->m[2][2]*dz + xf->post[2];
+        
+        if(outcodes)
+            outcode[i] = (z < NEAR_PLANE) * OUT_NEAR | (z > SCREEN_DEPTH) * OUT_FAR |
+                         (x + z * ax < 0) * OUT_LEFT | (x > z * ax) * OUT_RIGHT |
+                         (y > z * ay) * OUT_TOP | (y + z * ay < 0) * OUT_BOTTOM;
+    }
+}
+
+//Big streams get split across the job system
+void run_stream_transform(stream_transform *xf) {
+    
+    if(xf->s->count > TRANSFORM_GRAIN && jobs.count > 1)
+        parallel_for(transform_stream, (void*)xf, xf->s->count, TRANSFORM_GRAIN);
+    else
+        transform_stream((void*)xf, 0, xf->s->count);
+}
+
+//Set up xf to take s to cam's view space and test it against the view
+//volume. Only the full size is safe to read from the geometry thread,
+//and the guard band covers whatever it gets scaled down to since the
+//aspect stays put
+void view_transform(stream_transform *xf, camera *cam, vertex_stream *s) {
+    
+    xf->pre[0] = cam->x;
+    xf->pre[1] = cam->y;
+    xf->pre[2] = cam->z;
+    xf->post[0] = xf->post[1] = xf->post[2] = 0.0;
+    memcpy((void*)xf->m, (void*)cam->view, sizeof(xf->m));
+    xf->outcodes = 1;
+    xf->focal = cam->focal;
+    xf->width = screen.full_width;
+    xf->height = screen.full_height;
+    xf->s = s;
+}
+
+#define PARTICLE_GRAIN 8192 //Particles per job once a system is worth splitting up
+
+//A system that can hold up to capacity particles at once, starting out
+//empty. Every attribute array comes out of the one allocation
+particle_system *new_particle_system(emitter *e, int capacity) {
+    
+    particle_system *ps = new(particle_system);
+    float *block;
+    
+    if(!ps) {
+        
+        printf("[new_particle_system] Could not allocate the particle system\n");
+        return NULL;
+    }
+    
+    if(!(block = (float*)malloc(capacity * 7 * sizeof(float)))) {
+        
+        printf("[new_particle_system] Could not allocate %d particles\n", capacity);
+        free(ps);
+        return NULL;
+    }
+    
+    ps->e = *e;
+    ps->x = block;
+    ps->y = block + capacity;
+    ps->z = block + capacity * 2;
+    ps->vx = block + capacity * 3;
+    ps->vy = block + capacity * 4;
+    ps->vz = block + capacity * 5;
+    ps->life = block + capacity * 6;
+    ps->count = 0;
+    ps->capacity = capacity;
+    ps->owed = 0.0;
+    ps->step = 0.0;
+    ps->seed = 1;
+    
+    return ps;
+}
+
+void delete_particle_system(particle_system *ps) {
+    
+    free(ps->x);
+    free(ps);
+}
+
+//Deterministic, from -1 to 1
+float particle_random(particle_system *ps) {
+    
+    ps->seed = ps->seed * 1103515245 + 12345;
+    
+    return ((ps->seed >> 8) & 0xFFFF) / 32767.5 - 1.0;
+}
+
+//Move particles start through end on by a step, along with their
+//velocity and what they have left to live. Both loops go in the same
+//order so every path lands in the same place
+void move_particles(void *data, int start, int end) {
+    
+    particle_system *ps = (particle_system*)data;
+    float dt = ps->step, fall = ps->e.gravity * ps->step;
+    int i;
+#ifdef SIMD_WIDTH
+    simd_float t = simd_set(dt), g = simd_set(fall), vy;
+    
+    for(i = start; i + SIMD_WIDTH <= end; i += SIMD_WIDTH) {
+        
+        vy = simd_load(&(ps->vy[i]));
+        simd_store(&(ps->x[i]), simd_add(simd_load(&(ps->x[i])), simd_mul(simd_load(&(ps->vx[i])), t)));
+        simd_store(&(ps->y[i]), simd_add(simd_load(&(ps->y[i])), simd_mul(vy, t)));
+        simd_store(&(ps->z[i]), simd_add(simd_load(&(ps->z[i])), simd_mul(simd_load(&(ps->vz[i])), t)));
+        simd_store(&(ps->vy[i]), simd_sub(vy, g));
+        simd_store(&(ps->life[i]), simd_sub(simd_load(&(ps->life[i])), t));
+    }
+    
+    start = i;
+#endif
+    
+    for(i = start; i < end; i++) {
+        
+        ps->x[i] = ps->x[i] + ps->vx[i] * dt;
+        ps->y[i] = ps->y[i] + ps->vy[i] * dt;
+        ps->z[i] = ps->z[i] + ps->vz[i] * dt;
+        ps->vy[i] = ps->vy[i] - fall;
+        ps->life[i] = ps->life[i] - dt;
+    }
+}
+
+//Move every particle on by dt seconds, drop the ones that have run out
+//of life and emit whatever the rate has built up. Like other submitted
+//geometry, it can't be touched while the previous frame is in flight,
+//so update between begin_frame and submit_particles
+void update_particles(particle_system *ps, float dt) {
+    
+    int i, born;
+    
+    ps->step = dt;
+    
+    if(ps->count > PARTICLE_GRAIN && jobs.count > 1)
+        parallel_for(move_particles, (void*)ps, ps->count, PARTICLE_GRAIN);
+    else
+        move_particles((void*)ps, 0, ps->count);
+        
+    //The last live particle moves into each dead one's place
+    for(i = 0; i < ps->count;) {
+        
+        if(ps->life[i] > 0.0) {
+            
+            i++;
+            continue;
+        }
+        
+        ps->count--;
+        ps->x[i] = ps->x[ps->count];
+        ps->y[i] = ps->y[ps->count];
+        ps->z[i] = ps->z[ps->count];
+        ps->vx[i] = ps->vx[ps->count];
+        ps->vy[i] = ps->vy[ps->count];
+        ps->vz[i] = ps->vz[ps->count];
+        ps->life[i] = ps->life[ps->count];
+    }
+    
+    ps->owed += ps->e.rate * dt;
+    born = (int)ps->owed;
+    ps->owed -= born;
+    
+    for(; born > 0 && ps->count < ps->capacity; born--, ps->count++) {
+        
+        i = ps->count;
+        ps->x[i] = ps->e.x;
+        ps->y[i] = ps->e.y;
+        ps->z[i] = ps->e.z;
+        ps->vx[i] = ps->e.vx + ps->e.spread * particle_random(ps);
+        ps->vy[i] = ps->e.vy + ps->e.spread * particle_random(ps);
+        ps->vz[i] = ps->e.vz + ps->e.spread * particle_random(ps);
+        ps->life[i] = ps->e.lifetime;
+    }
+}
+
+//Run every vertex of an object through m * (v - pivot) + pivot in one
+//batch. The triangles get copied into a stream and back out again
+vertex_stream object_stream;
+
+void rotate_object(object *obj, float m[3][3], float *pivot) {
+    
+    stream_transform xf;
+    triangle *temp_tri;
+    node     *item;
+    int      i, j, v;
+    
+    //tri_count lags behind until the bounds get updated
+    list_for_each(&(obj->tri_list), item, v);
+    
+    if(!reserve_stream(&object_stream, v * 3))
+        return;
+    
+    obj->bounds_dirty = 1;
+    obj->is_static = 0;
+    v = 0;
+    
+    list_for_each(&(obj->tri_list), item, i) {
+        
+        temp_tri = (triangle*)(item->payload);
+        
+        for(j = 0; j < 3; j++, v++) {
+            
+            object_stream.x[v] = temp_tri->v[j].x;
+            object_stream.y[v] = temp_tri->v[j].y;
+            object_stream.z[v] = temp_tri->v[j].z;
+        }
+    }
+    
+    object_stream.count = v;
+    memcpy((void*)xf.m, (void*)m, sizeof(xf.m));
+    
+    for(i = 0; i < 3; i++)
+        xf.pre[i] = xf.post[i] = pivot[i];
+    
+    xf.outcodes = 0;
+    xf.s = &object_stream;
+    run_stream_transform(&xf);
+    v = 0;
+    
+    list_for_each(&(obj->tri_list), item, i) {
+        
+        temp_tri = (triangle*)(item->payload);
+        temp_tri->has_plane = 0;
+        
+        for(j = 0; j < 3; j++, v++) {
+            
+            temp_tri->v[j].x = object_stream.x[v];
+            temp_tri->v[j].y = object_stream.y[v];
+            temp_tri->v[j].z = object_stream.z[v];
+        }
+    }
+}
+
+//Rotation about a single axis, laid out for rotate_object
+void axis_rotation(int axis, float angle, float m[3][3]) {
+    
+    float c = cos(DEG_TO_RAD(angle)), s = sin(DEG_TO_RAD(angle));
+    int a = (axis + 1) % 3, b = (axis + 2) % 3;
+    
+    memset((void*)m, 0, sizeof(float) * 9);
+    m[axis][axis] = 1.0;
+    m[a][a] = c;
+    m[a][b] = -s;
+    m[b][a] = s;
+    m[b][b] = c;
+}
+
+void translate_object(object* obj, float x, float y, float z) {
+    
+    triangle *temp_tri;
+    node     *item;
+    int      i, j;
+    
+    obj->x += x;
+    obj->y += y;
+    obj->z += z;
+    obj->bounds_dirty = 1;
+    obj->is_static = 0;
+    
+    list_for_each(&(obj->tri_list), item, i) {
+        
+        temp_tri = (triangle*)(item->payload);
+        temp_tri->has_plane = 0;
+        
+        for(j = 0; j < 3; j++) {
+        
+            temp_tri->v[j].x += x;
+            temp_tri->v[j].y += y;
+            temp_tri->v[j].z += z;
+        }
+    }
+}
+
+void rotate_object_x_global(object* obj, float angle) {
+    
+    float m[3][3], origin[3] = {0.0, 0.0, 0.0};
+    
+    axis_rotation(0, angle, m);
+    rotate_object(obj, m, origin);
+}
+
+void rotate_object_y_global(object* obj, float angle) {
+    
+    float m[3][3], origin[3] = {0.0, 0.0, 0.0};
+    
+    axis_rotation(1, angle, m);
+    rotate_object(obj, m, origin);
+}
+
+void rotate_object_z_global(object* obj, float angle) {
+    
+    float m[3][3], origin[3] = {0.0, 0.0, 0.0};
+    
+    axis_rotation(2, angle, m);
+    rotate_object(obj, m, origin);
+}
+
+void rotate_object_x_local(object* obj, float angle) {
+    
+    float m[3][3], pivot[3];
+    
+    pivot[0] = obj->x;
+    pivot[1] = obj->y;
+    pivot[2] = obj->z;
+    axis_rotation(0, angle, m);
+    rotate_object(obj, m, pivot);
+}
+
+void rotate_object_y_local(object* obj, float angle) {
+    
+    float m[3][3], pivot[3];
+    
+    pivot[0] = obj->x;
+    pivot[1] = obj->y;
+    pivot[2] = obj->z;
+    axis_rotation(1, angle, m);
+    rotate_object(obj, m, pivot);
+}
+
+void rotate_object_z_local(object* obj, float angle) {
+    
+    float m[3][3], pivot[3];
+    
+    pivot[0] = obj->x;
+    pivot[1] = obj->y;
+    pivot[2] = obj->z;
+    axis_rotation(2, angle, m);
+    rotate_object(obj, m, pivot);
+}
+
+//Out of range depths land on the far value, which never passes
+float encode_depth(float z) {
+    
+    switch(screen.depth_format) {
+        
+        case DEPTH_FLOAT32:
+            return z > SCREEN_DEPTH || z < 0 ? SCREEN_DEPTH : z;
+            
+        case DEPTH_REVERSED:
+            return z > SCREEN_DEPTH || z <= 0 ? 0.0 : NEAR_PLANE / z;
+    }
+    
+    return TO_SCREEN_Z(z);
+}
+
+void project(vertex* v, screen_point* p) {
+
+    float delta = (v->z == 0.0) ? 1.0 : (focal_length/v->z);
+
+    p->x = TO_SCREEN_X(v->x * delta);
+    p->y = TO_SCREEN_Y(v->y * delta);
+    p->z = encode_depth(v->z);
+    p->w = v->z > 0.0 ? 1.0 / v->z : 0.0;
+    
+    p->u = v->u;
+    p->v = v->v;
+}
+
+#define KEYED_MARGIN 0.01 //Of a texel
+
+//How many pixels after one that landed in a see-through run of a keyed
+//texture are sure to land in the same run, up to most. Only for spans
+//whose u and v are linear, and short of the run's ends by a margin so
+//that rounding in the per pixel u and v can't make it overshoot
+int skip_keyed_run(span *s, float u, float v, unsigned int newu, unsigned int newv, int most) {
+    
+    texture *tex = s->tex;
+    unsigned short *run = &tex->runs[(newv * tex->width + newu) * 2];
+    float du = s->mu * (tex->width - 1), dv = s->mv * (tex->height - 1), room;
+    
+    u *= tex->width - 1;
+    v *= tex->height - 1;
+    
+    if(du > 0.0 && (room = (run[1] + 0.5 - KEYED_MARGIN - u) / du) < most)
+        most = room < 0.0 ? 0 : (int)room;
+    else if(du < 0.0 && (room = (u - run[0] + 0.5 - KEYED_MARGIN) / -du) < most)
+        most = room < 0.0 ? 0 : (int)room;
+        
+    if(dv > 0.0 && (room = (newv + 0.5 - KEYED_MARGIN - v) / dv) < most)
+        most = room < 0.0 ? 0 : (int)room;
+    else if(dv < 0.0 && (room = (v - newv + 0.5 - KEYED_MARGIN) / -dv) < most)
+        most = room < 0.0 ? 0 : (int)room;
+        
+    return most;
+}
+
+//The one span filler every pipeline state is generated from. format
+//and state are constants in each generated copy and it's always inlined
+//so the compiler drops whatever that state doesn't use from the loop.
+//The float formats pass when view z is less and when 1/z is greater.
+//Negating both sides turns one test into the other exactly, so that's
+//a multiply by dir rather than another copy
+FORCE_INLINE int span_fill(span *s, int first, int last, int format, int state) {
+    
+    int x, written = 0;
+    unsigned short newz = 0, *depth16 = (unsigned short*)s->depth;
+    unsigned int newu, newv, texel, dst;
+    float fx, z = 0.0, u, v, w, dir = format == DEPTH_REVERSED ? -1.0 : 1.0;
+    float *depth32 = (float*)s->depth;
+    texture *tex = s->tex;
+    
+    for(x = first; x <= last; x++) {
+        
+        fx = (float)x;
+        
+        //Calculate the interpolated z value and check the z buffer
+        if(state & STATE_DEPTH) {
+            
+            z = s->mz*(fx - s->x1) + s->z1;
+            
+            if(format == DEPTH_LINEAR16) {
+                
+                newz = (unsigned short)lround(z >= 65535 ? 65535 : z < 0 ? 0 : z);
+                
+                if(newz >= depth16[x])
+                    continue;
+            } else if(z * dir >= depth32[x] * dir) {
+                
+                continue;
+            }
+        }
+        
+        if(state & STATE_TEXTURED) {
+            
+            u = s->mu*(fx - s->x1) + s->u1;
+            v = s->mv*(fx - s->x1) + s->v1;
+            
+            //u/z and v/z are what's linear across the screen
+            if(state & STATE_PERSPECTIVE) {
+                
+                w = s->mw*(fx - s->x1) + s->w1;
+                u /= w;
+                v /= w;
+                u = u < 0.0 ? 0.0 : u > 1.0 ? 1.0 : u;
+                v = v < 0.0 ? 0.0 : v > 1.0 ? 1.0 : v;
+            }
+            
+            newu = (unsigned int)lround(u * (tex->width - 1)); //-1
+            newv = (unsigned int)lround(v * (tex->height - 1)); //-1
+            texel = tex->data[newv * tex->width + newu];
+            
+            //Before the depth write, so whatever's behind shows through.
+            //Linear u and v can jump the rest of the run in one go
+            if((state & STATE_KEYED) && texel == tex->key) {
+                
+                if(!(state & STATE_PERSPECTIVE))
+                    x += skip_keyed_run(s, u, v, newu, newv, last - x);
+                    
+                continue;
+            }
+        } else {
+            
+            texel = s->flat;
+        }
+        
+        //Red and blue scale together, green on its own
+        if(state & STATE_SHADED)
+            texel = ((((texel & 0xFF00FF) * s->light) >> 8) & 0xFF00FF) | ((((texel & 0x00FF00) * s->light) >> 8) & 0x00FF00);
+        
+        //Same again for the mix with what's behind, the two weights
+        //adding up to 256 so that no channel can carry into the next
+        if(state & STATE_BLEND) {
+            
+            dst = s->color[x];
+            texel = ((((texel & 0xFF00FF) * s->alpha + (dst & 0xFF00FF) * (256 - s->alpha)) >> 8) & 0xFF00FF) |
+                    ((((texel & 0x00FF00) * s->alpha + (dst & 0x00FF00) * (256 - s->alpha)) >> 8) & 0x00FF00);
+        }
+        
+        s->color[x] = 0xFF000000 | texel;
+        
+        //Uncomment the below to view the depth buffer
+        //s->color[x] = 0xFF000000 | (newz >> 8) * 0x010101;
+        if((state & STATE_DEPTH) && !(state & STATE_BLEND)) {
+            
+            if(format == DEPTH_LINEAR16)
+                depth16[x] = newz;
+            else
+                depth32[x] = z;
+        }
+        
+        written++;
+    }
+    
+    return written;
+}
+
+//Generate a filler for each format and state, span_<name>_<state>
+#define SPAN_FILLER(name, format, state) \
+    int span_##name##_##state(span *s, int first, int last) { return span_fill(s, first, last, format, state); }
+    
+#define SPAN_FILLERS(name, format) \
+    SPAN_FILLER(name, format, 0) SPAN_FILLER(name, format, 1) SPAN_FILLER(name, format, 2) SPAN_FILLER(name, format, 3) \
+    SPAN_FILLER(name, format, 4) SPAN_FILLER(name, format, 5) SPAN_FILLER(name, format, 6) SPAN_FILLER(name, format, 7) \
+    SPAN_FILLER(name, format, 8) SPAN_FILLER(name, format, 9) SPAN_FILLER(name, format, 10) SPAN_FILLER(name, format, 11) \
+    SPAN_FILLER(name, format, 12) SPAN_FILLER(name, format, 13) SPAN_FILLER(name, format, 14) SPAN_FILLER(name, format, 15) \
+    SPAN_FILLER(name, format, 16) SPAN_FILLER(name, format, 17) SPAN_FILLER(name, format, 18) SPAN_FILLER(name, format, 19) \
+    SPAN_FILLER(name, format, 20) SPAN_FILLER(name, format, 21) SPAN_FILLER(name, format, 22) SPAN_FILLER(name, format, 23) \
+    SPAN_FILLER(name, format, 24) SPAN_FILLER(name, format, 25) SPAN_FILLER(name, format, 26) SPAN_FILLER(name, format, 27) \
+    SPAN_FILLER(name, format, 28) SPAN_FILLER(name, format, 29) SPAN_FILLER(name, format, 30) SPAN_FILLER(name, format, 31) \
+    SPAN_FILLER(name, format, 32) SPAN_FILLER(name, format, 33) SPAN_FILLER(name, format, 34) SPAN_FILLER(name, format, 35) \
+    SPAN_FILLER(name, format, 36) SPAN_FILLER(name, format, 37) SPAN_FILLER(name, format, 38) SPAN_FILLER(name, format, 39) \
+    SPAN_FILLER(name, format, 40) SPAN_FILLER(name, format, 41) SPAN_FILLER(name, format, 42) SPAN_FILLER(name, format, 43) \
+    SPAN_FILLER(name, format, 44) SPAN_FILLER(name, format, 45) SPAN_FILLER(name, format, 46) SPAN_FILLER(name, format, 47) \
+    SPAN_FILLER(name, format, 48) SPAN_FILLER(name, format, 49) SPAN_FILLER(name, format, 50) SPAN_FILLER(name, format, 51) \
+    SPAN_FILLER(name, format, 52) SPAN_FILLER(name, format, 53) SPAN_FILLER(name, format, 54) SPAN_FILLER(name, format, 55) \
+    SPAN_FILLER(name, format, 56) SPAN_FILLER(name, format, 57) SPAN_FILLER(name, format, 58) SPAN_FILLER(name, format, 59) \
+    SPAN_FILLER(name, format, 60) SPAN_FILLER(name, format, 61) SPAN_FILLER(name, format, 62) SPAN_FILLER(name, format, 63)
+    
+#define SPAN_FILLER_ROW(name) { \
+    span_##name##_0, span_##name##_1, span_##name##_2, span_##name##_3, \
+    span_##name##_4, span_##name##_5, span_##name##_6, span_##name##_7, \
+    span_##name##_8, span_##name##_9, span_##name##_10, span_##name##_11, \
+    span_##name##_12, span_##name##_13, span_##name##_14, span_##name##_15, \
+    span_##name##_16, span_##name##_17, span_##name##_18, span_##name##_19, \
+    span_##name##_20, span_##name##_21, span_##name##_22, span_##name##_23, \
+    span_##name##_24, span_##name##_25, span_##name##_26, span_##name##_27, \
+    span_##name##_28, span_##name##_29, span_##name##_30, span_##name##_31, \
+    span_##name##_32, span_##name##_33, span_##name##_34, span_##name##_35, \
+    span_##name##_36, span_##name##_37, span_##name##_38, span_##name##_39, \
+    span_##name##_40, span_##name##_41, span_##name##_42, span_##name##_43, \
+    span_##name##_44, span_##name##_45, span_##name##_46, span_##name##_47, \
+    span_##name##_48, span_##name##_49, span_##name##_50, span_##name##_51, \
+    span_##name##_52, span_##name##_53, span_##name##_54, span_##name##_55, \
+    span_##name##_56, span_##name##_57, span_##name##_58, span_##name##_59, \
+    span_##name##_60, span_##name##_61, span_##name##_62, span_##name##_63 }
+
+SPAN_FILLERS(linear16, DEPTH_LINEAR16)
+SPAN_FILLERS(float32, DEPTH_FLOAT32)
+SPAN_FILLERS(reversed, DEPTH_REVERSED)
+
+//Indexed by depth format and state. init_span_kernel swaps the vector
+//kernels in for the default state
+span_function span_fillers[DEPTH_FORMATS][STATES] = {
+    SPAN_FILLER_ROW(linear16),
+    SPAN_FILLER_ROW(float32),
+    SPAN_FILLER_ROW(reversed)
+};
+
+//The default state's scalar kernels, which the vector ones finish off with
+int span_linear16_scalar(span *s, int first, int last) {
+    
+    return span_fill(s, first, last, DEPTH_LINEAR16, STATE_DEFAULT);
+}
+
+int span_float32_scalar(span *s, int first, int last) {
+    
+    return span_fill(s, first, last, DEPTH_FLOAT32, STATE_DEFAULT);
+}
+
+int span_reversed_scalar(span *s, int first, int last) {
+    
+    return span_fill(s, first, last, DEPTH_REVERSED, STATE_DEFAULT);
+}
+
+#ifdef LESTER_X86
+//lround, which rounds halfway away from zero where the conversion
+//instructions round to even. Splitting off the fraction is exact, so 
+//this lands on exactly what the scalar kernel gets
+TARGET("sse2")
+__m128i round_sse2(__m128 a) {
+    
+    __m128 sign = _mm_set1_ps(-0.0);
+    __m128 mag = _mm_andnot_ps(sign, a);
+    __m128i whole = _mm_cvttps_epi32(mag);
+    __m128i neg = _mm_srai_epi32(_mm_castps_si128(a), 31);
+    
+    whole = _mm_sub_epi32(whole, _mm_castps_si128(_mm_cmpge_ps(_mm_sub_ps(mag, _mm_cvtepi32_ps(whole)), _mm_set1_ps(0.5))));
+    
+    return _mm_sub_epi32(_mm_xor_si128(whole, neg), neg);
+}
+
+//SSE2 has no gather or masked stores, so the depth test and all of the
+//interpolation go four wide and the pixels that pass get written out
+//one at a time
+TARGET("sse2")
+int span_linear16_sse2(span *s, int first, int last) {
+    
+    int x, k, mask, written = 0;
+    unsigned short *depth = (unsigned short*)s->depth;
+    int newz[4], newu[4], newv[4];
+    texture *tex = s->tex;
+    __m128 d, z;
+    __m128 x1 = _mm_set1_ps(s->x1), z1 = _mm_set1_ps(s->z1), u1 = _mm_set1_ps(s->u1), v1 = _mm_set1_ps(s->v1);
+    __m128 mz = _mm_set1_ps(s->mz), mu = _mm_set1_ps(s->mu), mv = _mm_set1_ps(s->mv);
+    __m128 u_scale = _mm_set1_ps((float)(tex->width - 1)), v_scale = _mm_set1_ps((float)(tex->height - 1));
+    __m128i z_int, old, lanes = _mm_set_epi32(3, 2, 1, 0);
+    
+    for(x = first; x + 3 <= last; x += 4) {
+        
+        d = _mm_sub_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x), lanes)), x1);
+        z = _mm_add_ps(_mm_mul_ps(mz, d), z1);
+        z_int = round_sse2(_mm_min_ps(_mm_max_ps(z, _mm_setzero_ps()), _mm_set1_ps(65535.0)));
+        old = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)&depth[x]), _mm_setzero_si128());
+        
+        if(!(mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(z_int, old)))))
+            continue;
+        
+        _mm_storeu_si128((__m128i*)newz, z_int);
+        _mm_storeu_si128((__m128i*)newu, round_sse2(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(mu, d), u1), u_scale)));
+        _mm_storeu_si128((__m128i*)newv, round_sse2(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(mv, d), v1), v_scale)));
+        
+        for(k = 0; k < 4; k++) {
+            
+            if(!(mask & (1 << k)))
+                continue;
+                
+            s->color[x + k] = 0xFF000000 | tex->data[(unsigned int)newv[k] * tex->width + (unsigned int)newu[k]];
+            depth[x + k] = (unsigned short)newz[k];
+            written++;
+        }
+    }
+    
+    return written + span_linear16_scalar(s, x, last);
+}
+
+TARGET("avx2")
+__m256i round_avx2(__m256 a) {
+    
+    __m256 sign = _mm256_set1_ps(-0.0);
+    __m256 mag = _mm256_andnot_ps(sign, a);
+    __m256i whole = _mm256_cvttps_epi32(mag);
+    __m256i neg = _mm256_srai_epi32(_mm256_castps_si256(a), 31);
+    
+    whole = _mm256_sub_epi32(whole, _mm256_castps_si256(_mm256_cmp_ps(_mm256_sub_ps(mag, _mm256_cvtepi32_ps(whole)), _mm256_set1_ps(0.5), _CMP_GE_OQ)));
+    
+    return _mm256_sub_epi32(_mm256_xor_si256(whole, neg), neg);
+}
+
+//Eight pixels at a time end to end: texels are gathered for just the
+//pixels that passed the depth test and written back with masked stores
+TARGET("avx2")
+int span_linear16_avx2(span *s, int first, int last) {
+    
+    int x, mask, written = 0;
+    unsigned short *depth = (unsigned short*)s->depth;
+    texture *tex = s->tex;
+    __m256 d, z;
+    __m256 x1 = _mm256_set1_ps(s->x1), z1 = _mm256_set1_ps(s->z1), u1 = _mm256_set1_ps(s->u1), v1 = _mm256_set1_ps(s->v1);
+    __m256 mz = _mm256_set1_ps(s->mz), mu = _mm256_set1_ps(s->mu), mv = _mm256_set1_ps(s->mv);
+    __m256 u_scale = _mm256_set1_ps((float)(tex->width - 1)), v_scale = _mm256_set1_ps((float)(tex->height - 1));
+    __m256i z_int, pass, index, texel, packed, lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m128i old;
+    
+    for(x = first; x + 7 <= last; x += 8) {
+        
+        d = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), lanes)), x1);
+        z = _mm256_add_ps(_mm256_mul_ps(mz, d), z1);
+        z_int = round_avx2(_mm256_min_ps(_mm256_max_ps(z, _mm256_setzero_ps()), _mm256_set1_ps(65535.0)));
+        old = _mm_loadu_si128((__m128i*)&depth[x]);
+        pass = _mm256_cmpgt_epi32(_mm256_cvtepu16_epi32(old), z_int);
+        
+        if(!(mask = _mm256_movemask_ps(_mm256_castsi256_ps(pass))))
+            continue;
+            
+        index = _mm256_add_epi32(_mm256_mullo_epi32(round_avx2(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(mv, d), v1), v_scale)), _mm256_set1_epi32(tex->width)),
+                                 round_avx2(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(mu, d), u1), u_scale)));
+        texel = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (int*)tex->data, index, pass, 4);
+        _mm256_maskstore_epi32((int*)&(s->color[x]), pass, _mm256_or_si256(texel, _mm256_set1_epi32(0xFF000000)));
+        
+        //Packing works within 128 bit halves, so pull the low quarter 
+        //of each half together for the eight 16 bit results
+        packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(z_int, z_int), 0x08);
+        pass = _mm256_permute4x64_epi64(_mm256_packs_epi32(pass, pass), 0x08);
+        _mm_storeu_si128((__m128i*)&depth[x], _mm_blendv_epi8(old, _mm256_castsi256_si128(packed), _mm256_castsi256_si128(pass)));
+        
+        for(; mask; mask &= mask - 1)
+            written++;
+    }
+    
+    return written + span_linear16_scalar(s, x, last);
+}
+
+TARGET("sse2")
+int span_float_sse2(span *s, int first, int last, int format) {
+    
+    int x, k, mask, written = 0;
+    int newu[4], newv[4];
+    float *depth = (float*)s->depth, newz[4];
+    texture *tex = s->tex;
+    __m128 d, z, old, sign = _mm_set1_ps(format == DEPTH_REVERSED ? -1.0 : 1.0);
+    __m128 x1 = _mm_set1_ps(s->x1), z1 = _mm_set1_ps(s->z1), u1 = _mm_set1_ps(s->u1), v1 = _mm_set1_ps(s->v1);
+    __m128 mz = _mm_set1_ps(s->mz), mu = _mm_set1_ps(s->mu), mv = _mm_set1_ps(s->mv);
+    __m128 u_scale = _mm_set1_ps((float)(tex->width - 1)), v_scale = _mm_set1_ps((float)(tex->height - 1));
+    __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+    
+    for(x = first; x + 3 <= last; x += 4) {
+        
+        d = _mm_sub_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x), lanes)), x1);
+        z = _mm_add_ps(_mm_mul_ps(mz, d), z1);
+        old = _mm_loadu_ps(&depth[x]);
+        
+        if(!(mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_mul_ps(z, sign), _mm_mul_ps(old, sign)))))
+            continue;
+        
+        _mm_storeu_ps(newz, z);
+        _mm_storeu_si128((__m128i*)newu, round_sse2(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(mu, d), u1), u_scale)));
+        _mm_storeu_si128((__m128i*)newv, round_sse2(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(mv, d), v1), v_scale)));
+        
+        for(k = 0; k < 4; k++) {
+            
+            if(!(mask & (1 << k)))
+                continue;
+                
+            s->color[x + k] = 0xFF000000 | tex->data[(unsigned int)newv[k] * tex->width + (unsigned int)newu[k]];
+            depth[x + k] = newz[k];
+            written++;
+        }
+    }
+    
+    return written + (format == DEPTH_REVERSED ? span_reversed_scalar(s, x, last) : span_float32_scalar(s, x, last));
+}
+
+int span_float32_sse2(span *s, int first, int last) {
+    
+    return span_float_sse2(s, first, last, DEPTH_FLOAT32);
+}
+
+int span_reversed_sse2(span *s, int first, int last) {
+    
+    return span_float_sse2(s, first, last, DEPTH_REVERSED);
+}
+
+TARGET("avx2")
+int span_float_avx2(span *s, int first, int last, int format) {
+    
+    int x, mask, written = 0;
+    float *depth = (float*)s->depth;
+    texture *tex = s->tex;
+    __m256 d, z, old, pass, sign = _mm256_set1_ps(format == DEPTH_REVERSED ? -1.0 : 1.0);
+    __m256 x1 = _mm256_set1_ps(s->x1), z1 = _mm256_set1_ps(s->z1), u1 = _mm256_set1_ps(s->u1), v1 = _mm256_set1_ps(s->v1);
+    __m256 mz = _mm256_set1_ps(s->mz), mu = _mm256_set1_ps(s->mu), mv = _mm256_set1_ps(s->mv);
+    __m256 u_scale = _mm256_set1_ps((float)(tex->width - 1)), v_scale = _mm256_set1_ps((float)(tex->height - 1));
+    __m256i index, texel, lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    
+    for(x = first; x + 7 <= last; x += 8) {
+        
+        d = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), lanes)), x1);
+        z = _mm256_add_ps(_mm256_mul_ps(mz, d), z1);
+        old = _mm256_loadu_ps(&depth[x]);
+        pass = _mm256_cmp_ps(_mm256_mul_ps(z, sign), _mm256_mul_ps(old, sign), _CMP_LT_OQ);
+        
+        if(!(mask = _mm256_movemask_ps(pass)))
+            continue;
+            
+        index = _mm256_add_epi32(_mm256_mullo_epi32(round_avx2(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(mv, d), v1), v_scale)), _mm256_set1_epi32(tex->width)),
+                                 round_avx2(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(mu, d), u1), u_scale)));
+        texel = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (int*)tex->data, index, _mm256_castps_si256(pass), 4);
+        _mm256_maskstore_epi32((int*)&(s->color[x]), _mm256_castps_si256(pass), _mm256_or_si256(texel, _mm256_set1_epi32(0xFF000000)));
+        _mm256_maskstore_ps(&depth[x], _mm256_castps_si256(pass), z);
+        
+        for(; mask; mask &= mask - 1)
+            written++;
+    }
+    
+    return written + (format == DEPTH_REVERSED ? span_reversed_scalar(s, x, last) : span_float32_scalar(s, x, last));
+}
+
+int span_float32_avx2(span *s, int first, int last) {
+    
+    return span_float_avx2(s, first, last, DEPTH_FLOAT32);
+}
+
+int span_reversed_avx2(span *s, int first, int last) {
+    
+    return span_float_avx2(s, first, last, DEPTH_REVERSED);
+}
+#endif
+
+const char *span_names[SPAN_KERNELS] = { "scalar", "sse2", "avx2" };
+#ifdef LESTER_X86
+span_function span_kernels[DEPTH_FORMATS][SPAN_KERNELS] = {
+    { span_linear16_scalar, span_linear16_sse2, span_linear16_avx2 },
+    { span_float32_scalar, span_float32_sse2, span_float32_avx2 },
+    { span_reversed_scalar, span_reversed_sse2, span_reversed_avx2 }
+};
+#else
+span_function span_kernels[DEPTH_FORMATS][SPAN_KERNELS] = {
+    { span_linear16_scalar, span_linear16_scalar, span_linear16_scalar },
+    { span_float32_scalar, span_float32_scalar, span_float32_scalar },
+    { span_reversed_scalar, span_reversed_scalar, span_reversed_scalar }
+};
+#endif
+int span_kernel = SPAN_SCALAR;
+
+int span_kernel_supported(int kernel) {
+    
+    switch(kernel) {
+        
+        case SPAN_SCALAR:
+            return 1;
+#ifdef LESTER_X86
+        case SPAN_SSE2:
+            return SDL_HasSSE2();
+            
+        case SPAN_AVX2:
+            return SDL_HasAVX2();
+#endif
+    }
+    
+    return 0;
+}
+
+//Use the given kernel, or the widest the CPU runs when it is -1
+int init_span_kernel(int kernel) {
+    
+    int i;
+    
+    if(kernel < 0) {
+        
+        for(kernel = SPAN_KERNELS - 1; !span_kernel_supported(kernel); kernel--);
+    } else if(kernel >= SPAN_KERNELS) {
+        
+        printf("[init_span_kernel] Unknown span kernel, use one of scalar, sse2 or avx2\n");
+        return 0;
+    } else if(!span_kernel_supported(kernel)) {
+        
+        printf("[init_span_kernel] This CPU can't run the %s span kernel\n", span_names[kernel]);
+        return 0;
+    }
+    
+    span_kernel = kernel;
+    
+    for(i = 0; i < DEPTH_FORMATS; i++)
+        span_fillers[i][STATE_DEFAULT] = span_kernels[i][kernel];
+    
+    return 1;
+}
+
+//Fill pixels first through last of a row, with the interpolants taken
+//from the triangle's planes at the last pixel's center. Only the part of
+//the row that is on the screen gets handed to the filler. s comes in
+//with the triangle's texture, colors, state and slopes filled in
+void draw_scanline(SDL_Renderer *r, int row, int first, int last, span *s, gradients *g, span_function fill) {
+    
+    int pixels, tested = 0, written = 0;
+    float fx, fy, u0, v0;
+    
+    //Spans write to the framebuffer now, the renderer is left unused
+    (void)r;
+    
+    //Slivers can have rows without a single pixel center inside
+    if(first > last)
+        return;
+    
+    STAT_ADD(STAT_SPANS, 1);
+    PROFILE_BEGIN(PROF_SPAN);
+    fx = last + 0.5 - g->x;
+    fy = row + 0.5 - g->y;
+    s->x1 = last;
+    s->z1 = g->z + g->dzdx*fx + g->dzdy*fy;
+    s->w1 = g->w + g->dwdx*fx + g->dwdy*fy;
+    s->u1 = g->u + g->dudx*fx + g->dudy*fy;
+    s->v1 = g->v + g->dvdx*fx + g->dvdy*fy;
+    s->mu = g->dudx;
+    s->mv = g->dvdx;
+    
+    //Pixel centers are inside the triangle so u and v only leave the
+    //texture by rounding or when a vertex's do. Clamp them to 1.0 x 1.0
+    //space at both ends then, unless they are still divided by z and
+    //get clamped per pixel instead
+    if(!(s->state & STATE_PERSPECTIVE)) {
+        
+        fx = (float)(last - first);
+        u0 = s->u1 - s->mu*fx;
+        v0 = s->v1 - s->mv*fx;
+        
+        if(u0 < 0.0 || u0 > 1.0 || s->u1 < 0.0 || s->u1 > 1.0 || v0 < 0.0 || v0 > 1.0 || s->v1 < 0.0 || s->v1 > 1.0) {
+            
+            u0 = u0 < 0.0 ? 0.0 : u0 > 1.0 ? 1.0 : u0;
+            v0 = v0 < 0.0 ? 0.0 : v0 > 1.0 ? 1.0 : v0;
+            s->u1 = s->u1 < 0.0 ? 0.0 : s->u1 > 1.0 ? 1.0 : s->u1;
+            s->v1 = s->v1 < 0.0 ? 0.0 : s->v1 > 1.0 ? 1.0 : s->v1;
+            s->mu = fx ? (s->u1 - u0) / fx : 0;
+            s->mv = fx ? (s->v1 - v0) / fx : 0;
+        }
+    }
+    
+    pixels = last - first + 1;
+    first = first < 0 ? 0 : first;
+    last = last >= screen.width ? screen.width - 1 : last;
+    
+    if(first <= last) {
+        
+        s->color = &screen.fbuf[row * screen.width];
+        s->depth = (char*)screen.zbuf + row * screen.width * depth_bytes[screen.depth_format];
+        tested = last - first + 1;
+        written = fill(s, first, last);
+    }
+    
+    //Tallied once per span to keep the pixel loop free of them
+    STAT_ADD(STAT_PIXELS, pixels);
+    STAT_ADD(STAT_OFFSCREEN, pixels - tested);
+    STAT_ADD(STAT_DEPTH_FAILED, tested - written);
+    STAT_ADD(STAT_WRITTEN, written);
+    PROFILE_END();
+}
+
+//Start an edge from a down to b on the given row. Its x there is the
+//ceiling of where the edge crosses the row's pixel centers, less half a
+//pixel, all in subpixels. b has to be below a
+void edge_setup(edge *e, screen_point *a, screen_point *b, int row) {
+    
+    long long num, inc;
+    
+    e->den = (long long)(b->y - a->y) * SUBPIXEL_ONE;
+    num = (long long)(a->x - SUBPIXEL_HALF) * (b->y - a->y) + (long long)(b->x - a->x) * (row * SUBPIXEL_ONE + SUBPIXEL_HALF - a->y);
+    inc = (long long)(b->x - a->x) * SUBPIXEL_ONE;
+    e->x = (int)CEIL_DIV(num, e->den);
+    e->err = (long long)e->x * e->den - num;
+    e->step = (int)FLOOR_DIV(inc, e->den);
+    e->rem = inc - (long long)e->step * e->den;
+}
+
+void edge_step(edge *e) {
+    
+    e->x += e->step;
+    e->err -= e->rem;
+    
+    if(e->err < 0) {
+        
+        e->x++;
+        e->err += e->den;
+    }
+}
+
+//Triangles that fit in a few pixels each way skip the edge setup and test
+//each pixel center in their bounding box against the edges instead. The
+//edge functions are exact in subpixels and follow the same rule as the
+//stepped edges in draw_triangle: a center on a left edge is in, one on
+//a right edge is out. a, b and c are sorted by ascending y, area is
+//twice the triangle's signed area and rows top through bottom - 1 are
+//the ones to draw, with the short edges switching over at middle
+void draw_small_triangle(SDL_Renderer *rend, screen_point *a, screen_point *b, screen_point *c, long long area, int top, int middle, int bottom, span *sp, gradients *g, span_function fill) {
+    
+    int x, y, cy, first, last, min_x, max_x, left, right;
+    screen_point *e, *n, *l0, *l1, *r0, *r1;
+    
+    min_x = a->x < b->x ? a->x : b->x;
+    min_x = c->x < min_x ? c->x : min_x;
+    max_x = a->x > b->x ? a->x : b->x;
+    max_x = c->x > max_x ? c->x : max_x;
+    min_x = CEIL_DIV(min_x - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    max_x = CEIL_DIV(max_x - SUBPIXEL_HALF, SUBPIXEL_ONE) - 1;
+    
+    for(y = top; y < bottom; y++) {
+        
+        //The short edge the row crosses runs from e down to n. With a
+        //negative area the middle vertex, and so the short edge, is on
+        //the left
+        e = y < middle ? a : b;
+        n = y < middle ? b : c;
+        l0 = area < 0 ? e : a;
+        l1 = area < 0 ? n : c;
+        r0 = area < 0 ? a : e;
+        r1 = area < 0 ? c : n;
+        cy = y * SUBPIXEL_ONE + SUBPIXEL_HALF;
+        left = (min_x * SUBPIXEL_ONE + SUBPIXEL_HALF - l0->x)*(l1->y - l0->y) - (l1->x - l0->x)*(cy - l0->y);
+        right = (r0->x - min_x * SUBPIXEL_ONE - SUBPIXEL_HALF)*(r1->y - r0->y) + (r1->x - r0->x)*(cy - r0->y);
+        first = max_x + 1;
+        last = min_x - 1;
+        
+        for(x = min_x; x <= max_x; x++) {
+            
+            if(left >= 0 && right > 0) {
+                
+                first = x < first ? x : first;
+                last = x;
+            }
+            
+            left += SUBPIXEL_ONE * (l1->y - l0->y);
+            right -= SUBPIXEL_ONE * (r1->y - r0->y);
+        }
+        
+        draw_scanline(rend, y, first, last, sp, g, fill);
+    }
+}
+
+//The fixed point build sets up and clips its own triangles, and its
+//raster lists hold those instead
+#ifndef LESTER_FIXED
+void draw_triangle(SDL_Renderer *rend, triangle* tri) {
+    
+    int i;
+    screen_point p[3];
+    float vec_a[3];
+    float vec_b[3];
+    float cross[3];
+    float mag;
+    float normal_angle;
+    float lighting_pct;
+    span sp;
+    span_function fill;
+    unsigned char f, s, t, e;
+    int min_x, max_x, row, top, middle, bottom, small;
+    long long area;
+    float dx_1, dy_1, dx_3, dy_3, inv;
+    gradients g;
+    edge long_edge, short_edge;
+    
+    //Every band sees every triangle, so only the one at the top counts it
+    if(!raster_top)
+        STAT_ADD(STAT_DRAWN, 1);
+    
+    //Don't draw the triangle if it's offscreen
+    if(tri->v[0].z < 0 && tri->v[1].z < 0 && tri->v[2].z < 0)
+        return;
+    
+    if(tri->has_plane) {
+        
+        //Static geometry arrives with its view space normal and has
+        //already been backface culled against the camera position
+        normal_angle = acos(-tri->p.z);
+    } else {
+        
+        //Calculate the surface normal
+        //subtract 3 from 2 and 1, translating it to the origin
+        vec_a[0] = tri->v[0].x - tri->v[2].x;
+        vec_a[1] = tri->v[0].y - tri->v[2].y;
+        vec_a[2] = tri->v[0].z - tri->v[2].z;
+        vec_b[0] = tri->v[1].x - tri->v[2].x;
+        vec_b[1] = tri->v[1].y - tri->v[2].y;
+        vec_b[2] = tri->v[1].z - tri->v[2].z;
+        
+        //calculate the cross product using 1 as vector a and 2 as vector b
+        cross[0] = vec_a[1]*vec_b[2] - vec_a[2]*vec_b[1];
+        cross[1] = vec_a[2]*vec_b[0] - vec_a[0]*vec_b[2];
+        cross[2] = vec_a[0]*vec_b[1] - vec_a[1]*vec_b[0]; 
+        
+        //normalize the result vector
+        mag = sqrt(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
+        cross[0] /= mag;
+        cross[1] /= mag;
+        cross[2] /= mag;
+            
+        //Calculate the normal's angle vs the camera view direction
+        normal_angle = acos(-cross[2]);
+        
+        //If the normal is facing away from the camera, don't bother drawing it
+        if(normal_angle >= (3*PI/4)) {
+            
+            if(!raster_top)
+                STAT_ADD(STAT_CULLED, 1);
+                
+            return;
+        }
+    }
+    
+    //Calculate the shading based on the angle between the camera and the
+    //surface normal, and pick the span filler for the triangle's state
+    lighting_pct = 1.0 - (normal_angle/PI);
+    sp.light = (int)(lighting_pct * 256);
+    sp.flat = (tri->v[0].c->r << 16) | (tri->v[0].c->g << 8) | tri->v[0].c->b;
+    sp.alpha = tri->v[0].c->a + (tri->v[0].c->a >> 7);
+    sp.tex = tri->t;
+    sp.state = tri->state;
+    
+    if((sp.state & STATE_TEXTURED) && tri->t->runs)
+        sp.state |= STATE_KEYED;
+        
+    fill = span_fillers[screen.depth_format][sp.state];
+    
+    //Move the vertices from world space to screen space
+    for(i = 0; i < 3; i++) 
+        project(&(tri->v[i]), &p[i]);
+        
+    //Perspective correct texturing interpolates u/z, v/z and 1/z
+    if(tri->state & STATE_PERSPECTIVE) {
+        
+        for(i = 0; i < 3; i++) {
+            
+            p[i].u *= p[i].w;
+            p[i].v *= p[i].w;
+        }
+    }
+    
+    //sort vertices by ascending y
+    f = 0; s = 1; t = 2;
+    if(p[f].y > p[s].y) {
+        e = s;
+        s = f;
+        f = e;
+    }
+    if(p[s].y > p[t].y) {
+        e = t;
+        t = s;
+        s = e;
+    }
+    if(p[f].y > p[s].y) {
+        e = s;
+        s = f;
+        f = e;
+    }
+                    
+    //Twice the signed area in subpixels, negative when the middle vertex
+    //is left of the long edge. Without any there's nothing to cover
+    area = (long long)(p[s].x - p[f].x)*(p[t].y - p[f].y) - (long long)(p[t].x - p[f].x)*(p[s].y - p[f].y);
+    
+    if(!area)
+        return;
+    
+    //A row is drawn when its pixel centers are at or below the top vertex
+    //and above the bottom one, so rows shared by two triangles are only
+    //drawn once. The short edges switch over at the middle vertex
+    top = CEIL_DIV(p[f].y - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    middle = CEIL_DIV(p[s].y - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    bottom = CEIL_DIV(p[t].y - SUBPIXEL_HALF, SUBPIXEL_ONE);
+    
+    //Triangles only a few pixels across would spend more time in the
+    //edge setup than drawing, so they get tested pixel by pixel instead.
+    //That's decided on the whole triangle, so every band agrees on it
+    min_x = p[0].x < p[1].x ? p[0].x : p[1].x;
+    min_x = p[2].x < min_x ? p[2].x : min_x;
+    max_x = p[0].x > p[1].x ? p[0].x : p[1].x;
+    max_x = p[2].x > max_x ? p[2].x : max_x;
+    small = max_x - min_x < SMALL_TRIANGLE_SIZE * SUBPIXEL_ONE && bottom - top < SMALL_TRIANGLE_SIZE;
+    
+    if(small && !raster_top)
+        STAT_ADD(STAT_SMALL, 1);
+    
+    //Only the rows inside the thread's band and on the screen get walked
+    top = top > raster_top ? top : raster_top;
+    top = top > 0 ? top : 0;
+    bottom = bottom < raster_bottom ? bottom : raster_bottom;
+    bottom = bottom < screen.height ? bottom : screen.height;
+    
+    if(top >= bottom)
+        return;
+    
+    //The planes of z, u, v and w, from one reciprocal of the area
+    g.x = p[f].x / (float)SUBPIXEL_ONE;
+    g.y = p[f].y / (float)SUBPIXEL_ONE;
+    g.z = p[f].z;
+    g.u = p[f].u;
+    g.v = p[f].v;
+    g.w = p[f].w;
+    dx_1 = (p[s].x - p[f].x) / (float)SUBPIXEL_ONE;
+    dy_1 = (p[s].y - p[f].y) / (float)SUBPIXEL_ONE;
+    dx_3 = (p[t].x - p[f].x) / (float)SUBPIXEL_ONE;
+    dy_3 = (p[t].y - p[f].y) / (float)SUBPIXEL_ONE;
+    inv = (float)(SUBPIXEL_ONE * SUBPIXEL_ONE) / area;
+    g.dzdx = ((p[s].z - p[f].z)*dy_3 - (p[t].z - p[f].z)*dy_1) * inv;
+    g.dzdy = ((p[t].z - p[f].z)*dx_1 - (p[s].z - p[f].z)*dx_3) * inv;
+    g.dudx = ((p[s].u - p[f].u)*dy_3 - (p[t].u - p[f].u)*dy_1) * inv;
+    g.dudy = ((p[t].u - p[f].u)*dx_1 - (p[s].u - p[f].u)*dx_3) * inv;
+    g.dvdx = ((p[s].v - p[f].v)*dy_3 - (p[t].v - p[f].v)*dy_1) * inv;
+    g.dvdy = ((p[t].v - p[f].v)*dx_1 - (p[s].v - p[f].v)*dx_3) * inv;
+    g.dwdx = ((p[s].w - p[f].w)*dy_3 - (p[t].w - p[f].w)*dy_1) * inv;
+    g.dwdy = ((p[t].w - p[f].w)*dx_1 - (p[s].w - p[f].w)*dx_3) * inv;
+    sp.mz = g.dzdx;
+    sp.mw = g.dwdx;
+    
+    if(small) {
+        
+        draw_small_triangle(rend, &p[f], &p[s], &p[t], area, top, middle, bottom, &sp, &g, fill);
+        return;
+    }
+    
+    //Edge 3 is the long edge that both the top half, against edge 1, and
+    //the bottom half, against edge 2, share
+    edge_setup(&long_edge, &p[f], &p[t], top);
+    
+    if(top < middle)
+        edge_setup(&short_edge, &p[f], &p[s], top);
+    
+    for(row = top; row < bottom; row++) {
+        
+        if(row == (top > middle ? top : middle))
+            edge_setup(&short_edge, &p[s], &p[t], row);
+            
+        //Left edges are in and right ones out
+        if(area < 0)
+            draw_scanline(rend, row, short_edge.x, long_edge.x - 1, &sp, &g, fill);
+        else
+            draw_scanline(rend, row, long_edge.x, short_edge.x - 1, &sp, &g, fill);
+        
+        edge_step(&long_edge);
+        edge_step(&short_edge);
+    }
+}
+
+void clip_and_render(SDL_Renderer *r, triangle* tri) {    
+
+    int count;
+    int on_second_iteration = 0;
+    int i;
+    float plane_z = NEAR_PLANE;
+    float scale_factor, dx, dy, dz, du, dv, ndz;
+    unsigned char point_marked[3] = {0, 0, 0};
+    vertex new_point[2]; 
+    triangle out_triangle[2];
+    int fixed[2];
+    int original;
+    
+    
+    //Note that in the future we're also going to need to clip on the
+    //'U', 'V' and color axes
+    while(1) {
+        
+        count = 0;
+        
+        //Check each point to see if it's greater than the plane
+        for(i = 0; i < 3; i++) {
+            
+            if((on_second_iteration && tri->v[i].z > plane_z) || 
+              (!on_second_iteration && tri->v[i].z < plane_z)) {
+
+                point_marked[i] = 1;
+                count++;
+            } else {
+                
+                point_marked[i] = 0;
+            }
+        }
+            
+        switch(count) {
+            
+            //If all of the vertices were out of range, 
+            //skip drawing the whole thing entirely
+            case 3:
+                STAT_ADD(STAT_REJECTED, 1);
+                return;
+                break;
+            
+            //If one vertex was out, find it's edge intersections and
+            //build two new triangles out of it
+            case 1:
+                STAT_ADD(STAT_SPLIT_TWO, 1);
+                
+                //Figure out what the other two points are
+                fixed[0] = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
+                fixed[1] = fixed[0] == 0 ? point_marked[1] ? 2 : 1 : fixed[0] == 1 ? point_marked[0] ? 2 : 0 : point_marked[0] ? 1 : 0;
+                original = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
+                
+                //Calculate the new intersection points
+                for(i = 0; i < 2; i++) {
+                    
+                    //x,y, and z 'length'
+                    dx = tri->v[original].x - tri->v[fixed[i]].x;
+                    dy = tri->v[original].y - tri->v[fixed[i]].y;
+                    dz = tri->v[original].z - tri->v[fixed[i]].z;
+                    du = tri->v[original].u - tri->v[fixed[i]].u;
+                    dv = tri->v[original].v - tri->v[fixed[i]].v;
+                                       
+                    //Set the known axis value
+                    new_point[i].z = plane_z; //Replace this with a line function
+                    
+                    //z 'length' of new point
+                    ndz = new_point[i].z - tri->v[fixed[i]].z;
+                    
+                    //ratio of new y-length to to old
+                    scale_factor = ndz/dz; //For now, we're dealing with a plane orthogonal to the clipping axis and as such 
+                                           //we can't possibly have zero dy because that would place both the 'in' and 'out'
+                                           //vertexes behind the plane, which is obviously impossible, so we won't worry about
+                                           //that case until we start playing with sloped clipping planes
+                    
+                    //Scale the independent axis value by the scaling factor
+                    //We can do this for other arbitrary axes in the future, such as U and V
+                    //Update: AND NOW WE ARE, MOTHERFUCKER
+                    new_point[i].x = scale_factor * dx + tri->v[fixed[i]].x;
+                    new_point[i].y = scale_factor * dy + tri->v[fixed[i]].y;
+                    new_point[i].u = scale_factor * du + tri->v[fixed[i]].u;
+                    new_point[i].v = scale_factor * dv + tri->v[fixed[i]].v;
+                    
+                    //Copy the color information
+                    new_point[i].c = tri->v[fixed[i]].c;
+                }   
+                
+                //Test/draw the new triangles, maintaining the CW or CCW ordering
+                //Build the first triangle
+                clone_vertex(&new_point[0], &(out_triangle[0].v[original]));
+                clone_vertex(&(tri->v[fixed[0]]), &(out_triangle[0].v[fixed[0]]));
+                clone_vertex(&(tri->v[fixed[1]]), &(out_triangle[0].v[fixed[1]]));
+                    
+                //Build the second triangle    
+                clone_vertex(&new_point[1], &(out_triangle[1].v[original]));
+                clone_vertex(&new_point[0], &(out_triangle[1].v[fixed[0]]));
+                clone_vertex(&(tri->v[fixed[1]]), &(out_triangle[1].v[fixed[1]]));
+                
+                //Run the new triangles through another round of processing
+                out_triangle[0].t = out_triangle[1].t = tri->t;
+                out_triangle[0].p = out_triangle[1].p = tri->p;
+                out_triangle[0].has_plane = out_triangle[1].has_plane = tri->has_plane;
+                out_triangle[0].state = out_triangle[1].state = tri->state;
+                clip_and_render(r, &out_triangle[0]);
+                clip_and_render(r, &out_triangle[1]);
+                
+                //Exit the function early for dat tail recursion              
+                return;
+                break;
+            
+            case 2:
+                STAT_ADD(STAT_SPLIT_ONE, 1);
+                
+                //Figure out which point we're keeping
+                original = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
+                fixed[0] = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
+                fixed[1] = fixed[0] == 0 ? point_marked[1] ? 1 : 2 : fixed[0] == 1 ? point_marked[0] ? 0 : 2 : point_marked[0] ? 0 : 1;
+                            
+                //Calculate the new intersection points
+                for(i = 0; i < 2; i++) {
+                    
+                    //x,y, and z 'length'
+                    dx = tri->v[original].x - tri->v[fixed[i]].x;
+                    dy = tri->v[original].y - tri->v[fixed[i]].y;
+                    dz = tri->v[original].z - tri->v[fixed[i]].z;
+                    du = tri->v[original].u - tri->v[fixed[i]].u;
+                    dv = tri->v[original].v - tri->v[fixed[i]].v;
+                                       
+                    //Set the known axis value
+                    new_point[i].z = plane_z; //Replace this with a line function
+                    
+                    //z 'length' of new point
+                    ndz = new_point[i].z - tri->v[fixed[i]].z;
+                    
+                    //ratio of new y-length to to old
+                    scale_factor = ndz/dz; //For now, we're dealing with a plane orthogonal to the clipping axis and as such 
+                                           //we can't possibly have zero dy because that would place both the 'in' and 'out'
+                                           //vertexes behind the plane, which is obviously impossible, so we won't worry about
+                                           //that case until we start playing with sloped clipping planes
+                    
+                    //Scale the independent axis value by the scaling factor
+                    //We can do this for other arbitrary axes in the future, such as U and V
+                    //Update: AND NOW WE ARE, MOTHERFUCKER
+                    new_point[i].x = scale_factor * dx + tri->v[fixed[i]].x;
+                    new_point[i].y = scale_factor * dy + tri->v[fixed[i]].y;
+                    new_point[i].u = scale_factor * du + tri->v[fixed[i]].u;
+                    new_point[i].v = scale_factor * dv + tri->v[fixed[i]].v;
+                    
+                    //Copy the color information
+                    new_point[i].c = tri->v[fixed[i]].c;
+                }      
+                
+                //Start building the new triangles, maintaining the CW or CCW ordering 
+                clone_vertex(&(tri->v[original]), &(out_triangle[0].v[original]));
+                clone_vertex(&new_point[0], &(out_triangle[0].v[fixed[0]]));
+                clone_vertex(&new_point[1], &(out_triangle[0].v[fixed[1]]));
+                
+                //Send through processing again
+                out_triangle[0].t = tri->t;
+                out_triangle[0].p = tri->p;
+                out_triangle[0].has_plane = tri->has_plane;
+                out_triangle[0].state = tri->state;
+                clip_and_render(r, &out_triangle[0]);
+                    
+                //Exit the function early for dat tail recursion  
+                return;
+                break;
+            
+            //If there were no intersections we won't do anything and 
+            //allow execution to flow through
+            case 0:
+            default:
+                break; 
+        }
+
+        //If we hit case 0 both times above, all points on this
+        //triangle lie in the drawable area and we can leave this
+        //clipping loop and flow down to do the drawing of the 
+        //processed triangle         
+        if(on_second_iteration)
+            break;
+        
+        on_second_iteration = 1;
+        plane_z = SCREEN_DEPTH;
+    }    
+    
+    //If we got this far, the triangle is drawable. So we should do that. Or whatever.
+    if(raster_target) {
+        
+        raster_list_add(raster_target, tri);
+        return;
+    }
+    
+    PROFILE_BEGIN(PROF_SETUP);
+    draw_triangle(r, tri);   
+    PROFILE_END();
+}
+#else
+//Convert without touching the FPU by pulling the mantissa out of the 
+//IEEE bits and shifting it into 16.16 place, truncating toward zero
+fixed float_to_fixed(float f) {
+    
+    union {
+        float f;
+        unsigned int i;
+    } bits;
+    int exponent, shift;
+    unsigned int mantissa;
+    fixed result;
+    
+    bits.f = f;
+    exponent = (bits.i >> 23) & 0xFF;
+    
+    //Zero and denormals
+    if(!exponent)
+        return 0;
+        
+    //The value is mantissa * 2^(exponent - 150), and we want it * 2^16
+    mantissa = (bits.i & 0x7FFFFF) | 0x800000;
+    shift = exponent - 134;
+    
+    if(shift >= 8)
+        result = 0x7FFFFFFF;
+    else if(shift >= 0)
+        result = mantissa << shift;
+    else if(shift > -24)
+        result = mantissa >> -shift;
+    else
+        result = 0;
+        
+    return (bits.i & 0x80000000) ? -result : result;
+}
+
+void dda_setup(dda *d, int start, int delta, int den) {
+    
+    d->value = start;
+    d->den = den > 0 ? den : 1;
+    d->step = delta / d->den;
+    d->rem = delta % d->den;
+    d->err = 0;
+    
+    //Keep the remainder positive so stepping always floors
+    if(d->rem < 0) {
+        
+        d->step--;
+        d->rem += d->den;
+    }
+}
+
+void dda_step(dda *d) {
+    
+    d->value += d->step;
+    d->err += d->rem;
+    
+    if(d->err >= d->den) {
+        
+        d->value++;
+        d->err -= d->den;
+    }
+}
+
+void transform_vertex_fixed(camera *cam, vertex *src, fixed_vertex *dst) {
+    
+    fixed dx = float_to_fixed(src->x) - cam->fixed_pos[0];
+    fixed dy = float_to_fixed(src->y) - cam->fixed_pos[1];
+    fixed dz = float_to_fixed(src->z) - cam->fixed_pos[2];
+    
+    dst->x = FIXED_MUL(cam->fixed_view[0][0], dx) + FIXED_MUL(cam->fixed_view[0][1], dy) + FIXED_MUL(cam->fixed_view[0][2], dz);
+    dst->y = FIXED_MUL(cam->fixed_view[1][0], dx) + FIXED_MUL(cam->fixed_view[1][1], dy) + FIXED_MUL(cam->fixed_view[1][2], dz);
+    dst->z = FIXED_MUL(cam->fixed_view[2][0], dx) + FIXED_MUL(cam->fixed_view[2][1], dy) + FIXED_MUL(cam->fixed_view[2][2], dz);
+    dst->u = float_to_fixed(src->u);
+    dst->v = float_to_fixed(src->v);
+    dst->c = src->c;
+}
+
+void project_fixed(fixed_vertex *v, fixed_screen_point *p, fixed focal) {
+    
+    fixed delta = v->z == 0 ? FIXED_ONE : FIXED_DIV(focal, v->z);
+    
+    //Same mapping as TO_SCREEN_X/Y/Z in whole pixels, kept in 64 bits
+    //until the fraction is dropped
+    p->x = (int)((((long long)screen.width << FIXED_SHIFT) + (((long long)v->x * delta) >> FIXED_SHIFT) * screen.height) >> (FIXED_SHIFT + 1));
+    p->y = (int)((((long long)screen.height << FIXED_SHIFT) - (((long long)v->y * delta) >> FIXED_SHIFT) * screen.height) >> (FIXED_SHIFT + 1));
+    p->z = v->z > FIXED_CONST(SCREEN_DEPTH) || v->z < 0 ? 65535 : (int)(((long long)v->z * 65535) / FIXED_CONST(SCREEN_DEPTH));
+    p->u = v->u;
+    p->v = v->v;
+}
+
+//Untextured triangles pass a NULL tex and get filled with flat instead
+void draw_scanline_fixed(SDL_Renderer *r, int scanline, int x0, int z0, fixed u0, fixed v0, int x1, int z1, fixed u1, fixed v1, texture *tex, unsigned int flat) {
+    
+    int t, x, z_addr, newz, tested = 0, written = 0, width = screen.width;
+    unsigned int newu, newv, texel, *fbuf = screen.fbuf;
+    unsigned short *zbuf = screen.zbuf;
+    dda z, u, v;
+    
+    (void)r;
+    STAT_ADD(STAT_SPANS, 1);
+    
+    if(scanline >= screen.height || scanline < 0) {
+        
+        STAT_ADD(STAT_OFFSCREEN, abs(x1 - x0) + 1);
+        return;
+    }
+        
+    PROFILE_BEGIN(PROF_SPAN);
+    
+    //Clamp u and v values to 1.0 x 1.0 space
+    u0 = u0 < 0 ? 0 : u0 > FIXED_ONE ? FIXED_ONE : u0;
+    u1 = u1 < 0 ? 0 : u1 > FIXED_ONE ? FIXED_ONE : u1;
+    v0 = v0 < 0 ? 0 : v0 > FIXED_ONE ? FIXED_ONE : v0;
+    v1 = v1 < 0 ? 0 : v1 > FIXED_ONE ? FIXED_ONE : v1;
+    
+    if(x0 > x1) {
+        
+        t = x0; x0 = x1; x1 = t;
+        t = z0; z0 = z1; z1 = t;
+        t = u0; u0 = u1; u1 = t;
+        t = v0; v0 = v1; v1 = t;
+    }
+    
+    dda_setup(&z, z0, z1 - z0, x1 - x0);
+    dda_setup(&u, u0, u1 - u0, x1 - x0);
+    dda_setup(&v, v0, v1 - v0, x1 - x0);
+    z_addr = scanline * width + x0;
+    
+    for(x = x0; x <= x1; x++, z_addr++, dda_step(&z), dda_step(&u), dda_step(&v)) {
+        
+        if(x >= width || x < 0)
+            continue;
+            
+        tested++;
+        newz = z.value > 65535 ? 65535 : z.value < 0 ? 0 : z.value;
+        
+        if(newz >= zbuf[z_addr])
+            continue;
+            
+        if(tex) {
+            
+            newu = (unsigned int)(((long long)u.value * (tex->width - 1) + FIXED_HALF) >> FIXED_SHIFT);
+            newv = (unsigned int)(((long long)v.value * (tex->height - 1) + FIXED_HALF) >> FIXED_SHIFT);
+            texel = tex->data[newv * tex->width + newu];
+            
+            //Keyed texels let what's behind show through
+            if(tex->runs && texel == tex->key)
+                continue;
+        } else {
+            
+            texel = flat;
+        }
+        
+        fbuf[z_addr] = 0xFF000000 | texel;
+        zbuf[z_addr] = newz;
+        written++;
+    }
+    
+    STAT_ADD(STAT_PIXELS, x1 - x0 + 1);
+    STAT_ADD(STAT_OFFSCREEN, x1 - x0 + 1 - tested);
+    STAT_ADD(STAT_DEPTH_FAILED, tested - written);
+    STAT_ADD(STAT_WRITTEN, written);
+    PROFILE_END();
+}
+
+void draw_triangle_fixed(SDL_Renderer *rend, fixed_triangle *tri, fixed focal) {
+    
+    int i, s;
+    fixed_screen_point p[3];
+    fixed vec_a[3], vec_b[3];
+    long long cross[3];
+    unsigned long long mag2;
+    unsigned int flat;
+    unsigned char f, m, l, e;
+    dda x_1, z_1, u_1, v_1, x_2, z_2, u_2, v_2, x_3, z_3, u_3, v_3;
+    
+    if(!raster_top)
+        STAT_ADD(STAT_DRAWN, 1);
+    
+    //Don't draw the triangle if it's offscreen
+    if(tri->v[0].z < 0 && tri->v[1].z < 0 && tri->v[2].z < 0)
+        return;
+        
+    //Static triangles were culled against their plane already
+    if(!tri->has_plane) {
+        
+        vec_a[0] = tri->v[0].x - tri->v[2].x;
+        vec_a[1] = tri->v[0].y - tri->v[2].y;
+        vec_a[2] = tri->v[0].z - tri->v[2].z;
+        vec_b[0] = tri->v[1].x - tri->v[2].x;
+        vec_b[1] = tri->v[1].y - tri->v[2].y;
+        vec_b[2] = tri->v[1].z - tri->v[2].z;
+        cross[0] = ((long long)vec_a[1]*vec_b[2] - (long long)vec_a[2]*vec_b[1]) >> FIXED_SHIFT;
+        cross[1] = ((long long)vec_a[2]*vec_b[0] - (long long)vec_a[0]*vec_b[2]) >> FIXED_SHIFT;
+        cross[2] = ((long long)vec_a[0]*vec_b[1] - (long long)vec_a[1]*vec_b[0]) >> FIXED_SHIFT;
+        mag2 = (unsigned long long)(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
+        
+        //Same 135 degree cutoff as the float path: cull once nz/|n| 
+        //reaches sqrt(2)/2, which squared needs no sqrt at all
+        if(cross[2] >= 0 && 2 * (unsigned long long)(cross[2]*cross[2]) >= mag2) {
+            
+            if(!raster_top)
+                STAT_ADD(STAT_CULLED, 1);
+                
+            return;
+        }
+    }
+    
+    //Same as the float path, untextured triangles take the first
+    //vertex's color
+    flat = tri->t ? 0 : (tri->v[0].c->r << 16) | (tri->v[0].c->g << 8) | tri->v[0].c->b;
+    
+    for(i = 0; i < 3; i++)
+        project_fixed(&(tri->v[i]), &p[i], focal);
+        
+    //sort vertices by ascending y
+    f = 0; m = 1; l = 2;
+    if(p[f].y > p[m].y) { e = m; m = f; f = e; }
+    if(p[m].y > p[l].y) { e = l; l = m; m = e; }
+    if(p[f].y > p[m].y) { e = m; m = f; f = e; }
+    
+    if(p[l].y <= raster_top || p[f].y >= raster_bottom)
+        return;
+    
+    //Edge 3 is the long edge, 1 and 2 the short ones above and below
+    dda_setup(&x_1, p[f].x, p[m].x - p[f].x, p[m].y - p[f].y);
+    dda_setup(&z_1, p[f].z, p[m].z - p[f].z, p[m].y - p[f].y);
+    dda_setup(&u_1, p[f].u, p[m].u - p[f].u, p[m].y - p[f].y);
+    dda_setup(&v_1, p[f].v, p[m].v - p[f].v, p[m].y - p[f].y);
+    dda_setup(&x_2, p[m].x, p[l].x - p[m].x, p[l].y - p[m].y);
+    dda_setup(&z_2, p[m].z, p[l].z - p[m].z, p[l].y - p[m].y);
+    dda_setup(&u_2, p[m].u, p[l].u - p[m].u, p[l].y - p[m].y);
+    dda_setup(&v_2, p[m].v, p[l].v - p[m].v, p[l].y - p[m].y);
+    dda_setup(&x_3, p[f].x, p[l].x - p[f].x, p[l].y - p[f].y);
+    dda_setup(&z_3, p[f].z, p[l].z - p[f].z, p[l].y - p[f].y);
+    dda_setup(&u_3, p[f].u, p[l].u - p[f].u, p[l].y - p[f].y);
+    dda_setup(&v_3, p[f].v, p[l].v - p[f].v, p[l].y - p[f].y);
+    
+    for(s = p[f].y; s < p[l].y; s++) {
+        
+        //Outside of the thread's band the edges still have to be stepped
+        if(s < p[m].y) {
+            
+            if(s >= raster_top && s < raster_bottom)
+                draw_scanline_fixed(rend, s, x_1.value, z_1.value, u_1.value, v_1.value, x_3.value, z_3.value, u_3.value, v_3.value, tri->t, flat);
+                
+            dda_step(&x_1);
+            dda_step(&z_1);
+            dda_step(&u_1);
+            dda_step(&v_1);
+        } else {
+            
+            if(s >= raster_top && s < raster_bottom)
+                draw_scanline_fixed(rend, s, x_2.value, z_2.value, u_2.value, v_2.value, x_3.value, z_3.value, u_3.value, v_3.value, tri->t, flat);
+                
+            dda_step(&x_2);
+            dda_step(&z_2);
+            dda_step(&u_2);
+            dda_step(&v_2);
+        }
+        
+        dda_step(&x_3);
+        dda_step(&z_3);
+        dda_step(&u_3);
+        dda_step(&v_3);
+    }
+}
+
+//Mirrors clip_and_render, splitting in the same vertex order so that 
+//both paths end up with the same triangles to interpolate over
+void clip_and_render_fixed(SDL_Renderer *r, fixed_triangle *tri, fixed focal) {
+    
+    int count, i, pass, original, fixed_index[2];
+    unsigned char point_marked[3];
+    fixed plane_z, scale_factor;
+    fixed_vertex new_point[2], *in, *out;
+    fixed_triangle out_triangle[2];
+    
+    for(pass = 0; pass < 2; pass++) {
+        
+        plane_z = pass ? FIXED_CONST(SCREEN_DEPTH) : FIXED_CONST(NEAR_PLANE);
+        count = 0;
+        
+        for(i = 0; i < 3; i++) {
+            
+            point_marked[i] = pass ? tri->v[i].z > plane_z : tri->v[i].z < plane_z;
+            count += point_marked[i];
+        }
+        
+        if(count == 3) {
+            
+            STAT_ADD(STAT_REJECTED, 1);
+            return;
+        }
+            
+        if(!count)
+            continue;
+            
+        STAT_ADD(count == 1 ? STAT_SPLIT_TWO : STAT_SPLIT_ONE, 1);
+            
+        //With one vertex out the two fixed are the others, with two out 
+        //the fixed vertices are the ones being replaced
+        if(count == 1) {
+            
+            fixed_index[0] = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
+            fixed_index[1] = fixed_index[0] == 0 ? point_marked[1] ? 2 : 1 : fixed_index[0] == 1 ? point_marked[0] ? 2 : 0 : point_marked[0] ? 1 : 0;
+            original = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
+        } else {
+            
+            original = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
+            fixed_index[0] = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
+            fixed_index[1] = fixed_index[0] == 0 ? point_marked[1] ? 1 : 2 : fixed_index[0] == 1 ? point_marked[0] ? 0 : 2 : point_marked[0] ? 0 : 1;
+        }
+        
+        for(i = 0; i < 2; i++) {
+            
+            in = &(tri->v[fixed_index[i]]);
+            out = &(tri->v[original]);
+            scale_factor = FIXED_DIV(plane_z - in->z, out->z - in->z);
+            new_point[i].x = in->x + FIXED_MUL(scale_factor, out->x - in->x);
+            new_point[i].y = in->y + FIXED_MUL(scale_factor, out->y - in->y);
+            new_point[i].z = plane_z;
+            new_point[i].u = in->u + FIXED_MUL(scale_factor, out->u - in->u);
+            new_point[i].v = in->v + FIXED_MUL(scale_factor, out->v - in->v);
+            new_point[i].c = in->c;
+        }
+        
+        out_triangle[0] = out_triangle[1] = *tri;
+        
+        if(count == 1) {
+            
+            out_triangle[0].v[original] = new_point[0];
+            out_triangle[1].v[original] = new_point[1];
+            out_triangle[1].v[fixed_index[0]] = new_point[0];
+            clip_and_render_fixed(r, &out_triangle[0], focal);
+            clip_and_render_fixed(r, &out_triangle[1], focal);
+        } else {
+            
+            out_triangle[0].v[fixed_index[0]] = new_point[0];
+            out_triangle[0].v[fixed_index[1]] = new_point[1];
+            clip_and_render_fixed(r, &out_triangle[0], focal);
+        }
+        
+        return;
+    }
+    
+    if(raster_target) {
+        
+        raster_list_add(raster_target, tri);
+        return;
+    }
+    
+    PROFILE_BEGIN(PROF_SETUP);
+    draw_triangle_fixed(r, tri, focal);
+    PROFILE_END();
+}
+#endif
+
+void set_plane(plane *p, float x, float y, float z, float d) {
+    
+    float mag = sqrt(x*x + y*y + z*z);
+    
+    p->x = x / mag;
+    p->y = y / mag;
+    p->z = z / mag;
+    p->d = d / mag;
+}
+
+//Rebuild the view frustum planes, needs to be called whenever
+//focal_length changes. Projected x spans +/-(width/height) and
+//projected y spans +/-1, so the side planes fall out of x*f/z
+//and y*f/z hitting those limits
+void update_frustum() {
+    
+    float aspect = (float)screen.full_width / (float)screen.full_height;
+    
+    set_plane(&view_frustum.p[FRUSTUM_LEFT], focal_length, 0.0, aspect, 0.0);
+    set_plane(&view_frustum.p[FRUSTUM_RIGHT], -focal_length, 0.0, aspect, 0.0);
+    set_plane(&view_frustum.p[FRUSTUM_TOP], 0.0, -focal_length, 1.0, 0.0);
+    set_plane(&view_frustum.p[FRUSTUM_BOTTOM], 0.0, focal_length, 1.0, 0.0);
+    set_plane(&view_frustum.p[FRUSTUM_NEAR], 0.0, 0.0, 1.0, -NEAR_PLANE);
+    set_plane(&view_frustum.p[FRUSTUM_FAR], 0.0, 0.0, -1.0, SCREEN_DEPTH);
+}
+
+void init_camera(camera *cam, float fov) {
+    
+    cam->x = cam->y = cam->z = 0.0;
+    cam->yaw = cam->pitch = 0.0;
+    cam->fov = fov;
+}
+
+//Recompute everything derived from the camera's position, angles and 
+//field of view. Called once per frame after the camera has moved
+void update_camera(camera *cam) {
+    
+    float cy, sy, cp, sp;
+    plane *src, *dst;
+    int i;
+    
+    focal_length = cam->focal = 1.0 / (2.0 * tan(DEG_TO_RAD(cam->fov)/2.0));
+    update_frustum();
+    
+    cy = cos(DEG_TO_RAD(cam->yaw));
+    sy = sin(DEG_TO_RAD(cam->yaw));
+    cp = cos(DEG_TO_RAD(cam->pitch));
+    sp = sin(DEG_TO_RAD(cam->pitch));
+    
+    //Undo the yaw about y, then the pitch about x
+    cam->view[0][0] = cy;
+    cam->view[0][1] = 0.0;
+    cam->view[0][2] = -sy;
+    cam->view[1][0] = -sy * sp;
+    cam->view[1][1] = cp;
+    cam->view[1][2] = -cy * sp;
+    cam->view[2][0] = sy * cp;
+    cam->view[2][1] = sp;
+    cam->view[2][2] = cy * cp;
+    
+    //Carry the view space planes back into the world by rotating 
+    //their normals with the transposed view and moving them to the
+    //camera's position
+    for(i = 0; i < FRUSTUM_PLANES; i++) {
+        
+        src = &view_frustum.p[i];
+        dst = &(cam->world_frustum.p[i]);
+        dst->x = cam->view[0][0]*src->x + cam->view[1][0]*src->y + cam->view[2][0]*src->z;
+        dst->y = cam->view[0][1]*src->x + cam->view[1][1]*src->y + cam->view[2][1]*src->z;
+        dst->z = cam->view[0][2]*src->x + cam->view[1][2]*src->y + cam->view[2][2]*src->z;
+        dst->d = src->d - (dst->x*cam->x + dst->y*cam->y + dst->z*cam->z);
+    }
+    
+#ifdef LESTER_FIXED
+    for(i = 0; i < 9; i++)
+        cam->fixed_view[i / 3][i % 3] = float_to_fixed(cam->view[i / 3][i % 3]);
+        
+    cam->fixed_pos[0] = float_to_fixed(cam->x);
+    cam->fixed_pos[1] = float_to_fixed(cam->y);
+    cam->fixed_pos[2] = float_to_fixed(cam->z);
+    cam->fixed_focal = float_to_fixed(focal_length);
+#endif
+}
+
+//Move the camera along its heading, ignoring pitch so that looking
+//up or down doesn't make the player fly
+void move_camera(camera *cam, float forward, float right) {
+    
+    float cy = cos(DEG_TO_RAD(cam->yaw));
+    float sy = sin(DEG_TO_RAD(cam->yaw));
+    
+    cam->x += forward * sy + right * cy;
+    cam->z += forward * cy - right * sy;
+}
+
+void transform_vertex(camera *cam, vertex *src, vertex *dst) {
+    
+    float dx = src->x - cam->x;
+    float dy = src->y - cam->y;
+    float dz = src->z - cam->z;
+    
+    dst->x = cam->view[0][0]*dx + cam->view[0][1]*dy + cam->view[0][2]*dz;
+    dst->y = cam->view[1][0]*dx + cam->view[1][1]*dy + cam->view[1][2]*dz;
+    dst->z = cam->view[2][0]*dx + cam->view[2][1]*dy + cam->view[2][2]*dz;
+    dst->u = src->u;
+    dst->v = src->v;
+    dst->c = src->c;
+}
+
+//Take a world space triangle through the camera and draw it. The
+//source triangle is left untouched
+#ifdef LESTER_FIXED
+void render_triangle(SDL_Renderer *rend, camera *cam, triangle* tri) {
+    
+    fixed_triangle view_tri;
+    fixed side, px, py, pz;
+    
+    //The fixed spans can't blend, and drawing those triangles opaque
+    //would hide whatever is behind them
+    if(tri->state & STATE_BLEND) {
+        
+        STAT_ADD(STAT_REJECTED, 1);
+        return;
+    }
+    
+    if(tri->has_plane) {
+        
+        px = float_to_fixed(tri->p.x);
+        py = float_to_fixed(tri->p.y);
+        pz = float_to_fixed(tri->p.z);
+        side = FIXED_MUL(px, cam->fixed_pos[0]) + FIXED_MUL(py, cam->fixed_pos[1]) + FIXED_MUL(pz, cam->fixed_pos[2]) + float_to_fixed(tri->p.d);
+        
+        if(side <= 0) {
+            
+            STAT_ADD(STAT_CULLED, 1);
+            return;
+        }
+    }
+    
+    view_tri.has_plane = tri->has_plane;
+    PROFILE_BEGIN(PROF_TRANSFORM);
+    transform_vertex_fixed(cam, &(tri->v[0]), &(view_tri.v[0]));
+    transform_vertex_fixed(cam, &(tri->v[1]), &(view_tri.v[1]));
+    transform_vertex_fixed(cam, &(tri->v[2]), &(view_tri.v[2]));
+    PROFILE_END();
+    view_tri.t = tri->state & STATE_TEXTURED ? tri->t : NULL;
+    
+    STAT_ADD(STAT_CLIP_IN, 1);
+    PROFILE_BEGIN(PROF_CLIP);
+    clip_and_render_fixed(rend, &view_tri, cam->fixed_focal);
+    PROFILE_END();
+}
+#else
+//Static geometry already knows its plane, so it can be backface
+//culled against the camera position before doing any transforming
+//and only needs its normal rotated into view space. src and dst can
+//be the same triangle. Returns 0 if it faces away
+int view_plane(camera *cam, triangle *src, triangle *dst) {
+    
+    plane p = src->p;
+    float side = p.x*cam->x + p.y*cam->y + p.z*cam->z + p.d;
+    
+    if(side <= 0) {
+        
+        STAT_ADD(STAT_CULLED, 1);
+        return 0;
+    }
+        
+    dst->p.x = cam->view[0][0]*p.x + cam->view[0][1]*p.y + cam->view[0][2]*p.z;
+    dst->p.y = cam->view[1][0]*p.x + cam->view[1][1]*p.y + cam->view[1][2]*p.z;
+    dst->p.z = cam->view[2][0]*p.x + cam->view[2][1]*p.y + cam->view[2][2]*p.z;
+    dst->p.d = side;
+    
+    return 1;
+}
+
+void render_triangle(SDL_Renderer *rend, camera *cam, triangle* tri) {
+    
+    triangle view_tri;
+    
+    if(tri->has_plane && !view_plane(cam, tri, &view_tri))
+        return;
+    
+    view_tri.has_plane = tri->has_plane;
+    PROFILE_BEGIN(PROF_TRANSFORM);
+    transform_vertex(cam, &(tri->v[0]), &(view_tri.v[0]));
+    transform_vertex(cam, &(tri->v[1]), &(view_tri.v[1]));
+    transform_vertex(cam, &(tri->v[2]), &(view_tri.v[2]));
+    PROFILE_END();
+    view_tri.t = tri->t;
+    view_tri.state = tri->state;
+    
+    STAT_ADD(STAT_CLIP_IN, 1);
+    PROFILE_BEGIN(PROF_CLIP);
+    clip_and_render(rend, &view_tri);
+    PROFILE_END();
+}
+#endif
+
+//Test a volume against the planes set in mask. Planes the volume
+//is entirely inside of are cleared from mask so that anything
+//contained by this volume can skip them
+int frustum_test_bounds(frustum *f, bounds *b, int *mask) {
+    
+    int i;
+    int result = CULL_INSIDE;
+    float dist, extent;
+    plane *p;
+    
+    for(i = 0; i < FRUSTUM_PLANES; i++) {
+        
+        if(!(*mask & (1 << i)))
+            continue;
+            
+        p = &(f->p[i]);
+        dist = p->x*b->center[0] + p->y*b->center[1] + p->z*b->center[2] + p->d;
+        
+        //Cheap sphere test first
+        if(dist < -b->radius)
+            return CULL_OUTSIDE;
+        
+        if(dist >= b->radius) {
+            
+            *mask &= ~(1 << i);
+            continue;
+        }
+        
+        //The sphere straddles the plane, so refine using how far
+        //the box reaches along the plane normal
+        extent = fabs(p->x)*(b->max[0] - b->center[0]) + 
+                 fabs(p->y)*(b->max[1] - b->center[1]) + 
+                 fabs(p->z)*(b->max[2] - b->center[2]);
+        
+        if(dist < -extent)
+            return CULL_OUTSIDE;
+            
+        if(dist >= extent)
+            *mask &= ~(1 << i);
+        else
+            result = CULL_INTERSECT;
+    }
+    
+    return result;
+}
+
+void render_bvh_node(SDL_Renderer *r, camera *cam, object *obj, int index, int mask) {
+    
+    bvh_node *n = &(obj->bvh[index]);
+    int i;
+    
+    //Once a parent is entirely inside there is nothing left to test
+    if(mask && frustum_test_bounds(&(cam->world_frustum), &(n->b), &mask) == CULL_OUTSIDE)
+        return;
+        
+    if(n->left < 0) {
+        
+        for(i = n->first; i < n->first + n->tri_count; i++)
+            render_triangle(r, cam, obj->tri_array[i]);
+            
+        return;
+    }
+    
+    render_bvh_node(r, cam, obj, n->left, mask);
+    render_bvh_node(r, cam, obj, n->right, mask);
+}
+
+void render_object(SDL_Renderer *r, camera *cam, object *obj) {
+    
+    node* item;
+    int i;
+    int mask = FRUSTUM_ALL_PLANES;
+    
+    if(obj->bounds_dirty)
+        update_object_bounds(obj);
+        
+    if(!obj->tri_count)
+        return;
+        
+    if(obj->bvh) {
+        
+        render_bvh_node(r, cam, obj, 0, mask);
+        return;
+    }
+    
+    if(frustum_test_bounds(&(cam->world_frustum), &(obj->b), &mask) == CULL_OUTSIDE)
+        return;
+    
+    list_for_each(&(obj->tri_list), item, i) {
+        
+        render_triangle(r, cam, (triangle*)item->payload);
+    }
+}
+
+float plane_distance(plane *p, vertex *v) {
+    
+    return p->x*v->x + p->y*v->y + p->z*v->z + p->d;
+}
+
+#define BSP_COPLANAR 0
+#define BSP_FRONT    1
+#define BSP_BACK     2
+#define BSP_SPANNING 3
+
+int bsp_classify(plane *p, triangle *tri) {
+    
+    int i, result = BSP_COPLANAR;
+    float dist;
+    
+    for(i = 0; i < 3; i++) {
+        
+        dist = plane_distance(p, &(tri->v[i]));
+        
+        if(dist > BSP_EPSILON)
+            result |= BSP_FRONT;
+        else if(dist < -BSP_EPSILON)
+            result |= BSP_BACK;
+    }
+    
+    return result;
+}
+
+//Cut a spanning triangle along the plane, fanning each side's polygon
+//back into triangles which keep the original winding. Returns the 
+//number of triangles written to front and back, up to two each
+void bsp_split_triangle(plane *p, triangle *tri, triangle **front, int *front_count, triangle **back, int *back_count) {
+    
+    vertex front_poly[4], back_poly[4], temp_v;
+    int fc = 0, bc = 0, i, j;
+    float dist[3], t;
+    
+    for(i = 0; i < 3; i++)
+        dist[i] = plane_distance(p, &(tri->v[i]));
+        
+    for(i = 0; i < 3; i++) {
+        
+        j = (i + 1) % 3;
+        
+        if(dist[i] >= -BSP_EPSILON)
+            clone_vertex(&(tri->v[i]), &front_poly[fc++]);
+            
+        if(dist[i] <= BSP_EPSILON)
+            clone_vertex(&(tri->v[i]), &back_poly[bc++]);
+        
+        //Edge crosses the plane, so both sides get the intersection
+        if((dist[i] > BSP_EPSILON && dist[j] < -BSP_EPSILON) ||
+           (dist[i] < -BSP_EPSILON && dist[j] > BSP_EPSILON)) {
+            
+            t = dist[i] / (dist[i] - dist[j]);
+            temp_v.x = tri->v[i].x + t * (tri->v[j].x - tri->v[i].x);
+            temp_v.y = tri->v[i].y + t * (tri->v[j].y - tri->v[i].y);
+            temp_v.z = tri->v[i].z + t * (tri->v[j].z - tri->v[i].z);
+            temp_v.u = tri->v[i].u + t * (tri->v[j].u - tri->v[i].u);
+            temp_v.v = tri->v[i].v + t * (tri->v[j].v - tri->v[i].v);
+            temp_v.c = tri->v[i].c;
+            clone_vertex(&temp_v, &front_poly[fc++]);
+            clone_vertex(&temp_v, &back_poly[bc++]);
+        }
+    }
+    
+    *front_count = 0;
+    *back_count = 0;
+    
+    //The pieces all lie in the original triangle's plane
+    for(i = 2; i < fc; i++) {
+        
+        if((front[*front_count] = new_triangle(&front_poly[0], &front_poly[i - 1], &front_poly[i], tri->t))) {
+            
+            front[*front_count]->p = tri->p;
+            front[*front_count]->has_plane = tri->has_plane;
+            front[*front_count]->state = tri->state;
+            (*front_count)++;
+        }
+    }
+    
+    for(i = 2; i < bc; i++) {
+        
+        if((back[*back_count] = new_triangle(&back_poly[0], &back_poly[i - 1], &back_poly[i], tri->t))) {
+            
+            back[*back_count]->p = tri->p;
+            back[*back_count]->has_plane = tri->has_plane;
+            back[*back_count]->state = tri->state;
+            (*back_count)++;
+        }
+    }
+}
+
+//Pick the candidate plane which best trades off the number of
+//triangles it would cut against how evenly it divides the rest
+int bsp_choose_splitter(triangle **tris, int count, plane *best) {
+    
+    int i, j, step, score, best_score = -1;
+    int front, back, split;
+    plane p;
+    
+    step = count > BSP_CANDIDATES ? count / BSP_CANDIDATES : 1;
+    
+    for(i = 0; i < count; i += step) {
+        
+        if(!triangle_plane(tris[i], &p))
+            continue;
+            
+        front = back = split = 0;
+        
+        for(j = 0; j < count; j++) {
+            
+            switch(bsp_classify(&p, tris[j])) {
+                
+                case BSP_FRONT: front++; break;
+                case BSP_BACK: back++; break;
+                case BSP_SPANNING: split++; break;
+                default: break;
+            }
+        }
+        
+        score = split * BSP_SPLIT_COST + abs(front - back);
+        
+        if(best_score < 0 || score < best_score) {
+            
+            best_score = score;
+            *best = p;
+        }
+    }
+    
+    return best_score >= 0;
+}
+
+void delete_bsp(bsp_node *n) {
+    
+    int i;
+    
+    if(!n)
+        return;
+        
+    for(i = 0; i < n->front_count; i++)
+        free(n->front_tris[i]);
+        
+    for(i = 0; i < n->back_count; i++)
+        free(n->back_tris[i]);
+        
+    free(n->front_tris);
+    free(n->back_tris);
+    delete_bsp(n->front);
+    delete_bsp(n->back);
+    free(n);
+}
+
+//Takes ownership of the triangles in tris, but not the array itself
+bsp_node *build_bsp_node(triangle **tris, int count) {
+    
+    bsp_node *ret_node;
+    triangle **front_list, **back_list;
+    int front_count = 0, back_count = 0;
+    int i, split_front, split_back;
+    
+    if(!count)
+        return NULL;
+        
+    if(!(ret_node = new(bsp_node)))
+        return NULL;
+        
+    ret_node->front_tris = ret_node->back_tris = NULL;
+    ret_node->front_count = ret_node->back_count = 0;
+    ret_node->front = ret_node->back = NULL;
+    
+    //A split can put two triangles on the same side
+    front_list = (triangle**)malloc(sizeof(triangle*) * count * 2);
+    back_list = (triangle**)malloc(sizeof(triangle*) * count * 2);
+    ret_node->front_tris = (triangle**)malloc(sizeof(triangle*) * count);
+    ret_node->back_tris = (triangle**)malloc(sizeof(triangle*) * count);
+    
+    if(!front_list || !back_list || !ret_node->front_tris || !ret_node->back_tris || !bsp_choose_splitter(tris, count, &(ret_node->p))) {
+        
+        printf("[build_bsp_node] could not split %d triangles\n", count);
+        free(front_list);
+        free(back_list);
+        
+        for(i = 0; i < count; i++)
+            free(tris[i]);
+            
+        delete_bsp(ret_node);
+        return NULL;
+    }
+    
+    clear_bounds(&(ret_node->b));
+    
+    for(i = 0; i < count; i++) {
+        
+        bounds_add_triangle(&(ret_node->b), tris[i]);
+        
+        switch(bsp_classify(&(ret_node->p), tris[i])) {
+            
+            case BSP_FRONT: 
+                front_list[front_count++] = tris[i]; 
+                break;
+                
+            case BSP_BACK: 
+                back_list[back_count++] = tris[i]; 
+                break;
+                
+            case BSP_SPANNING:
+                bsp_split_triangle(&(ret_node->p), tris[i], &front_list[front_count], &split_front, &back_list[back_count], &split_back);
+                front_count += split_front;
+                back_count += split_back;
+                free(tris[i]);
+                break;
+                
+            //Degenerate triangles are coplanar with everything and 
+            //would never be drawn anyway, so drop them here
+            default:
+                if(!tris[i]->has_plane)
+                    free(tris[i]);
+                else if(tris[i]->p.x*ret_node->p.x + tris[i]->p.y*ret_node->p.y + tris[i]->p.z*ret_node->p.z > 0)
+                    ret_node->front_tris[ret_node->front_count++] = tris[i];
+                else
+                    ret_node->back_tris[ret_node->back_count++] = tris[i];
+                break;
+        }
+    }
+    
+    finish_bounds(&(ret_node->b));
+    ret_node->front = build_bsp_node(front_list, front_count);
+    ret_node->back = build_bsp_node(back_list, back_count);
+    free(front_list);
+    free(back_list);
+    
+    return ret_node;
+}
+
+//Compile the object's geometry into a BSP tree. This is meant to be done
+//once when the level is loaded; the tree holds its own copies of the 
+//triangles so the source object can be deleted afterwards
+bsp_node *build_bsp(object *level) {
+    
+    triangle **tris;
+    node *item;
+    int i, count;
+    bsp_node *ret_node;
+    
+    list_for_each(&(level->tri_list), item, count);
+    
+    if(!count || !(tris = (triangle**)malloc(sizeof(triangle*) * count)))
+        return NULL;
+    
+    list_for_each(&(level->tri_list), item, i) {
+        
+        if(!(tris[i] = new(triangle))) {
+            
+            printf("[build_bsp] could not copy triangle #%d\n", i+1);
+            
+            while(i--)
+                free(tris[i]);
+                
+            free(tris);
+            return NULL;
+        }
+        
+        *tris[i] = *(triangle*)item->payload;
+        tris[i]->has_plane = triangle_plane(tris[i], &(tris[i]->p));
+    }
+    
+    ret_node = build_bsp_node(tris, count);
+    free(tris);
+    
+    return ret_node;
+}
+
+//Walk the tree front-to-back relative to the camera, skipping subtrees
+//outside the frustum and node triangles facing away from the camera
+void walk_bsp(SDL_Renderer *r, camera *cam, bsp_node *n, int mask) {
+    
+    float side;
+    int i;
+    
+    if(!n)
+        return;
+        
+    if(mask && frustum_test_bounds(&(cam->world_frustum), &(n->b), &mask) == CULL_OUTSIDE)
+        return;
+    
+    side = n->p.x*cam->x + n->p.y*cam->y + n->p.z*cam->z + n->p.d;
+    
+    if(side >= 0) {
+        
+        walk_bsp(r, cam, n->front, mask);
+        
+        for(i = 0; i < n->front_count; i++)
+            render_triangle(r, cam, n->front_tris[i]);
+            
+        walk_bsp(r, cam, n->back, mask);
+    } else {
+        
+        walk_bsp(r, cam, n->back, mask);
+        
+        for(i = 0; i < n->back_count; i++)
+            render_triangle(r, cam, n->back_tris[i]);
+            
+        walk_bsp(r, cam, n->front, mask);
+    }
+}
+
+void render_bsp(SDL_Renderer *r, camera *cam, bsp_node *root) {
+    
+    walk_bsp(r, cam, root, FRUSTUM_ALL_PLANES);
+}
+
+//Build a transform that rotates about x, then y, then z the same way
+//the rotate_object_*_global functions do, and then translates
+void set_transform(transform *xf, float x, float y, float z, float rx, float ry, float rz) {
+    
+    float cx = cos(DEG_TO_RAD(rx)), sx = sin(DEG_TO_RAD(rx));
+    float cy = cos(DEG_TO_RAD(ry)), sy = sin(DEG_TO_RAD(ry));
+    float cz = cos(DEG_TO_RAD(rz)), sz = sin(DEG_TO_RAD(rz));
+    
+    //Rz * Ry * Rx
+    xf->m[0][0] = cz * cy;
+    xf->m[0][1] = cz * sy * sx - sz * cx;
+    xf->m[0][2] = cz * sy * cx + sz * sx;
+    xf->m[1][0] = sz * cy;
+    xf->m[1][1] = sz * sy * sx + cz * cx;
+    xf->m[1][2] = sz * sy * cx - cz * sx;
+    xf->m[2][0] = -sy;
+    xf->m[2][1] = cy * sx;
+    xf->m[2][2] = cy * cx;
+    xf->x = x;
+    xf->y = y;
+    xf->z = z;
+}
+
+void transform_triangle(transform *xf, triangle *src, triangle *dst) {
+    
+    int i;
+    float x, y, z;
+    
+    *dst = *src;
+    
+    for(i = 0; i < 3; i++) {
+        
+        x = src->v[i].x;
+        y = src->v[i].y;
+        z = src->v[i].z;
+        dst->v[i].x = xf->m[0][0]*x + xf->m[0][1]*y + xf->m[0][2]*z + xf->x;
+        dst->v[i].y = xf->m[1][0]*x + xf->m[1][1]*y + xf->m[1][2]*z + xf->y;
+        dst->v[i].z = xf->m[2][0]*x + xf->m[2][1]*y + xf->m[2][2]*z + xf->z;
+    }
+    
+    //Rotating the normal keeps it a unit vector, the distance just has
+    //to account for the plane having been moved
+    if(src->has_plane) {
+        
+        dst->p.x = xf->m[0][0]*src->p.x + xf->m[0][1]*src->p.y + xf->m[0][2]*src->p.z;
+        dst->p.y = xf->m[1][0]*src->p.x + xf->m[1][1]*src->p.y + xf->m[1][2]*src->p.z;
+        dst->p.z = xf->m[2][0]*src->p.x + xf->m[2][1]*src->p.y + xf->m[2][2]*src->p.z;
+        dst->p.d = src->p.d - (dst->p.x*xf->x + dst->p.y*xf->y + dst->p.z*xf->z);
+    }
+}
+
+//Carry world space planes into an object's space so its bounds and
+//BVH can be culled without transforming them
+void frustum_to_object(frustum *src, transform *xf, frustum *dst) {
+    
+    int i;
+    plane *s, *d;
+    
+    for(i = 0; i < FRUSTUM_PLANES; i++) {
+        
+        s = &(src->p[i]);
+        d = &(dst->p[i]);
+        d->x = xf->m[0][0]*s->x + xf->m[1][0]*s->y + xf->m[2][0]*s->z;
+        d->y = xf->m[0][1]*s->x + xf->m[1][1]*s->y + xf->m[2][1]*s->z;
+        d->z = xf->m[0][2]*s->x + xf->m[1][2]*s->y + xf->m[2][2]*s->z;
+        d->d = s->d + s->x*xf->x + s->y*xf->y + s->z*xf->z;
+    }
+}
+
+command_buffer frame_commands;
+
+//Wait for the geometry thread to finish the frame it was handed and
+//pick up its profile data, along with the workers' since none of them
+//can be busy with the last frame anymore either
+void finish_geometry() {
+    
+    if(frame_commands.busy) {
+        
+        SDL_SemWait(frame_commands.geometry_done);
+        frame_commands.busy = 0;
+        profile_merge(&frame_commands.geometry_record);
+    }
+    
+    merge_job_profiles();
+}
+
+void delete_command_buffer() {
+    
+    int i;
+    
+    finish_geometry();
+    
+    if(frame_commands.geometry_thread) {
+        
+        frame_commands.quit = 1;
+        SDL_SemPost(frame_commands.geometry_start);
+        SDL_WaitThread(frame_commands.geometry_thread, NULL);
+    }
+    
+    if(frame_commands.geometry_start)
+        SDL_DestroySemaphore(frame_commands.geometry_start);
+        
+    if(frame_commands.geometry_done)
+        SDL_DestroySemaphore(frame_commands.geometry_done);
+    
+    free(frame_commands.commands);
+    free(frame_commands.queue);
+    free(frame_commands.world);
+    free(frame_commands.blended);
+    delete_stream(&frame_commands.view);
+    delete_stream(&frame_commands.batch);
+    
+    for(i = 0; i < 2; i++) {
+        
+        free(frame_commands.lists[i].tris);
+        free(frame_commands.lists[i].sprites);
+        free(frame_commands.lists[i].points);
+        free(frame_commands.lists[i].sprite_bins.starts);
+        free(frame_commands.lists[i].sprite_bins.entries);
+        free(frame_commands.lists[i].point_bins.starts);
+        free(frame_commands.lists[i].point_bins.entries);
+        free(frame_commands.lists[i].lines);
+    }
+    
+    free(frame_commands.debug_lines.lines);
+    
+    memset((void*)&frame_commands, 0, sizeof(command_buffer));
+}
+
+//Start recording a frame as seen from cam. Nothing gets drawn until 
+//end_frame, so the submitted geometry has to stay put until then. When
+//pipelined, the previous frame's geometry may still be in flight until
+//this returns, so the scene shouldn't be touched before calling it
+void begin_frame(camera *cam, unsigned int clear_color) {
+    
+    finish_geometry();
+    frame_commands.cam = *cam;
+    frame_commands.clear_color = clear_color;
+    frame_commands.command_count = 0;
+    frame_commands.queue_count = 0;
+}
+
+int push_command(int type, void *target, transform *xf, material *mat) {
+    
+    draw_command *grown, *cmd;
+    int capacity;
+    
+    if(frame_commands.command_count == frame_commands.command_capacity) {
+        
+        capacity = frame_commands.command_capacity ? frame_commands.command_capacity * 2 : 64;
+        
+        if(!(grown = (draw_command*)realloc(frame_commands.commands, capacity * sizeof(draw_command)))) {
+            
+            printf("[push_command] Could not grow the command buffer to %d commands\n", capacity);
+            return 0;
+        }
+        
+        frame_commands.commands = grown;
+        frame_commands.command_capacity = capacity;
+    }
+    
+    cmd = &frame_commands.commands[frame_commands.command_count++];
+    cmd->type = type;
+    cmd->target = target;
+    cmd->mat = mat;
+    cmd->has_transform = xf != NULL;
+    
+    if(xf)
+        cmd->xf = *xf;
+        
+    return 1;
+}
+
+//xf and mat can be left NULL to draw the geometry as it is
+int submit_triangle(triangle *tri, transform *xf, material *mat) {
+    
+    return push_command(COMMAND_TRIANGLE, (void*)tri, xf, mat);
+}
+
+int submit_object(object *obj, transform *xf, material *mat) {
+    
+    return push_command(COMMAND_OBJECT, (void*)obj, xf, mat);
+}
+
+//BSP geometry is already in world space, so it only takes a material
+int submit_bsp(bsp_node *root, material *mat) {
+    
+    return push_command(COMMAND_BSP, (void*)root, NULL, mat);
+}
+
+//Sprites skip clipping and triangle setup altogether, so they can't
+//be transformed or take a material
+int submit_sprite(sprite *spr) {
+    
+    return push_command(COMMAND_SPRITE, (void*)spr, NULL, NULL);
+}
+
+//Particles are already in world space and get their look from their
+//emitter, so they don't take a transform or material either
+int submit_particles(particle_system *ps) {
+    
+    return push_command(COMMAND_PARTICLES, (void*)ps, NULL, NULL);
+}
+
+//Lines are in world space already. The list has to stay put until the
+//frame's built, same as the rest of the geometry
+int submit_lines(line_list *list) {
+    
+    return push_command(COMMAND_LINES, (void*)list, NULL, NULL);
+}
+
+void queue_triangle(int command, triangle *tri) {
+    
+    queued_triangle *grown, *q;
+    material *mat = frame_commands.commands[command].mat;
+    int capacity;
+    
+    if(frame_commands.queue_count == frame_commands.queue_capacity) {
+        
+        capacity = frame_commands.queue_capacity ? frame_commands.queue_capacity * 2 : 1024;
+        
+        if(!(grown = (queued_triangle*)realloc(frame_commands.queue, capacity * sizeof(queued_triangle)))) {
+            
+            printf("[queue_triangle] Could not grow the triangle queue to %d triangles\n", capacity);
+            return;
+        }
+        
+        frame_commands.queue = grown;
+        frame_commands.queue_capacity = capacity;
+    }
+    
+    q = &frame_commands.queue[frame_commands.queue_count];
+    q->tri = tri;
+    q->t = mat && mat->t ? mat->t : tri->t;
+    q->state = mat ? mat->state : tri->state;
+    q->command = command;
+    q->sequence = frame_commands.queue_count++;
+}
+
+void queue_bvh_node(int command, frustum *f, object *obj, int index, int mask) {
+    
+    bvh_node *n = &(obj->bvh[index]);
+    int i;
+    
+    if(mask && frustum_test_bounds(f, &(n->b), &mask) == CULL_OUTSIDE)
+        return;
+        
+    if(frame_commands.debug_view == DEBUG_VIEW_BOUNDS)
+        add_box_lines(&frame_commands.debug_lines, &(n->b), frame_commands.commands[command].has_transform ? &(frame_commands.commands[command].xf) : NULL, n->left < 0 ? 0x00FF00 : 0x008000);
+        
+    if(n->left < 0) {
+        
+        for(i = n->first; i < n->first + n->tri_count; i++)
+            queue_triangle(command, obj->tri_array[i]);
+            
+        return;
+    }
+    
+    queue_bvh_node(command, f, obj, n->left, mask);
+    queue_bvh_node(command, f, obj, n->right, mask);
+}
+
+void queue_object(int command) {
+    
+    draw_command *cmd = &frame_commands.commands[command];
+    object *obj = (object*)cmd->target;
+    frustum local, *f = &(frame_commands.cam.world_frustum);
+    node *item;
+    int i;
+    int mask = FRUSTUM_ALL_PLANES;
+    
+    if(obj->bounds_dirty)
+        update_object_bounds(obj);
+        
+    if(!obj->tri_count)
+        return;
+        
+    if(cmd->has_transform) {
+        
+        frustum_to_object(f, &(cmd->xf), &local);
+        f = &local;
+    }
+        
+    if(obj->bvh) {
+        
+        queue_bvh_node(command, f, obj, 0, mask);
+        return;
+    }
+    
+    if(frustum_test_bounds(f, &(obj->b), &mask) == CULL_OUTSIDE)
+        return;
+        
+    if(frame_commands.debug_view == DEBUG_VIEW_BOUNDS)
+        add_box_lines(&frame_commands.debug_lines, &(obj->b), cmd->has_transform ? &(cmd->xf) : NULL, 0x00FF00);
+    
+    list_for_each(&(obj->tri_list), item, i)
+        queue_triangle(command, (triangle*)item->payload);
+}
+
+//Same front to back order as walk_bsp
+void queue_bsp_node(int command, bsp_node *n, int mask) {
+    
+    camera *cam = &frame_commands.cam;
+    float side;
+    int i;
+    
+    if(!n)
+        return;
+        
+    if(mask && frustum_test_bounds(&(cam->world_frustum), &(n->b), &mask) == CULL_OUTSIDE)
+        return;
+        
+    if(frame_commands.debug_view == DEBUG_VIEW_BOUNDS)
+        add_box_lines(&frame_commands.debug_lines, &(n->b), NULL, 0xFF8000);
+    
+    side = n->p.x*cam->x + n->p.y*cam->y + n->p.z*cam->z + n->p.d;
+    
+    if(side >= 0) {
+        
+        queue_bsp_node(command, n->front, mask);
+        
+        for(i = 0; i < n->front_count; i++)
+            queue_triangle(command, n->front_tris[i]);
+            
+        queue_bsp_node(command, n->back, mask);
+    } else {
+        
+        queue_bsp_node(command, n->back, mask);
+        
+        for(i = 0; i < n->back_count; i++)
+            queue_triangle(command, n->back_tris[i]);
+            
+        queue_bsp_node(command, n->front, mask);
+    }
+}
+
+//Group by texture, keeping submission order within each group so that
+//front to back BSP order still helps the depth test
+int compare_queued(const void *a, const void *b) {
+    
+    queued_triangle *qa = (queued_triangle*)a, *qb = (queued_triangle*)b;
+    
+    if(qa->t != qb->t)
+        return (size_t)qa->t < (size_t)qb->t ? -1 : 1;
+        
+    return qa->sequence - qb->sequence;
+}
+
+//Farthest first, falling back on the order they were queued in
+int compare_deferred(const void *a, const void *b) {
+    
+    deferred_triangle *da = (deferred_triangle*)a, *db = (deferred_triangle*)b;
+    
+    if(da->depth != db->depth)
+        return da->depth > db->depth ? -1 : 1;
+        
+    return da->index - db->index;
+}
+
+#ifndef LESTER_FIXED
+int reserve_world(int count) {
+    
+    triangle *grown;
+    deferred_triangle *deferred;
+    int capacity;
+    
+    if(!reserve_stream(&frame_commands.view, count * 3))
+        return 0;
+    
+    if(count <= frame_commands.world_capacity)
+        return 1;
+        
+    capacity = frame_commands.world_capacity ? frame_commands.world_capacity : 1024;
+    
+    while(capacity < count)
+        capacity *= 2;
+        
+    if(!(grown = (triangle*)realloc(frame_commands.world, capacity * sizeof(triangle)))) {
+        
+        printf("[reserve_world] Could not grow the world triangles to %d\n", capacity);
+        return 0;
+    }
+    
+    frame_commands.world = grown;
+    
+    if(!(deferred = (deferred_triangle*)realloc(frame_commands.blended, capacity * sizeof(deferred_triangle)))) {
+        
+        printf("[reserve_world] Could not grow the blended triangles to %d\n", capacity);
+        return 0;
+    }
+    
+    frame_commands.blended = deferred;
+    frame_commands.world_capacity = capacity;
+    
+    return 1;
+}
+#endif
+
+//Take a sprite's center to view space and keep it if any of it could
+//be on the screen, which only needs the aspect since that stays put
+void queue_sprite(raster_list *out, sprite *spr) {
+    
+    camera *cam = &(out->cam);
+    sprite view = *spr;
+    float dx = spr->x - cam->x, dy = spr->y - cam->y, dz = spr->z - cam->z;
+    float aspect = (float)screen.full_width / screen.full_height;
+    
+    view.x = cam->view[0][0]*dx + cam->view[0][1]*dy + cam->view[0][2]*dz;
+    view.y = cam->view[1][0]*dx + cam->view[1][1]*dy + cam->view[1][2]*dz;
+    view.z = cam->view[2][0]*dx + cam->view[2][1]*dy + cam->view[2][2]*dz;
+    
+    if(view.z < NEAR_PLANE || view.z > SCREEN_DEPTH)
+        return;
+        
+    if((fabs(view.x) - view.width / 2) * cam->focal > view.z * aspect || (fabs(view.y) - view.height / 2) * cam->focal > view.z)
+        return;
+        
+    STAT_ADD(STAT_SPRITES, 1);
+    raster_list_add_sprite(out, &view);
+}
+
+//Take every particle to view space in one batch and keep the ones whose
+//centers are on the screen, as sprites when textured and as points,
+//projected already, when not
+void queue_particles(raster_list *out, particle_system *ps) {
+    
+    vertex_stream *view = &frame_commands.batch;
+    stream_transform xf;
+    sprite spr;
+    raster_point pt;
+    float w;
+    int i, kept = 0;
+    
+    if(!ps->count || !reserve_stream(view, ps->count))
+        return;
+        
+    memcpy((void*)view->x, (void*)ps->x, ps->count * sizeof(float));
+    memcpy((void*)view->y, (void*)ps->y, ps->count * sizeof(float));
+    memcpy((void*)view->z, (void*)ps->z, ps->count * sizeof(float));
+    view->count = ps->count;
+    view_transform(&xf, &(out->cam), view);
+    run_stream_transform(&xf);
+    spr.width = spr.height = ps->e.size;
+    spr.t = ps->e.t;
+    pt.color = ps->e.color;
+    
+    for(i = 0; i < view->count; i++) {
+        
+        if(view->outcode[i])
+            continue;
+            
+        if(ps->e.t) {
+            
+            spr.x = view->x[i];
+            spr.y = view->y[i];
+            spr.z = view->z[i];
+            raster_list_add_sprite(out, &spr);
+        } else {
+            
+            w = out->cam.focal / view->z[i];
+            pt.x = view->x[i] * w;
+            pt.y = view->y[i] * w;
+            pt.z = view->z[i];
+            pt.radius = ps->e.size / 2 * w;
+            raster_list_add_point(out, &pt);
+        }
+        
+        kept++;
+    }
+    
+    STAT_ADD(STAT_PARTICLES, kept);
+}
+
+//Cut a view space line down to where z is at least near, returning 0
+//when none of it is
+int clip_line_near(debug_line *l, float near) {
+    
+    float t;
+    
+    if(l->z0 < near && l->z1 < near)
+        return 0;
+        
+    if(l->z0 < near) {
+        
+        t = (near - l->z0) / (l->z1 - l->z0);
+        l->x0 += (l->x1 - l->x0) * t;
+        l->y0 += (l->y1 - l->y0) * t;
+        l->z0 = near;
+    } else if(l->z1 < near) {
+        
+        t = (near - l->z1) / (l->z0 - l->z1);
+        l->x1 += (l->x0 - l->x1) * t;
+        l->y1 += (l->y0 - l->y1) * t;
+        l->z1 = near;
+    }
+    
+    return 1;
+}
+
+//Clip a view space line to the near and far planes and add it, pulled
+//in towards the camera by the depth bias
+void add_view_line(raster_list *out, debug_line *l) {
+    
+    debug_line far;
+    
+    if(!clip_line_near(l, NEAR_PLANE))
+        return;
+        
+    //The far plane is the near one with z turned around
+    far = *l;
+    far.z0 = -l->z0;
+    far.z1 = -l->z1;
+    
+    if(!clip_line_near(&far, -SCREEN_DEPTH))
+        return;
+        
+    l->x0 = far.x0;
+    l->y0 = far.y0;
+    l->x1 = far.x1;
+    l->y1 = far.y1;
+    l->z0 = -far.z0 * (1.0 - LINE_DEPTH_BIAS);
+    l->z1 = -far.z1 * (1.0 - LINE_DEPTH_BIAS);
+    STAT_ADD(STAT_LINES, 1);
+    raster_list_add_line(out, l);
+}
+
+//Take both ends of every line to view space in one batch, dropping the
+//ones with both past the same edge of the view volume
+void queue_lines(raster_list *out, line_list *list) {
+    
+    vertex_stream *view = &frame_commands.batch;
+    stream_transform xf;
+    debug_line l;
+    int i;
+    
+    if(!list->count || !reserve_stream(view, list->count * 2))
+        return;
+        
+    for(i = 0; i < list->count; i++) {
+        
+        view->x[i * 2] = list->lines[i].x0;
+        view->y[i * 2] = list->lines[i].y0;
+        view->z[i * 2] = list->lines[i].z0;
+        view->x[i * 2 + 1] = list->lines[i].x1;
+        view->y[i * 2 + 1] = list->lines[i].y1;
+        view->z[i * 2 + 1] = list->lines[i].z1;
+    }
+    
+    view->count = list->count * 2;
+    view_transform(&xf, &(out->cam), view);
+    run_stream_transform(&xf);
+    
+    for(i = 0; i < list->count; i++) {
+        
+        if(view->outcode[i * 2] & view->outcode[i * 2 + 1])
+            continue;
+            
+        l.x0 = view->x[i * 2];
+        l.y0 = view->y[i * 2];
+        l.z0 = view->z[i * 2];
+        l.x1 = view->x[i * 2 + 1];
+        l.y1 = view->y[i * 2 + 1];
+        l.z1 = view->z[i * 2 + 1];
+        l.color = list->lines[i].color;
+        add_view_line(out, &l);
+    }
+}
+
+//Cull everything submitted down to a queue of triangles, sort it and
+//transform and clip it into out. The float build takes all of the 
+//vertices to view space in one batch and rejects whatever is entirely
+//off of the screen before clipping, then clips the blended triangles
+//last and back to front so each one mixes with what's behind it
+void build_frame(raster_list *out) {
+    
+    int i;
+    draw_command *cmd;
+    queued_triangle *q;
+#ifdef LESTER_FIXED
+    triangle world;
+#else
+    int j, count, blended;
+    debug_line line;
+    triangle *tri;
+    vertex_stream *view = &frame_commands.view;
+    stream_transform xf;
+#endif
+    
+    out->count = 0;
+    out->sprite_count = 0;
+    out->point_count = 0;
+    out->line_count = 0;
+    frame_commands.debug_lines.count = 0;
+    out->cam = frame_commands.cam;
+    out->clear_color = frame_commands.clear_color;
+    
+    for(i = 0; i < frame_commands.command_count; i++) {
+        
+        cmd = &frame_commands.commands[i];
+        
+        switch(cmd->type) {
+            
+            case COMMAND_TRIANGLE:
+                queue_triangle(i, (triangle*)cmd->target);
+                break;
+                
+            case COMMAND_OBJECT:
+                queue_object(i);
+                break;
+                
+            case COMMAND_BSP:
+                queue_bsp_node(i, (bsp_node*)cmd->target, FRUSTUM_ALL_PLANES);
+                break;
+                
+            case COMMAND_SPRITE:
+                queue_sprite(out, (sprite*)cmd->target);
+                break;
+                
+            case COMMAND_PARTICLES:
+                queue_particles(out, (particle_system*)cmd->target);
+                break;
+                
+            case COMMAND_LINES:
+                queue_lines(out, (line_list*)cmd->target);
+                break;
+        }
+    }
+    
+    queue_lines(out, &frame_commands.debug_lines);
+    
+    if(frame_commands.sort_by_texture)
+        qsort(frame_commands.queue, frame_commands.queue_count, sizeof(queued_triangle), compare_queued);
+    
+#ifdef LESTER_FIXED
+    raster_target = out;
+    
+    for(i = 0; i < frame_commands.queue_count; i++) {
+        
+        q = &frame_commands.queue[i];
+        cmd = &frame_commands.commands[q->command];
+        
+        if(cmd->has_transform)
+            transform_triangle(&(cmd->xf), q->tri, &world);
+        else
+            world = *(q->tri);
+            
+        world.t = q->t;
+        world.state = q->state;
+        render_triangle(NULL, &(out->cam), &world);
+    }
+    
+    out->opaque = out->count;
+#else
+    if(!reserve_world(frame_commands.queue_count))
+        return;
+        
+    //Bring everything into world space, dropping static triangles that
+    //face away before they cost a transform
+    PROFILE_BEGIN(PROF_TRANSFORM);
+    
+    for(i = 0, count = 0; i < frame_commands.queue_count; i++) {
+        
+        q = &frame_commands.queue[i];
+        cmd = &frame_commands.commands[q->command];
+        tri = &frame_commands.world[count];
+        
+        if(cmd->has_transform)
+            transform_triangle(&(cmd->xf), q->tri, tri);
+        else
+            *tri = *(q->tri);
+            
+        tri->t = q->t;
+        tri->state = q->state;
+        
+        if(tri->has_plane && !view_plane(&(out->cam), tri, tri))
+            continue;
+            
+        for(j = 0; j < 3; j++) {
+            
+            view->x[count * 3 + j] = tri->v[j].x;
+            view->y[count * 3 + j] = tri->v[j].y;
+            view->z[count * 3 + j] = tri->v[j].z;
+        }
+        
+        count++;
+    }
+    
+    view->count = count * 3;
+    view_transform(&xf, &(out->cam), view);
+    run_stream_transform(&xf);
+    PROFILE_END();
+    
+    raster_target = out;
+    
+    for(i = 0, blended = 0; i < count; i++) {
+        
+        tri = &frame_commands.world[i];
+        
+        for(j = 0; j < 3; j++) {
+            
+            tri->v[j].x = view->x[i * 3 + j];
+            tri->v[j].y = view->y[i * 3 + j];
+            tri->v[j].z = view->z[i * 3 + j];
+        }
+        
+        STAT_ADD(STAT_CLIP_IN, 1);
+        
+        //Entirely past one edge of the view volume
+        if(view->outcode[i * 3] & view->outcode[i * 3 + 1] & view->outcode[i * 3 + 2]) {
+            
+            STAT_ADD(STAT_REJECTED, 1);
+            continue;
+        }
+        
+        if(tri->state & STATE_BLEND) {
+            
+            frame_commands.blended[blended].index = i;
+            frame_commands.blended[blended].depth = tri->v[0].z + tri->v[1].z + tri->v[2].z;
+            blended++;
+            continue;
+        }
+        
+        PROFILE_BEGIN(PROF_CLIP);
+        clip_and_render(NULL, tri);
+        PROFILE_END();
+    }
+    
+    out->opaque = out->count;
+    qsort(frame_commands.blended, blended, sizeof(deferred_triangle), compare_deferred);
+    
+    for(i = 0; i < blended; i++) {
+        
+        PROFILE_BEGIN(PROF_CLIP);
+        clip_and_render(NULL, &frame_commands.world[frame_commands.blended[i].index]);
+        PROFILE_END();
+    }
+    
+    //The raster list's triangles are clipped and in view space already
+    if(frame_commands.debug_view == DEBUG_VIEW_WIREFRAME) {
+        
+        for(i = 0; i < out->count; i++) {
+            
+            for(j = 0; j < 3; j++) {
+                
+                line.x0 = out->tris[i].v[j].x;
+                line.y0 = out->tris[i].v[j].y;
+                line.z0 = out->tris[i].v[j].z;
+                line.x1 = out->tris[i].v[(j + 1) % 3].x;
+                line.y1 = out->tris[i].v[(j + 1) % 3].y;
+                line.z1 = out->tris[i].v[(j + 1) % 3].z;
+                line.color = i < out->opaque ? 0xFFFFFF : 0x00FFFF;
+                add_view_line(out, &line);
+            }
+        }
+    }
+#endif
+    
+    raster_target = NULL;
+}
+
+//Columns first through last of a sprite, rows top through bottom, all
+//at depth z. Texel columns are picked by where each pixel center falls
+//across the sprite and rows are stepped down in 16.16 fixed point
+FORCE_INLINE int sprite_columns(texture *tex, int first, int last, int top, int bottom, float left, float width, unsigned int v0, unsigned int dv, float z, int format) {
+    
+    int x, y, u, written = 0;
+    unsigned int v, texel, *src, *color;
+    unsigned short newz = (unsigned short)z, *depth16;
+    float *depth32, dir = format == DEPTH_REVERSED ? -1.0 : 1.0;
+    
+    for(x = first; x <= last; x++) {
+        
+        u = (int)((x + 0.5 - left) / width * tex->width);
+        src = &tex->data[u >= tex->width ? tex->width - 1 : u];
+        color = &screen.fbuf[top * screen.width + x];
+        depth16 = &((unsigned short*)screen.zbuf)[top * screen.width + x];
+        depth32 = &((float*)screen.zbuf)[top * screen.width + x];
+        
+        for(y = top, v = v0; y <= bottom; y++, v += dv, color += screen.width, depth16 += screen.width, depth32 += screen.width) {
+            
+            if(format == DEPTH_LINEAR16) {
+                
+                if(newz >= *depth16)
+                    continue;
+            } else if(z * dir >= *depth32 * dir) {
+                
+                continue;
+            }
+            
+            texel = src[(v >> 16) * tex->width];
+            
+            if(tex->runs && texel == tex->key)
+                continue;
+                
+            *color = 0xFF000000 | texel;
+            
+            if(format == DEPTH_LINEAR16)
+                *depth16 = newz;
+            else
+                *depth32 = z;
+                
+            written++;
+        }
+    }
+    
+    return written;
+}
+
+//Where a view space sprite lands on the screen and the pixels it
+//covers, those with their centers inside it, same as triangles
+FORCE_INLINE void sprite_rect(sprite *spr, float *left, float *upper, float *width, float *height, int *first, int *last, int *top, int *bottom) {
+    
+    float scale = focal_length / spr->z * screen.height / 2.0;
+    
+    *width = spr->width * scale;
+    *height = spr->height * scale;
+    *left = screen.width / 2.0 + spr->x * scale - *width / 2.0;
+    *upper = screen.height / 2.0 - spr->y * scale - *height / 2.0;
+    *first = (int)ceil(*left - 0.5);
+    *last = (int)ceil(*left + *width - 0.5) - 1;
+    *top = (int)ceil(*upper - 0.5);
+    *bottom = (int)ceil(*upper + *height - 0.5) - 1;
+}
+
+int sprite_rows(void *items, int i, int *top, int *bottom) {
+    
+    int first, last;
+    float left, upper, width, height;
+    
+    sprite_rect(&((sprite*)items)[i], &left, &upper, &width, &height, &first, &last, top, bottom);
+    
+    if(last < 0 || first >= screen.width || *bottom < 0 || *top >= screen.height || first > last || *top > *bottom)
+        return 0;
+        
+    *top = *top < 0 ? 0 : *top;
+    *bottom = *bottom >= screen.height ? screen.height - 1 : *bottom;
+    
+    return 1;
+}
+
+//Draw whatever part of a view space sprite is in the current band, a
+//column at a time. The whole sprite sits at the depth of its center
+void draw_sprite(sprite *spr) {
+    
+    int first, last, top, bottom, written;
+    float width, height, left, upper, z;
+    unsigned int v0, dv;
+    texture *tex = spr->t;
+    
+    sprite_rect(spr, &left, &upper, &width, &height, &first, &last, &top, &bottom);
+    first = first < 0 ? 0 : first;
+    last = last >= screen.width ? screen.width - 1 : last;
+    top = top < raster_top ? raster_top : top;
+    bottom = bottom >= raster_bottom ? raster_bottom - 1 : bottom;
+    bottom = bottom >= screen.height ? screen.height - 1 : bottom;
+    
+    if(first > last || top > bottom)
+        return;
+        
+    PROFILE_BEGIN(PROF_SPAN);
+    z = encode_depth(spr->z);
+    v0 = (unsigned int)((top + 0.5 - upper) / height * tex->height * 65536.0);
+    dv = (unsigned int)(tex->height / height * 65536.0);
+    
+    switch(screen.depth_format) {
+        
+        case DEPTH_FLOAT32:
+            written = sprite_columns(tex, first, last, top, bottom, left, width, v0, dv, z, DEPTH_FLOAT32);
+            break;
+            
+        case DEPTH_REVERSED:
+            written = sprite_columns(tex, first, last, top, bottom, left, width, v0, dv, z, DEPTH_REVERSED);
+            break;
+            
+        default:
+            written = sprite_columns(tex, first, last, top, bottom, left, width, v0, dv, z, DEPTH_LINEAR16);
+    }
+    
+    STAT_ADD(STAT_PIXELS, (last - first + 1) * (bottom - top + 1));
+    STAT_ADD(STAT_DEPTH_FAILED, (last - first + 1) * (bottom - top + 1) - written);
+    STAT_ADD(STAT_WRITTEN, written);
+    PROFILE_END();
+}
+
+//The pixels a point covers, those with their centers inside it or the
+//one its center is in when it's too small to cover any
+FORCE_INLINE void point_rect(raster_point *p, int *first, int *last, int *top, int *bottom) {
+    
+    float half = screen.height / 2.0, x = screen.width / 2.0 + p->x * half, y = half - p->y * half, r = p->radius * half;
+    
+    *first = (int)ceil(x - r - 0.5);
+    *last = (int)ceil(x + r - 0.5) - 1;
+    *top = (int)ceil(y - r - 0.5);
+    *bottom = (int)ceil(y + r - 0.5) - 1;
+    
+    if(*first > *last)
+        *first = *last = (int)floor(x);
+        
+    if(*top > *bottom)
+        *top = *bottom = (int)floor(y);
+}
+
+int point_rows(void *items, int i, int *top, int *bottom) {
+    
+    int first, last;
+    
+    point_rect(&((raster_point*)items)[i], &first, &last, top, bottom);
+    
+    if(last < 0 || first >= screen.width || *bottom < 0 || *top >= screen.height)
+        return 0;
+        
+    *top = *top < 0 ? 0 : *top;
+    *bottom = *bottom >= screen.height ? screen.height - 1 : *bottom;
+    
+    return 1;
+}
+
+//Flat squares at a single depth apiece, clipped to the current band
+FORCE_INLINE void fill_points(raster_list *in, int band, int format) {
+    
+    int i, x, y, first, last, top, bottom, pixels = 0, written = 0;
+    unsigned int color, *fbuf;
+    unsigned short newz, *depth16;
+    float z, *depth32, dir = format == DEPTH_REVERSED ? -1.0 : 1.0;
+    raster_point *p;
+    
+    for(i = in->point_bins.starts[band]; i < in->point_bins.starts[band + 1]; i++) {
+        
+        p = &(in->points[in->point_bins.entries[i]]);
+        point_rect(p, &first, &last, &top, &bottom);
+        first = first < 0 ? 0 : first;
+        last = last >= screen.width ? screen.width - 1 : last;
+        top = top < raster_top ? raster_top : top;
+        bottom = bottom >= raster_bottom ? raster_bottom - 1 : bottom;
+        z = encode_depth(p->z);
+        newz = (unsigned short)z;
+        color = 0xFF000000 | p->color;
+        pixels += (last - first + 1) * (bottom - top + 1);
+        
+        for(y = top; y <= bottom; y++) {
+            
+            fbuf = &screen.fbuf[y * screen.width];
+            depth16 = &((unsigned short*)screen.zbuf)[y * screen.width];
+            depth32 = &((float*)screen.zbuf)[y * screen.width];
+            
+            for(x = first; x <= last; x++) {
+                
+                if(format == DEPTH_LINEAR16) {
+                    
+                    if(newz >= depth16[x])
+                        continue;
+                        
+                    depth16[x] = newz;
+                } else {
+                    
+                    if(z * dir >= depth32[x] * dir)
+                        continue;
+                        
+                    depth32[x] = z;
+                }
+                
+                fbuf[x] = color;
+                written++;
+            }
+        }
+    }
+    
+    STAT_ADD(STAT_PIXELS, pixels);
+    STAT_ADD(STAT_DEPTH_FAILED, pixels - written);
+    STAT_ADD(STAT_WRITTEN, written);
+}
+
+void draw_points(raster_list *in, int band) {
+    
+    if(!in->point_count)
+        return;
+        
+    PROFILE_BEGIN(PROF_SPAN);
+    
+    switch(screen.depth_format) {
+        
+        case DEPTH_FLOAT32:
+            fill_points(in, band, DEPTH_FLOAT32);
+            break;
+            
+        case DEPTH_REVERSED:
+            fill_points(in, band, DEPTH_REVERSED);
+            break;
+            
+        default:
+            fill_points(in, band, DEPTH_LINEAR16);
+    }
+    
+    PROFILE_END();
+}
+
+//Narrow first to last down to the steps of a line that land inside lo
+//to hi on one axis. Step k is (2*k*d + major) / (2*major) rounded down
+//along an axis that moves d for every major, the same as a Bresenham
+//line's minor axis, and just k along the major axis where d is major.
+//Solving that for k gives where a band or the screen edge cuts in
+//without walking up to it
+FORCE_INLINE void line_minor_range(long long major, long long d, int start, int dir, int lo, int hi, long long *first, long long *last) {
+    
+    long long a = dir > 0 ? lo - start : start - hi, b = dir > 0 ? hi - start : start - lo;
+    
+    if(!d) {
+        
+        if(a > 0 || b < 0)
+            *first = 1, *last = 0;
+            
+        return;
+    }
+    
+    a = CEIL_DIV(2 * a * major - major, 2 * d);
+    b = CEIL_DIV(2 * (b + 1) * major - major, 2 * d) - 1;
+    *first = a > *first ? a : *first;
+    *last = b < *last ? b : *last;
+}
+
+//The part of an integer Bresenham line in the current band and on the
+//screen, depth tested without writing depth. Depth steps along in the
+//buffer's own encoding like a span's does, pulled in by LINE_SLOPE_BIAS
+//steps since the ends got rounded to pixels and the face under a line
+//can be that far off at the same pixel
+FORCE_INLINE int line_fill(int x0, int y0, int x1, int y1, float z0, float z1, unsigned int color, int format) {
+    
+    int dx = abs(x1 - x0), dy = abs(y1 - y0), sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+    int x, y, xmajor = dx >= dy, written = 0;
+    int bottom = raster_bottom > screen.height ? screen.height : raster_bottom;
+    long long major = xmajor ? dx : dy, minor = xmajor ? dy : dx, first = 0, last = major, err, k;
+    float z, dz = major ? (z1 - z0) / major : 0.0, dir = format == DEPTH_REVERSED ? -1.0 : 1.0;
+    unsigned short *depth16 = (unsigned short*)screen.zbuf;
+    float *depth32 = (float*)screen.zbuf;
+    
+    if(xmajor) {
+        
+        line_minor_range(major, major, x0, sx, 0, screen.width - 1, &first, &last);
+        line_minor_range(major, minor, y0, sy, raster_top, bottom - 1, &first, &last);
+    } else {
+        
+        line_minor_range(major, major, y0, sy, raster_top, bottom - 1, &first, &last);
+        line_minor_range(major, minor, x0, sx, 0, screen.width - 1, &first, &last);
+    }
+    
+    if(first > last)
+        return 0;
+        
+    //The major axis moves every step and the minor one whenever the
+    //error carries, starting from the first step in range. A line that
+    //ends where it starts is the one pixel
+    if(!major)
+        major = 1;
+        
+    err = 2 * first * minor + major;
+    x = xmajor ? x0 + sx * (int)first : x0 + sx * (int)(err / (2 * major));
+    y = xmajor ? y0 + sy * (int)(err / (2 * major)) : y0 + sy * (int)first;
+    err %= 2 * major;
+    z = z0 + dz * first - dir * LINE_SLOPE_BIAS * fabs(dz);
+    
+    for(k = first; k <= last; k++, z += dz) {
+        
+        if(format == DEPTH_LINEAR16) {
+            
+            if((unsigned short)lround(z) < depth16[y * screen.width + x]) {
+                
+                screen.fbuf[y * screen.width + x] = color;
+                written++;
+            }
+        } else if(z * dir < depth32[y * screen.width + x] * dir) {
+            
+            screen.fbuf[y * screen.width + x] = color;
+            written++;
+        }
+        
+        err += 2 * minor;
+        
+        if(err >= 2 * major) {
+            
+            err -= 2 * major;
+            
+            if(xmajor)
+                y += sy;
+            else
+                x += sx;
+        }
+        
+        if(xmajor)
+            x += sx;
+        else
+            y += sy;
+    }
+    
+    STAT_ADD(STAT_PIXELS, (int)(last - first + 1));
+    STAT_ADD(STAT_DEPTH_FAILED, (int)(last - first + 1) - written);
+    STAT_ADD(STAT_WRITTEN, written);
+    
+    return written;
+}
+
+//Project a view space line's ends to the pixels they're in and draw
+//whatever part of it is in the current band
+void draw_line(debug_line *l) {
+    
+    float half = screen.height / 2.0, w0 = focal_length / l->z0, w1 = focal_length / l->z1;
+    float fx0 = screen.width / 2.0 + l->x0 * w0 * half, fy0 = half - l->y0 * w0 * half;
+    float fx1 = screen.width / 2.0 + l->x1 * w1 * half, fy1 = half - l->y1 * w1 * half;
+    float z0 = encode_depth(l->z0), z1 = encode_depth(l->z1);
+    int x0, y0, x1, y1;
+    unsigned int color = 0xFF000000 | l->color;
+    
+    //Ends close to the near plane can land a long way off of the screen
+    x0 = (int)floor(fx0 < -LINE_LIMIT ? -LINE_LIMIT : fx0 > LINE_LIMIT ? LINE_LIMIT : fx0);
+    y0 = (int)floor(fy0 < -LINE_LIMIT ? -LINE_LIMIT : fy0 > LINE_LIMIT ? LINE_LIMIT : fy0);
+    x1 = (int)floor(fx1 < -LINE_LIMIT ? -LINE_LIMIT : fx1 > LINE_LIMIT ? LINE_LIMIT : fx1);
+    y1 = (int)floor(fy1 < -LINE_LIMIT ? -LINE_LIMIT : fy1 > LINE_LIMIT ? LINE_LIMIT : fy1);
+    
+    switch(screen.depth_format) {
+        
+        case DEPTH_FLOAT32:
+            line_fill(x0, y0, x1, y1, z0, z1, color, DEPTH_FLOAT32);
+            break;
+            
+        case DEPTH_REVERSED:
+            line_fill(x0, y0, x1, y1, z0, z1, color, DEPTH_REVERSED);
+            break;
+            
+        default:
+            line_fill(x0, y0, x1, y1, z0, z1, color, DEPTH_LINEAR16);
+    }
+}
+
+//Timed once per call, most triangles are only here to be found outside
+//of the band
+void draw_triangles(raster_list *in, int first, int end) {
+    
+    int i;
+    
+    PROFILE_BEGIN(PROF_SETUP);
+    
+    for(i = first; i < end; i++)
+#ifdef LESTER_FIXED
+        draw_triangle_fixed(NULL, &(in->tris[i]), in->cam.fixed_focal);
+#else
+        draw_triangle(NULL, &(in->tris[i]));
+#endif
+        
+    PROFILE_END();
+}
+
+//Sort count items into the bands their rows touch: counts first, then
+//where each band starts, then the indices themselves
+int bin_bands(band_bins *b, void *items, int count, band_rows rows) {
+    
+    int i, band, top, bottom, bands = RASTER_BANDS(screen.height);
+    int *grown;
+    
+    if(bands + 1 > b->start_capacity) {
+        
+        if(!(grown = (int*)realloc(b->starts, (bands + 1) * sizeof(int)))) {
+            
+            printf("[bin_bands] Could not grow the bins to %d bands\n", bands);
+            return 0;
+        }
+        
+        b->starts = grown;
+        b->start_capacity = bands + 1;
+    }
+    
+    memset((void*)b->starts, 0, (bands + 1) * sizeof(int));
+    
+    for(i = 0; i < count; i++)
+        if(rows(items, i, &top, &bottom))
+            for(band = top / RASTER_BAND_HEIGHT; band <= bottom / RASTER_BAND_HEIGHT; band++)
+                b->starts[band + 1]++;
+                
+    for(band = 0; band < bands; band++)
+        b->starts[band + 1] += b->starts[band];
+        
+    if(b->starts[bands] > b->entry_capacity) {
+        
+        if(!(grown = (int*)realloc(b->entries, b->starts[bands] * sizeof(int)))) {
+            
+            printf("[bin_bands] Could not grow the bins to %d entries\n", b->starts[bands]);
+            return 0;
+        }
+        
+        b->entries = grown;
+        b->entry_capacity = b->starts[bands];
+    }
+    
+    for(i = 0; i < count; i++)
+        if(rows(items, i, &top, &bottom))
+            for(band = top / RASTER_BAND_HEIGHT; band <= bottom / RASTER_BAND_HEIGHT; band++)
+                b->entries[b->starts[band]++] = i;
+                
+    //Filling moved each band's start on to where the next one starts
+    for(band = bands; band > 0; band--)
+        b->starts[band] = b->starts[band - 1];
+        
+    b->starts[0] = 0;
+    
+    return 1;
+}
+
+//Draw everything in the list that touches the jobs' bands of scanlines.
+//Bands never share a pixel so they can go in any order. Sprites and
+//points write depth, so they go in before the blended triangles that
+//might be in front of them. Lines go over the lot
+void draw_bands(void *data, int start, int end) {
+    
+    raster_list *in = (raster_list*)data;
+    int i, band;
+    
+    for(band = start; band < end; band++) {
+        
+        raster_top = band * RASTER_BAND_HEIGHT;
+        raster_bottom = raster_top + RASTER_BAND_HEIGHT > screen.height ? screen.height : raster_top + RASTER_BAND_HEIGHT;
+        draw_triangles(in, 0, in->opaque);
+        
+        if(in->sprite_count)
+            for(i = in->sprite_bins.starts[band]; i < in->sprite_bins.starts[band + 1]; i++)
+                draw_sprite(&(in->sprites[in->sprite_bins.entries[i]]));
+                
+        draw_points(in, band);
+        draw_triangles(in, in->opaque, in->count);
+        
+        if(in->line_count) {
+            
+            PROFILE_BEGIN(PROF_SPAN);
+            
+            for(i = 0; i < in->line_count; i++)
+                draw_line(&(in->lines[i]));
+                
+            PROFILE_END();
+        }
+    }
+    
+    raster_top = 0;
+    raster_bottom = RASTER_ALL;
+}
+
+void draw_frame(raster_list *in) {
+    
+    PROFILE_BEGIN(PROF_CLEAR);
+    clear_fbuf(in->clear_color);
+    clear_zbuf();
+    PROFILE_END();
+    
+    //Without bins there's no telling which bands a sprite or point is in
+    if(in->sprite_count && !bin_bands(&(in->sprite_bins), (void*)in->sprites, in->sprite_count, sprite_rows))
+        in->sprite_count = 0;
+        
+    if(in->point_count && !bin_bands(&(in->point_bins), (void*)in->points, in->point_count, point_rows))
+        in->point_count = 0;
+        
+    parallel_for(draw_bands, (void*)in, RASTER_BANDS(screen.height), 1);
+}
+
+int geometry_thread(void *data) {
+    
+    //Everything it works on is in frame_commands
+    (void)data;
+    profile_attach(&frame_commands.geometry_context, &frame_commands.geometry_record);
+    
+    while(1) {
+        
+        SDL_SemWait(frame_commands.geometry_start);
+        
+        if(frame_commands.quit)
+            break;
+            
+        build_frame(frame_commands.building);
+        SDL_SemPost(frame_commands.geometry_done);
+    }
+    
+    return 0;
+}
+
+int start_geometry_thread() {
+    
+    if(!(frame_commands.geometry_start = SDL_CreateSemaphore(0)) ||
+       !(frame_commands.geometry_done = SDL_CreateSemaphore(0))) {
+        
+        printf("[start_geometry_thread] Could not create semaphores: %s\n", SDL_GetError());
+        return 0;
+    }
+    
+    if(!(frame_commands.geometry_thread = SDL_CreateThread(geometry_thread, "geometry", NULL))) {
+        
+        printf("[start_geometry_thread] Could not create the thread: %s\n", SDL_GetError());
+        return 0;
+    }
+    
+    return 1;
+}
+
+//Draw a frame into the framebuffer. Pipelined, that is the frame before
+//this one while the geometry thread gets to work on this one
+void end_frame() {
+    
+    if(frame_commands.pipelined && !frame_commands.geometry_thread && !start_geometry_thread()) {
+        
+        printf("[end_frame] Falling back to an unpipelined frame\n");
+        frame_commands.pipelined = 0;
+    }
+    
+    if(!frame_commands.pipelined) {
+        
+        build_frame(&frame_commands.lists[0]);
+        draw_frame(&frame_commands.lists[0]);
+        return;
+    }
+    
+    frame_commands.building = &frame_commands.lists[frame_commands.ready ^ 1];
+    frame_commands.busy = 1;
+    SDL_SemPost(frame_commands.geometry_start);
+    draw_frame(&frame_commands.lists[frame_commands.ready]);
+    frame_commands.ready ^= 1;
+}
+
+//Golden image checks. Each canonical scene is rendered headless into
+//the framebuffer and compared against <dir>/<name>.ppm, allowing for
+//small per-channel differences and a small share of mismatched pixels
+//so that rounding changes along edges don't fail. The fixed point path
+//is held to the same references as a conformance check, but it rounds
+//edges and texel lookups its own way so it gets a larger share
+#define GOLDEN_CHANNEL_TOLERANCE 4
+#define GOLDEN_PIXEL_TOLERANCE 0.005
+#define GOLDEN_FIXED_PIXEL_TOLERANCE 0.02
+#define GOLDEN_LINE_PIXEL_TOLERANCE 0.0001 //Lines are a pixel wide, so a few wrong pixels is a lost edge
+#define GOLDEN_KEY 0xFF00FF
+#define GOLDEN_BACKGROUND 0xFF202020
+
+typedef struct golden_scene {
+    char *name;
+    float *tris; //x, y, z, u, v for each vertex, drawn immediately
+    int count;
+    float yaw, pitch;
+    void (*render)(camera *cam, texture *tex, color *c); //Or this when tris is NULL
+    int float_only; //Skipped by the fixed point build, which can't draw it
+    int depth_format;
+    int debug_view; //Drawn over whatever render submits
+} golden_scene;
+
+//One vertex behind the camera and then two behind it
+float golden_near[] = {
+     0.0,  0.6, -0.5, 0.5, 0.0,    0.6, -0.4,  2.0, 1.0, 1.0,   -0.6, -0.4,  2.0, 0.0, 1.0,
+     0.2,  0.3,  3.0, 0.5, 0.0,    0.9, -0.5, -0.5, 1.0, 1.0,   -0.7, -0.5, -0.2, 0.0, 1.0
+};
+
+//One vertex past the far plane and then two past it
+float golden_far[] = {
+     0.0,  8.0, 30.0, 0.5, 0.0,    6.0, -3.0, 10.0, 1.0, 1.0,   -6.0, -3.0, 10.0, 0.0, 1.0,
+     0.0, -3.0,  8.0, 0.5, 1.0,  -16.0,  8.0, 40.0, 0.0, 0.0,   16.0,  8.0, 40.0, 1.0, 0.0
+};
+
+//Collinear, repeated vertex, a single point, subpixel and flat in y
+float golden_degenerate[] = {
+    -0.5,  0.0,  2.0, 0.0, 0.0,    0.0,  0.0,  2.0, 0.5, 0.5,    0.5,  0.0,  2.0, 1.0, 1.0,
+     0.2,  0.2,  2.0, 0.0, 0.0,    0.2,  0.2,  2.0, 1.0, 0.0,    0.4, -0.2,  2.0, 1.0, 1.0,
+     0.0,  0.5,  2.0, 0.0, 0.0,    0.0,  0.5,  2.0, 0.0, 0.0,    0.0,  0.5,  2.0, 0.0, 0.0,
+     0.3,  0.3,  2.0, 0.0, 0.0,  0.301,  0.3,  2.0, 1.0, 0.0,    0.3, 0.299, 2.0, 0.0, 1.0,
+    -0.5, -0.5,  2.0, 0.0, 0.0,    0.5, -0.5,  2.0, 1.0, 0.0,    0.0, -0.5,  3.0, 0.5, 1.0
+};
+
+//Tall, wide and diagonal slivers
+float golden_slivers[] = {
+     0.0,  0.9,  2.0, 0.0, 0.0,   0.01, -0.9,  2.0, 1.0, 1.0,    0.0, -0.9,  2.0, 0.0, 1.0,
+    -0.9,  0.5,  2.0, 0.0, 0.0,    0.9, 0.51,  2.0, 1.0, 0.0,    0.9,  0.5,  2.0, 1.0, 1.0,
+    -0.9, -0.9,  2.0, 0.0, 1.0,   0.88,  0.9,  2.5, 0.9, 0.0,    0.9,  0.9,  2.5, 1.0, 0.0
+};
+
+//A quad facing the camera and one receding from it
+float golden_quads[] = {
+    -0.5,  0.5,  2.0, 0.0, 0.0,    0.5,  0.5,  2.0, 1.0, 0.0,    0.5, -0.5,  2.0, 1.0, 1.0,
+    -0.5,  0.5,  2.0, 0.0, 0.0,    0.5, -0.5,  2.0, 1.0, 1.0,   -0.5, -0.5,  2.0, 0.0, 1.0,
+     0.6,  0.8,  1.5, 0.0, 0.0,   0.95,  0.8,  4.0, 1.0, 0.0,   0.95,  0.2,  4.0, 1.0, 1.0,
+     0.6,  0.8,  1.5, 0.0, 0.0,   0.95,  0.2,  4.0, 1.0, 1.0,    0.6,  0.2,  1.5, 0.0, 1.0
+};
+
+//An opaque quad with three blended triangles submitted out of depth
+//order around it, one of them partly behind it
+float golden_blend_opaque[] = {
+    -0.5,  0.5,  2.0, 0.0, 0.0,    0.5,  0.5,  2.0, 1.0, 0.0,    0.5, -0.5,  2.0, 1.0, 1.0,
+    -0.5,  0.5,  2.0, 0.0, 0.0,    0.5, -0.5,  2.0, 1.0, 1.0,   -0.5, -0.5,  2.0, 0.0, 1.0
+};
+
+float golden_blend_blended[] = {
+    -0.6,  0.4,  1.5, 0.0, 0.0,    0.3,  0.4,  1.5, 0.0, 0.0,   -0.2, -0.5,  1.5, 0.0, 0.0,
+    -0.3,  0.6,  2.5, 0.0, 0.0,    0.8,  0.2,  1.5, 0.0, 0.0,    0.0, -0.6,  1.5, 0.0, 0.0,
+    -0.1,  0.3,  1.2, 0.0, 0.0,    0.6,  0.0,  1.2, 0.0, 0.0,   -0.4, -0.3,  1.2, 0.0, 0.0
+};
+
+int write_ppm(char *filename, unsigned int *pixels, int width, int height) {
+    
+    FILE *out;
+    int i;
+    
+    if(!(out = fopen(filename, "wb"))) {
+        
+        printf("[write_ppm] Could not open %s\n", filename);
+        return 0;
+    }
+    
+    fprintf(out, "P6\n%d %d\n255\n", width, height);
+    
+    for(i = 0; i < width * height; i++) {
+        
+        fputc((pixels[i] >> 16) & 0xFF, out);
+        fputc((pixels[i] >> 8) & 0xFF, out);
+        fputc(pixels[i] & 0xFF, out);
+    }
+    
+    fclose(out);
+    
+    return 1;
+}
 
-/*
-//Needs to be updated to work with textures
-object *new_cube(float s, color *c) {
+//Only reads the binary 8-bit PPMs that write_ppm produces
+unsigned int *read_ppm(char *filename, int *width, int *height) {
     
-    object* ret_obj = new_object();
-    int i;
-        triangle *temp_tri;
-    vertex temp_v[3];
-    float half_s = s/2.0;
-    float points[][5] = {
-        {-half_s, half_s, -half_s, 1.0, 0.0}, //Adding U and V 
-        {half_s, half_s, -half_s, 0.0, 0.0},
-        {half_s, -half_s, -half_s, },
-        {-half_s, -half_s, -half_s},
-        {-half_s, half_s, half_s},
-        {half_s, half_s, half_s},
-        {half_s, -half_s, half_s},
-        {-half_s, -half_s, half_s},
-    };
-    const int order[][3] = {
-                  {7, 5, 4}, //3
-                  {6, 5, 7}, //3
-                  {3, 0, 1}, //1
-                  {3, 1, 2}, //1
-                  {4, 5, 0}, 
-                  {1, 0, 5},
-                  {6, 7, 3},
-                  {3, 2, 6},
-                  {6, 1, 5},
-                  {6, 2, 1},
-                  {7, 4, 0},
-                  {0, 3, 7}
-              };
+    FILE *in;
+    int i, max, r, g, b;
+    unsigned int *pixels;
     
-    if(!ret_obj) {
+    if(!(in = fopen(filename, "rb"))) {
         
-        printf("[new_cube] object allocation failed\n");
-        return ret_obj;
+        printf("[read_ppm] Could not open %s\n", filename);
+        return NULL;
     }
     
-    printf("[new_cube] new object allocated\n");
+    if(fscanf(in, "P6 %d %d %d", width, height, &max) != 3 || max != 255 || fgetc(in) == EOF) {
         
-    if(!ret_obj)
-        return ret_obj;
+        printf("[read_ppm] %s is not an 8-bit binary PPM\n", filename);
+        fclose(in);
+        return NULL;
+    }
     
-    temp_v[0].c = c;
-    temp_v[1].c = c;
-    temp_v[2].c = c;
+    if(!(pixels = (unsigned int*)malloc(*width * *height * 4))) {
+        
+        printf("[read_ppm] Could not allocate %dx%d pixels\n", *width, *height);
+        fclose(in);
+        return NULL;
+    }
     
-    for(i = 0; i < 12; i++) {
-     
-        temp_v[0].x = points[order[i][0]][0];
-        temp_v[0].y = points[order[i][0]][1];
-        temp_v[0].z = points[order[i][0]][2];
-        temp_v[0].u = 0.0;
-        temp_v[0].v = 0.0;
-        temp_v[1].x = points[order[i][1]][0];
-        temp_v[1].y = points[order[i][1]][1];
-        temp_v[1].z = points[order[i][1]][2];
-        temp_v[1].u = 0.0;
-        temp_v[1].v = 0.0;
-        temp_v[2].x = points[order[i][2]][0];
-        temp_v[2].y = points[order[i][2]][1];
-        temp_v[2].z = points[order[i][2]][2];
+    for(i = 0; i < *width * *height; i++) {
         
-        printf("[new_cube] Creating new triangle (%f, %f, %f), (%f, %f, %f), (%f, %f, %f)\n", temp_v[0].x, temp_v[0].y, temp_v[0].z, temp_v[1].x, temp_v[1].y, temp_v[1].z,  temp_v[2].x, temp_v[2].y, temp_v[2].z);
+        r = fgetc(in);
+        g = fgetc(in);
+        b = fgetc(in);
         
-        if(!(temp_tri = new_triangle(&temp_v[0], &temp_v[1], &temp_v[2], new_texture("none")))) {
+        if(b == EOF) {
             
-            printf("[new_cube] failed to allocate triangle #%d\n", i+1);
-            delete_object(ret_obj);
-            return NULL;        
+            printf("[read_ppm] %s is truncated\n", filename);
+            free(pixels);
+            fclose(in);
+            return NULL;
         }
-        printf("[new_cube] generated triangle #%d\n", i+1);
         
-        list_push(&(ret_obj->tri_list), (void*)temp_tri);
-        printf("[new_cube] inserted triangle #%d\n", i+1);
+        pixels[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
     }
     
-    return ret_obj;
+    fclose(in);
+    
+    return pixels;
 }
-*/
 
-void translate_object(object* obj, float x, float y, float z) {
+//Fill in a triangle from 15 of a scene's floats
+void golden_triangle(triangle *tri, float *v, texture *tex, color *c, int state) {
     
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
+    int j;
     
-    obj->x += x;
-    obj->y += y;
-    obj->z += z;
+    tri->t = tex;
+    tri->has_plane = 0;
+    tri->state = state;
     
-    list_for_each(&(obj->tri_list), item, i) {
-        
-        temp_tri = (triangle*)(item->payload);
-        
-        for(j = 0; j < 3; j++) {
+    for(j = 0; j < 3; j++) {
         
-            temp_tri->v[j].x += x;
-            temp_tri->v[j].y += y;
-            temp_tri->v[j].z += z;
-        }
+        tri->v[j].x = v[j * 5];
+        tri->v[j].y = v[j * 5 + 1];
+        tri->v[j].z = v[j * 5 + 2];
+        tri->v[j].u = v[j * 5 + 3];
+        tri->v[j].v = v[j * 5 + 4];
+        tri->v[j].c = c;
     }
 }
 
-void rotate_object_x_global(object* obj, float angle) {
+//Scenes that render through the command buffer go through the same
+//geometry thread the game does. Pipelined, a frame is only drawn by the
+//end of the one after it
+void end_golden_frame(camera *cam) {
     
-    float rad_angle = DEG_TO_RAD(angle);
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
-    float temp_y, temp_z;
-        
-    list_for_each(&(obj->tri_list), item, i) {
-        
-        temp_tri = (triangle*)(item->payload);
-        
-        for(j = 0; j < 3; j++) {
-        
-            temp_y = temp_tri->v[j].y;
-            temp_z = temp_tri->v[j].z;
+    end_frame();
+    
+    if(frame_commands.pipelined) {
         
-            temp_tri->v[j].y = (temp_y * cos(rad_angle)) - (temp_z * sin(rad_angle));
-            temp_tri->v[j].z = (temp_y * sin(rad_angle)) + (temp_z * cos(rad_angle));
-        }
+        begin_frame(cam, GOLDEN_BACKGROUND);
+        end_frame();
     }
 }
 
-void rotate_object_y_global(object* obj, float angle) {
+void render_golden_level(camera *cam, texture *tex, color *c) {
     
-    float rad_angle = DEG_TO_RAD(angle);
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
-    float temp_x, temp_z;
+    object *level, *pillar;
+    bsp_node *level_bsp;
+    
+    if(!(level = new_box(-3.0, -1.0, -3.0, 3.0, 1.5, 6.0, 1, tex, c)) ||
+       !(pillar = new_box(-2.0, -1.0, 2.0, -1.0, 1.5, 3.0, 0, tex, c))) {
         
-    list_for_each(&(obj->tri_list), item, i) {
+        printf("[render_golden_level] Could not allocate the level geometry\n");
+        return;
+    }
+    
+    merge_object(level, pillar);
+    
+    if((level_bsp = build_bsp(level))) {
         
-        temp_tri = (triangle*)(item->payload);
+        begin_frame(cam, GOLDEN_BACKGROUND);
+        submit_bsp(level_bsp, NULL);
+        end_golden_frame(cam);
+        delete_bsp(level_bsp);
+    }
+    
+    delete_object(level);
+}
+
+//Two untextured triangles in their first vertex's color crossing each
+//other and a textured one, so the depth test decides what shows where
+float golden_flat[] = {
+    -0.8,  0.6,  2.0, 0.0, 0.0,    0.4,  0.6,  3.0, 1.0, 0.0,   -0.2, -0.7,  2.0, 0.5, 1.0,
+    -0.4,  0.7,  3.0, 0.0, 0.0,    0.8,  0.5,  2.0, 1.0, 0.0,    0.3, -0.6,  2.5, 0.5, 1.0,
+    -0.6, -0.2,  2.6, 0.0, 0.0,    0.7, -0.1,  2.2, 1.0, 0.0,    0.0, -0.8,  2.4, 0.5, 1.0
+};
+
+void render_golden_flat(camera *cam, texture *tex, color *c) {
+    
+    int i;
+    triangle tris[3];
+    color flat[2];
+    
+    flat[0].r = 255; flat[0].g = 96; flat[0].b = 32; flat[0].a = 255;
+    flat[1].r = 64; flat[1].g = 255; flat[1].b = 96; flat[1].a = 255;
+    begin_frame(cam, GOLDEN_BACKGROUND);
+    
+    for(i = 0; i < 3; i++) {
         
-        for(j = 0; j < 3; j++) {
+        if(i < 2)
+            golden_triangle(&tris[i], &golden_flat[i * 15], NULL, &flat[i], STATE_DEPTH);
+        else
+            golden_triangle(&tris[i], &golden_flat[i * 15], tex, c, STATE_DEFAULT);
             
-            temp_x = temp_tri->v[j].x;
-            temp_z = temp_tri->v[j].z;
-            
-            temp_tri->v[j].x = (temp_x * cos(rad_angle)) + (temp_z * sin(rad_angle));
-            temp_tri->v[j].z = (temp_z * cos(rad_angle)) - (temp_x * sin(rad_angle));
-        }
+        submit_triangle(&tris[i], NULL, NULL);
     }
+    
+    end_golden_frame(cam);
 }
 
-void rotate_object_z_global(object* obj, float angle) {
+//Goes through build_frame for the split between opaque and blended
+//triangles and the back to front sort
+void render_golden_blend(camera *cam, texture *tex, color *c) {
     
-    float rad_angle = DEG_TO_RAD(angle);
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
-    float temp_x, temp_y;
-        
-    list_for_each(&(obj->tri_list), item, i) {
+    triangle opaque[2], blended[3];
+    color tint[3];
+    int i;
+    
+    tint[0].r = 255; tint[0].g = 40; tint[0].b = 40; tint[0].a = 128;
+    tint[1].r = 40; tint[1].g = 255; tint[1].b = 40; tint[1].a = 192;
+    tint[2].r = 40; tint[2].g = 40; tint[2].b = 255; tint[2].a = 64;
+    begin_frame(cam, GOLDEN_BACKGROUND);
+    
+    for(i = 0; i < 3; i++) {
         
-        temp_tri = (triangle*)(item->payload);
+        golden_triangle(&blended[i], &golden_blend_blended[i * 15], NULL, &tint[i], STATE_DEPTH | STATE_BLEND);
+        submit_triangle(&blended[i], NULL, NULL);
         
-        for(j = 0; j < 3; j++) {
+        if(i < 2) {
             
-            temp_x = temp_tri->v[j].x;
-            temp_y = temp_tri->v[j].y;
-            
-            temp_tri->v[j].x = (temp_x * cos(rad_angle)) - (temp_y * sin(rad_angle));
-            temp_tri->v[j].y = (temp_x * sin(rad_angle)) + (temp_y * cos(rad_angle));
+            golden_triangle(&opaque[i], &golden_blend_opaque[i * 15], tex, c, STATE_DEFAULT);
+            submit_triangle(&opaque[i], NULL, NULL);
         }
     }
+    
+    end_golden_frame(cam);
 }
 
-void rotate_object_x_local(object* obj, float angle) {
+//A flat wall behind two quads of the keyed texture, the left one
+//facing the camera with linear u and v and the right one receding, in
+//perspective
+float golden_keyed_wall[] = {
+    -3.5,  2.0,  4.0, 0.0, 0.0,    3.5,  2.0,  4.0, 1.0, 0.0,    3.5, -2.0,  4.0, 1.0, 1.0,
+    -3.5,  2.0,  4.0, 0.0, 0.0,    3.5, -2.0,  4.0, 1.0, 1.0,   -3.5, -2.0,  4.0, 0.0, 1.0
+};
+
+float golden_keyed_quads[] = {
+    -0.9,  0.4,  1.2, 0.0, 0.0,   -0.1,  0.4,  1.2, 1.0, 0.0,   -0.1, -0.4,  1.2, 1.0, 1.0,
+    -0.9,  0.4,  1.2, 0.0, 0.0,   -0.1, -0.4,  1.2, 1.0, 1.0,   -0.9, -0.4,  1.2, 0.0, 1.0,
+     0.1,  0.5,  1.2, 0.0, 0.0,    0.9,  0.5,  3.0, 1.0, 0.0,    0.9, -0.5,  3.0, 1.0, 1.0,
+     0.1,  0.5,  1.2, 0.0, 0.0,    0.9, -0.5,  3.0, 1.0, 1.0,    0.1, -0.5,  1.2, 0.0, 1.0
+};
+
+//The test texture with a see-through window in the middle, a column
+//down the left and a diagonal, so rows have long runs and short ones
+unsigned int golden_keyed_data[100];
+texture golden_keyed;
+
+int init_golden_keyed() {
     
-    float oldx, oldy, oldz;
+    int x, y;
     
-    oldx = obj->x;
-    oldy = obj->y;
-    oldz = obj->z;
+    for(y = 0; y < 10; y++)
+        for(x = 0; x < 10; x++)
+            golden_keyed_data[y * 10 + x] = (x >= 3 && x < 8 && y >= 2 && y < 7) || !x || x == 9 - y ? GOLDEN_KEY : test_data[y * 10 + x];
     
-    translate_object(obj, -oldx, -oldy, -oldz);
-    rotate_object_x_global(obj, angle);
-    translate_object(obj, oldx, oldy, oldz);
+    golden_keyed.width = golden_keyed.height = 10;
+    golden_keyed.data = golden_keyed_data;
+    golden_keyed.runs = NULL;
+    
+    return key_texture(&golden_keyed, GOLDEN_KEY);
 }
 
-void rotate_object_y_local(object* obj, float angle) {
+//The fixed point build only draws the first, affine quad since its
+//spans don't correct for perspective
+void draw_golden_keyed_quads(camera *cam, texture *tex, color *c, int quads) {
     
-    float oldx, oldy, oldz;
+    triangle tri;
+    int i;
     
-    oldx = obj->x;
-    oldy = obj->y;
-    oldz = obj->z;
+    for(i = 0; i < 2; i++) {
+        
+        golden_triangle(&tri, &golden_keyed_wall[i * 15], tex, c, STATE_DEPTH);
+        render_triangle(NULL, cam, &tri);
+    }
     
-    translate_object(obj, -oldx, -oldy, -oldz);
-    rotate_object_y_global(obj, angle);
-    translate_object(obj, oldx, oldy, oldz);
+    for(i = 0; i < quads * 2; i++) {
+        
+        golden_triangle(&tri, &golden_keyed_quads[i * 15], &golden_keyed, c, i < 2 ? STATE_DEFAULT : STATE_DEFAULT | STATE_PERSPECTIVE);
+        render_triangle(NULL, cam, &tri);
+    }
 }
 
-void rotate_object_z_local(object* obj, float angle) {
-    
-    float oldx, oldy, oldz;
-    
-    oldx = obj->x;
-    oldy = obj->y;
-    oldz = obj->z;
+void draw_golden_keyed(camera *cam, texture *tex, color *c) {
     
-    translate_object(obj, -oldx, -oldy, -oldz);
-    rotate_object_z_global(obj, angle);
-    translate_object(obj, oldx, oldy, oldz);
+    draw_golden_keyed_quads(cam, tex, c, 2);
 }
 
-void project(vertex* v, screen_point* p) {
-
-    float delta = (v->z == 0.0) ? 1.0 : (focal_length/v->z);
-
-    p->x = TO_SCREEN_X(v->x * delta);
-    p->y = TO_SCREEN_Y(v->y * delta);
-    p->z = TO_SCREEN_Z(v->z);
+void draw_golden_keyed_affine(camera *cam, texture *tex, color *c) {
     
-    p->u = v->u;
-    p->v = v->v;
+    draw_golden_keyed_quads(cam, tex, c, 1);
 }
 
-//Draw an rgb-colored line along the scanline from x=x1 to x=x2, interpolating
-//z-values and only drawing the pixel if the interpolated z-value is less than
-//the value already written to the z-buffer
-void draw_scanline(SDL_Renderer *r, float scanline, float x0, float z0, float u0, float v0, float x1, float z1, float u1, float v1, texture *tex) {
+//Keyed sprites through the command buffer over the keyed scene's wall:
+//one across several bands, one across the edge between two of them,
+//two partly off the screen and one partly behind the wall
+float golden_sprite_list[] = {
+     0.0,     0.0,  2.0, 0.6, 0.6,
+     0.4, -0.1245,  2.0, 0.1, 0.1,
+    -1.3,     0.3,  1.0, 0.5, 0.5,
+     1.2,     0.8,  1.0, 0.5, 0.5,
+     4.4,     0.0,  5.0, 0.8, 0.8
+};
 
-    unsigned short newz;
-    int z_addr;
-    unsigned int newu, newv;	
-	float dz, dx, du, dv, mz, mu, mv, newz_f, newu_f, newv_f, t; 
-                 
-    //don't draw off the screen
-    if(scanline >= SCREEN_HEIGHT || scanline < 0)
-    	return;  
+void render_golden_sprites(camera *cam, texture *tex, color *c) {
     
-    //Clamp u and v values to 1.0 x 1.0 space
-    u0 = u0 < 0.0 ? 0.0 : u0 > 1.0 ? 1.0 : u0;
-    u1 = u1 < 0.0 ? 0.0 : u1 > 1.0 ? 1.0 : u1;
-    v0 = v0 < 0.0 ? 0.0 : v0 > 1.0 ? 1.0 : v0;
-    v1 = v1 < 0.0 ? 0.0 : v1 > 1.0 ? 1.0 : v1;
-      
-    if(x0 > x1) {
-     
-        //Swap x
-        t = x0;
-        x0 = x1;
-        x1 = t;
-        
-        //Swap z
-        t = z0;
-        z0 = z1;
-        z1 = t;
-        
-        //Swap u
-        t = u0;
-        u0 = u1;
-        u1 = t;
-        
-        //Swap v
-        t = u0;
-        u0 = u1;
-        u1 = t;
-    } 
+    triangle wall[2];
+    sprite sprites[5];
+    int i;
     
-    x0 = floor(x0);
-	dz = z1 - z0;
-    dx = x1 - x0;
-    du = u1 - u0;
-    dv = v1 - v0;
-    mz = dx ? dz/dx : 0;
-    mu = dx ? du/dx : 0;
-    mv = dx ? dv/dx : 0;
-    z_addr = scanline * SCREEN_WIDTH + x0;
-       
-    for(; x0 <= x1; x0 += 1, z_addr++) {
-
-        if(x0 < SCREEN_WIDTH && x0 >= 0) {
-
-            //Calculate interpolated z value
-            newz_f = mz*(x0 - x1) + z1;
-            newz = (unsigned short)lround(newz_f >= 65535 ? 65535 : newz_f < 0 ? 0 : newz_f);
-
-            //Check the z buffer and draw the point	
-            if(newz < zbuf[z_addr]) {
-                
-                                    
-                    //Calculate interpolated u value
-                    newu_f = mu*(x0 - x1) + u1;
-                    newu = (unsigned int)lround(newu_f * (tex->width - 1)); //-1
-                        
-                    //Calculate interpolated v value
-                    newv_f = mv*(x0 - x1) + v1;
-                    newv = (unsigned int)lround(newv_f * (tex->height - 1)); //-1
-                    
-                    //Need to make this conform to lighting in the future
-                    SDL_SetRenderDrawColor(r, (tex->data[newv * tex->width + newu] & 0xFF0000) >> 16, (tex->data[newv * tex->width + newu] & 0xFF00) >> 8, tex->data[newv * tex->width + newu] & 0xFF, 0xFF);
-                
-                    //Uncomment the below to view the depth buffer
-                    //SDL_SetRenderDrawColor(r, newz >> 8, newz >> 8, newz >> 8, 0xFF);
-                    SDL_RenderDrawPoint(r, lround(x0), lround(scanline));
-                    zbuf[z_addr] = newz;
-            }
-        }
+    begin_frame(cam, GOLDEN_BACKGROUND);
+    
+    for(i = 0; i < 2; i++) {
+        
+        golden_triangle(&wall[i], &golden_keyed_wall[i * 15], tex, c, STATE_DEPTH);
+        submit_triangle(&wall[i], NULL, NULL);
+    }
+    
+    for(i = 0; i < 5; i++) {
+        
+        sprites[i].x = golden_sprite_list[i * 5];
+        sprites[i].y = golden_sprite_list[i * 5 + 1];
+        sprites[i].z = golden_sprite_list[i * 5 + 2];
+        sprites[i].width = golden_sprite_list[i * 5 + 3];
+        sprites[i].height = golden_sprite_list[i * 5 + 4];
+        sprites[i].t = &golden_keyed;
+        submit_sprite(&sprites[i]);
     }
+    
+    end_golden_frame(cam);
 }
 
-void draw_triangle(SDL_Renderer *rend, triangle* tri) {
+//A fountain of flat particles, big enough that updating it gets split
+//across jobs, and a few keyed textured ones drifting in front of it
+void render_golden_particles(camera *cam, texture *tex, color *c) {
     
+    triangle wall[2];
+    emitter e;
+    particle_system *fountain, *puffs;
     int i;
-    screen_point p[3];
-    float vec_a[3];
-    float vec_b[3];
-    float cross[3];
-    float mag;
-    float normal_angle;
-    float lighting_pct;
-    float r, g, b;
-    unsigned char f, s, t, e;
-    float dx_1, dx_2, dx_3, dy_1, dy_2,	dy_3, dz_1, dz_2, dz_3, du_1, du_2, du_3, dv_1, dv_2, dv_3;
-    float mx_1, mx_2, mx_3, mz_1, mz_2, mz_3, mu_1, mu_2, mu_3, mv_1, mv_2, mv_3;
-    float new_x1, new_x2, new_x3, new_z1, new_z2, new_z3, new_u1, new_u2, new_u3, new_v1, new_v2, new_v3;
-    float first_orig_x, first_orig_y, first_orig_z, first_orig_u, first_orig_v, second_orig_x, second_orig_y, second_orig_z, second_orig_u, second_orig_v;
-	float current_s;
     
-    //Don't draw the triangle if it's offscreen
-    if(tri->v[0].z < 0 && tri->v[1].z < 0 && tri->v[2].z < 0)
+    memset((void*)&e, 0, sizeof(emitter));
+    e.y = -1.0;
+    e.z = 3.5;
+    e.vy = 2.5;
+    e.spread = 0.6;
+    e.rate = 40000.0;
+    e.lifetime = 2.0;
+    e.gravity = 2.0;
+    e.size = 0.03;
+    e.color = 0xFFC040;
+    
+    if(!(fountain = new_particle_system(&e, 20000)))
         return;
+        
+    e.x = 0.5;
+    e.y = -0.5;
+    e.z = 2.0;
+    e.vx = -0.5;
+    e.vy = 0.5;
+    e.spread = 0.5;
+    e.rate = 20.0;
+    e.size = 0.3;
+    e.t = &golden_keyed;
     
-    //Calculate the surface normal
-    //subtract 3 from 2 and 1, translating it to the origin
-    vec_a[0] = tri->v[0].x - tri->v[2].x;
-    vec_a[1] = tri->v[0].y - tri->v[2].y;
-    vec_a[2] = tri->v[0].z - tri->v[2].z;
-    vec_b[0] = tri->v[1].x - tri->v[2].x;
-    vec_b[1] = tri->v[1].y - tri->v[2].y;
-    vec_b[2] = tri->v[1].z - tri->v[2].z;
+    if(!(puffs = new_particle_system(&e, 16))) {
+        
+        delete_particle_system(fountain);
+        return;
+    }
     
-    //calculate the cross product using 1 as vector a and 2 as vector b
-    cross[0] = vec_a[1]*vec_b[2] - vec_a[2]*vec_b[1];
-    cross[1] = vec_a[2]*vec_b[0] - vec_a[0]*vec_b[2];
-    cross[2] = vec_a[0]*vec_b[1] - vec_a[1]*vec_b[0]; 
+    begin_frame(cam, GOLDEN_BACKGROUND);
     
-    //normalize the result vector
-    mag = sqrt(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
-    cross[0] /= mag;
-    cross[1] /= mag;
-    cross[2] /= mag;
+    for(i = 0; i < 2; i++) {
         
-    //Calculate the normal's angle vs the camera view direction
-    normal_angle = acos(-cross[2]);
+        golden_triangle(&wall[i], &golden_keyed_wall[i * 15], tex, c, STATE_DEPTH);
+        submit_triangle(&wall[i], NULL, NULL);
+    }
     
-    //If the normal is facing away from the camera, don't bother drawing it
-    if(normal_angle >= (3*PI/4)) {
+    for(i = 0; i < 10; i++) {
         
-        return;
+        update_particles(fountain, 0.05);
+        update_particles(puffs, 0.05);
     }
     
-    //Calculate the shading color based on the first vertex color and the
-    //angle between the camera and the surface normal
-    lighting_pct = 1.0 - (normal_angle/PI);
-    r = (float)tri->v[0].c->r * lighting_pct;
-    r = r > 255.0 ? 255 : r;     
-    g = (float)tri->v[0].c->g * lighting_pct;
-    g = g > 255.0 ? 255 : g;
-    b = (float)tri->v[0].c->b * lighting_pct;
-    b = b > 255.0 ? 255 : b;
-    SDL_SetRenderDrawColor(rend, (unsigned char)r, (unsigned char)g, (unsigned char)b, 0xFF);
+    submit_particles(fountain);
+    submit_particles(puffs);
+    end_golden_frame(cam);
     
-    //Move the vertices from world space to screen space
-    for(i = 0; i < 3; i++) 
-        project(&(tri->v[i]), &p[i]);
+    delete_particle_system(fountain);
+    delete_particle_system(puffs);
+}
+
+#ifndef LESTER_FIXED
+//Keyed texels tested one pixel at a time for linear16 depth and linear
+//u and v, which the run skipping in span_fill has to match exactly
+int span_keyed_reference(span *s, int first, int last) {
     
-    //sort vertices by ascending y
-    f = 0; s = 1; t = 2;
-    if(p[f].y > p[s].y) {
-        e = s;
-        s = f;
-        f = e;
+    int x, written = 0;
+    unsigned short newz, *depth16 = (unsigned short*)s->depth;
+    unsigned int texel;
+    float fx, z, u, v;
+    texture *tex = s->tex;
+    
+    for(x = first; x <= last; x++) {
+        
+        fx = (float)x;
+        z = s->mz*(fx - s->x1) + s->z1;
+        newz = (unsigned short)lround(z >= 65535 ? 65535 : z < 0 ? 0 : z);
+        
+        if(newz >= depth16[x])
+            continue;
+            
+        u = s->mu*(fx - s->x1) + s->u1;
+        v = s->mv*(fx - s->x1) + s->v1;
+        texel = tex->data[lround(v * (tex->height - 1)) * tex->width + lround(u * (tex->width - 1))];
+        
+        if(texel == tex->key)
+            continue;
+            
+        s->color[x] = 0xFF000000 | texel;
+        depth16[x] = newz;
+        written++;
     }
-    if(p[s].y > p[t].y) {
-        e = t;
-        t = s;
-        s = e;
+    
+    return written;
+}
+
+//Draw the keyed scene with the generated filler and again with the
+//reference swapped in. Any pixel that differs fails
+int check_keyed_runs(color *c) {
+    
+    int i, bad;
+    camera cam;
+    texture tex;
+    unsigned int *skipped;
+    span_function *filler = &span_fillers[DEPTH_LINEAR16][STATE_DEFAULT | STATE_KEYED], generated = *filler;
+    
+    if(screen.depth_format != DEPTH_LINEAR16) {
+        
+        printf("[golden] %-20s skipped: linear16 depth only\n", "keyed_runs");
+        return 0;
     }
-    if(p[f].y > p[s].y) {
-        e = s;
-        s = f;
-        f = e;
+    
+    if(!(skipped = (unsigned int*)malloc(screen.pixels * 4))) {
+        
+        printf("[check_keyed_runs] Could not allocate a copy of the framebuffer\n");
+        return 1;
+    }
+    
+    tex.width = tex.height = 10;
+    tex.data = test_data;
+    tex.runs = NULL;
+    init_camera(&cam, 50);
+    update_camera(&cam);
+    
+    for(i = 0; i < 2; i++) {
+        
+        *filler = i ? span_keyed_reference : generated;
+        clear_fbuf(GOLDEN_BACKGROUND);
+        clear_zbuf();
+        draw_golden_keyed(&cam, &tex, c);
+        
+        if(!i)
+            memcpy((void*)skipped, (void*)screen.fbuf, screen.pixels * 4);
+    }
+    
+    *filler = generated;
+    
+    for(i = 0, bad = 0; i < screen.pixels; i++)
+        bad += skipped[i] != screen.fbuf[i];
+        
+    free(skipped);
+    
+    if(bad) {
+        
+        printf("[golden] %-20s FAIL: %d pixels differ from per pixel keying\n", "keyed_runs", bad);
+        return 1;
     }
-                    
-	//Set the important scanlines
-	current_s = p[f].y;
-	dx_1 = p[s].x - p[f].x;
-    dy_1 = p[s].y - p[f].y;
-    dz_1 = p[s].z - p[f].z;
-    du_1 = p[s].u - p[f].u; 
-    dv_1 = p[s].v - p[f].v;
-    dx_2 = p[t].x - p[s].x;
-    dy_2 = p[t].y - p[s].y;
-    dz_2 = p[t].z - p[s].z;
-    du_2 = p[t].u - p[s].u; 
-    dv_2 = p[t].v - p[s].v;
-    dx_3 = p[t].x - p[f].x;
-    dy_3 = p[t].y - p[f].y;
-    dz_3 = p[t].z - p[f].z;
-    du_3 = p[t].u - p[f].u; 
-    dv_3 = p[t].v - p[f].v;
-    mx_1 = dy_1 ? dx_1 / dy_1 : 0;
-    mz_1 = dy_1 ? dz_1 / dy_1 : 0;
-    mu_1 = dy_1 ? du_1 / dy_1 : 0;
-    mv_1 = dy_1 ? dv_1 / dy_1 : 0;
-    mx_2 = dy_2 ? dx_2 / dy_2 : 0;
-    mz_2 = dy_2 ? dz_2 / dy_2 : 0;
-    mu_2 = dy_2 ? du_2 / dy_2 : 0;
-    mv_2 = dy_2 ? dv_2 / dy_2 : 0;
-    mx_3 = dy_3 ? dx_3 / dy_3 : 0;
-    mz_3 = dy_3 ? dz_3 / dy_3 : 0; 
-    mu_3 = dy_3 ? du_3 / dy_3 : 0;
-    mv_3 = dy_3 ? dv_3 / dy_3 : 0;
-    first_orig_x = p[f].x;
-    first_orig_y = p[f].y;
-    first_orig_z = p[f].z;
-    first_orig_u = p[f].u;
-    first_orig_v = p[f].v;
-    second_orig_x = p[s].x;
-    second_orig_y = p[s].y;
-    second_orig_z = p[s].z;
-    second_orig_u = p[s].u;
-    second_orig_v = p[s].v;
-	
-	while(current_s < p[t].y) {
-		
-        if(!(current_s >= SCREEN_HEIGHT || current_s < 0)) {
-            
-            new_x3 = mx_3*(current_s - first_orig_y) + first_orig_x;
-            new_z3 = mz_3*(current_s - first_orig_y) + first_orig_z;
-            new_u3 = mu_3*(current_s - first_orig_y) + first_orig_u;
-            new_v3 = mv_3*(current_s - first_orig_y) + first_orig_v;
-            
-            if(current_s < p[s].y) {
-                
-                new_x1 = mx_1*(current_s - first_orig_y) + first_orig_x;
-                new_z1 = mz_1*(current_s - first_orig_y) + first_orig_z;
-                new_u1 = mu_1*(current_s - first_orig_y) + first_orig_u;
-                new_v1 = mv_1*(current_s - first_orig_y) + first_orig_v;
-                
-                //Draw the scanline from the first edge to the third 
-                draw_scanline(rend, current_s, new_x1, new_z1, new_u1, new_v1, new_x3, new_z3, new_u3, new_v3, tri->t);
-            } else {
-                
-                new_x2 = mx_2*(current_s - second_orig_y) + second_orig_x;
-                new_z2 = mz_2*(current_s - second_orig_y) + second_orig_z;
-                new_u2 = mu_2*(current_s - second_orig_y) + second_orig_u;
-                new_v2 = mv_2*(current_s - second_orig_y) + second_orig_v;
-                
-                //Draw the scanline from the second edge to the third 
-                draw_scanline(rend, current_s, new_x2, new_z2, new_u2, new_v2, new_x3, new_z3, new_u3, new_v3, tri->t);
-            }
-        }
-           
-		//Move to the next scanline		
-		current_s += 1;
-	}
+    
+    printf("[golden] %-20s pass: same as per pixel keying\n", "keyed_runs");
+    
+    return 0;
 }
+#endif
 
-void clip_and_render(SDL_Renderer *r, triangle* tri) {    
+golden_scene golden_scenes[] = {
+    { "near_plane", golden_near, 2, 0, 0, NULL, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "far_plane", golden_far, 2, 0, 0, NULL, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "degenerate", golden_degenerate, 5, 0, 0, NULL, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "slivers", golden_slivers, 3, 0, 0, NULL, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "textured_quads", golden_quads, 4, 0, 0, NULL, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "level", NULL, 0, 30, -10, render_golden_level, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "flat", NULL, 0, 0, 0, render_golden_flat, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "blend", NULL, 0, 0, 0, render_golden_blend, 1, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "keyed", NULL, 0, 0, 0, draw_golden_keyed, 1, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "keyed_affine", NULL, 0, 0, 0, draw_golden_keyed_affine, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "sprites", NULL, 0, 0, 0, render_golden_sprites, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "particles", NULL, 0, 0, 0, render_golden_particles, 0, DEPTH_LINEAR16, DEBUG_VIEW_NONE },
+    { "level_bounds", NULL, 0, 30, -10, render_golden_level, 0, DEPTH_LINEAR16, DEBUG_VIEW_BOUNDS },
+    { "wireframe_linear16", NULL, 0, 30, -10, render_golden_level, 1, DEPTH_LINEAR16, DEBUG_VIEW_WIREFRAME },
+    { "wireframe_float32", NULL, 0, 30, -10, render_golden_level, 1, DEPTH_FLOAT32, DEBUG_VIEW_WIREFRAME },
+    { "wireframe_reversed", NULL, 0, 30, -10, render_golden_level, 1, DEPTH_REVERSED, DEBUG_VIEW_WIREFRAME }
+};
 
-    int count;
-    int on_second_iteration = 0;
+void render_golden_scene(golden_scene *scene, color *c) {
+    
     int i;
-    float plane_z = 0.1; //This is how far in front of camera the front clipping plane is
-    float scale_factor, dx, dy, dz, du, dv, ndz;
-    unsigned char point_marked[3] = {0, 0, 0};
-    vertex new_point[2]; 
-    triangle out_triangle[2];
-    int fixed[2];
-    int original;
+    camera cam;
+    triangle tri;
+    texture tex;
     
+    tex.width = tex.height = 10;
+    tex.data = test_data;
+    tex.runs = NULL;
+    clear_fbuf(GOLDEN_BACKGROUND);
+    clear_zbuf();
+    init_camera(&cam, 50);
+    cam.yaw = scene->yaw;
+    cam.pitch = scene->pitch;
+    update_camera(&cam);
     
-    //Note that in the future we're also going to need to clip on the
-    //'U', 'V' and color axes
-    while(1) {
+    if(!scene->tris) {
         
-        count = 0;
+        frame_commands.debug_view = scene->debug_view;
+        scene->render(&cam, &tex, c);
+        frame_commands.debug_view = DEBUG_VIEW_NONE;
+        return;
+    }
+    
+    for(i = 0; i < scene->count; i++) {
         
-        //Check each point to see if it's greater than the plane
-        for(i = 0; i < 3; i++) {
-            
-            if((on_second_iteration && tri->v[i].z > plane_z) || 
-              (!on_second_iteration && tri->v[i].z < plane_z)) {
+        golden_triangle(&tri, &scene->tris[i * 15], &tex, c, STATE_DEFAULT);
+        render_triangle(NULL, &cam, &tri);
+    }
+}
 
-                point_marked[i] = 1;
-                count++;
-            } else {
-                
-                point_marked[i] = 0;
-            }
-        }
+//Render every scene and either compare it against its reference or,
+//when updating, write it out as the new reference. Mismatches also get
+//a <name>.actual.ppm next to the reference. Returns the failure count
+int run_golden(char *dir, int update) {
+    
+    int i, j, width, height, bad, limit, failures = 0, depth = screen.depth_format;
+    int scene_count = sizeof(golden_scenes) / sizeof(golden_scene);
+    unsigned int *reference, a, b;
+    char filename[512];
+    color c;
+#ifdef LESTER_FIXED
+    double tolerance = GOLDEN_FIXED_PIXEL_TOLERANCE;
+    
+    //The references are the float path's, so don't overwrite them
+    if(update) {
+        
+        printf("[golden] The fixed point build only checks against the references\n");
+        return 1;
+    }
+#else
+    double tolerance = GOLDEN_PIXEL_TOLERANCE;
+#endif
+    
+    c.r = 50; c.g = 200; c.b = 255; c.a = 255;
+    
+    if(!init_golden_keyed())
+        return 1;
+    
+    for(i = 0; i < scene_count; i++) {
+        
+#ifdef LESTER_FIXED
+        if(golden_scenes[i].float_only) {
             
-        switch(count) {
+            printf("[golden] %-20s skipped: float only\n", golden_scenes[i].name);
+            continue;
+        }
+#endif
+        if(!set_depth_format(golden_scenes[i].depth_format)) {
             
-            //If all of the vertices were out of range, 
-            //skip drawing the whole thing entirely
-            case 3:
-                return;
-                break;
+            failures++;
+            continue;
+        }
+        
+        render_golden_scene(&golden_scenes[i], &c);
+        sprintf(filename, "%s/%s.ppm", dir, golden_scenes[i].name);
+        
+        if(update) {
             
-            //If one vertex was out, find it's edge intersections and
-            //build two new triangles out of it
-            case 1:
-                //Figure out what the other two points are
-                fixed[0] = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
-                fixed[1] = fixed[0] == 0 ? point_marked[1] ? 2 : 1 : fixed[0] == 1 ? point_marked[0] ? 2 : 0 : point_marked[0] ? 1 : 0;
-                original = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
-                
-                //Calculate the new intersection points
-                for(i = 0; i < 2; i++) {
-                    
-                    //x,y, and z 'length'
-                    dx = tri->v[original].x - tri->v[fixed[i]].x;
-                    dy = tri->v[original].y - tri->v[fixed[i]].y;
-                    dz = tri->v[original].z - tri->v[fixed[i]].z;
-                    du = tri->v[original].u - tri->v[fixed[i]].u;
-                    dv = tri->v[original].v - tri->v[fixed[i]].v;
-                                       
-                    //Set the known axis value
-                    new_point[i].z = plane_z; //Replace this with a line function
-                    
-                    //z 'length' of new point
-                    ndz = new_point[i].z - tri->v[fixed[i]].z;
-                    
-                    //ratio of new y-length to to old
-                    scale_factor = ndz/dz; //For now, we're dealing with a plane orthogonal to the clipping axis and as such 
-                                           //we can't possibly have zero dy because that would place both the 'in' and 'out'
-                                           //vertexes behind the plane, which is obviously impossible, so we won't worry about
-                                           //that case until we start playing with sloped clipping planes
-                    
-                    //Scale the independent axis value by the scaling factor
-                    //We can do this for other arbitrary axes in the future, such as U and V
-                    //Update: AND NOW WE ARE, MOTHERFUCKER
-                    new_point[i].x = scale_factor * dx + tri->v[fixed[i]].x;
-                    new_point[i].y = scale_factor * dy + tri->v[fixed[i]].y;
-                    new_point[i].u = scale_factor * du + tri->v[fixed[i]].u;
-                    new_point[i].v = scale_factor * dv + tri->v[fixed[i]].v;
-                    
-                    //Copy the color information
-                    new_point[i].c = tri->v[fixed[i]].c;
-                }   
-                
-                //Test/draw the new triangles, maintaining the CW or CCW ordering
-                //Build the first triangle
-                clone_vertex(&new_point[0], &(out_triangle[0].v[original]));
-                clone_vertex(&(tri->v[fixed[0]]), &(out_triangle[0].v[fixed[0]]));
-                clone_vertex(&(tri->v[fixed[1]]), &(out_triangle[0].v[fixed[1]]));
-                    
-                //Build the second triangle    
-                clone_vertex(&new_point[1], &(out_triangle[1].v[original]));
-                clone_vertex(&new_point[0], &(out_triangle[1].v[fixed[0]]));
-                clone_vertex(&(tri->v[fixed[1]]), &(out_triangle[1].v[fixed[1]]));
-                
-                //Run the new triangles through another round of processing
-                clip_and_render(r, &out_triangle[0]);
-                clip_and_render(r, &out_triangle[1]);
+            if(!write_ppm(filename, screen.fbuf, screen.width, screen.height))
+                failures++;
+            else
+                printf("[golden] %-20s updated\n", golden_scenes[i].name);
                 
-                //Exit the function early for dat tail recursion              
-                return;
-                break;
+            continue;
+        }
+        
+        if(!(reference = read_ppm(filename, &width, &height)) || width != screen.width || height != screen.height) {
             
-            case 2:
-                //Figure out which point we're keeping
-                original = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
-                fixed[0] = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
-                fixed[1] = fixed[0] == 0 ? point_marked[1] ? 1 : 2 : fixed[0] == 1 ? point_marked[0] ? 0 : 2 : point_marked[0] ? 0 : 1;
-                            
-                //Calculate the new intersection points
-                for(i = 0; i < 2; i++) {
-                    
-                    //x,y, and z 'length'
-                    dx = tri->v[original].x - tri->v[fixed[i]].x;
-                    dy = tri->v[original].y - tri->v[fixed[i]].y;
-                    dz = tri->v[original].z - tri->v[fixed[i]].z;
-                    du = tri->v[original].u - tri->v[fixed[i]].u;
-                    dv = tri->v[original].v - tri->v[fixed[i]].v;
-                                       
-                    //Set the known axis value
-                    new_point[i].z = plane_z; //Replace this with a line function
-                    
-                    //z 'length' of new point
-                    ndz = new_point[i].z - tri->v[fixed[i]].z;
-                    
-                    //ratio of new y-length to to old
-                    scale_factor = ndz/dz; //For now, we're dealing with a plane orthogonal to the clipping axis and as such 
-                                           //we can't possibly have zero dy because that would place both the 'in' and 'out'
-                                           //vertexes behind the plane, which is obviously impossible, so we won't worry about
-                                           //that case until we start playing with sloped clipping planes
-                    
-                    //Scale the independent axis value by the scaling factor
-                    //We can do this for other arbitrary axes in the future, such as U and V
-                    //Update: AND NOW WE ARE, MOTHERFUCKER
-                    new_point[i].x = scale_factor * dx + tri->v[fixed[i]].x;
-                    new_point[i].y = scale_factor * dy + tri->v[fixed[i]].y;
-                    new_point[i].u = scale_factor * du + tri->v[fixed[i]].u;
-                    new_point[i].v = scale_factor * dv + tri->v[fixed[i]].v;
-                    
-                    //Copy the color information
-                    new_point[i].c = tri->v[fixed[i]].c;
-                }      
-                
-                //Start building the new triangles, maintaining the CW or CCW ordering 
-                clone_vertex(&(tri->v[original]), &(out_triangle[0].v[original]));
-                clone_vertex(&new_point[0], &(out_triangle[0].v[fixed[0]]));
-                clone_vertex(&new_point[1], &(out_triangle[0].v[fixed[1]]));
-                
-                //Send through processing again
-                clip_and_render(r, &out_triangle[0]);
-                    
-                //Exit the function early for dat tail recursion  
-                return;
-                break;
+            printf("[golden] %-20s FAIL: no usable reference\n", golden_scenes[i].name);
+            free(reference);
+            failures++;
+            continue;
+        }
+        
+        for(j = 0, bad = 0; j < screen.pixels; j++) {
             
-            //If there were no intersections we won't do anything and 
-            //allow execution to flow through
-            case 0:
-            default:
-                break; 
+            a = screen.fbuf[j];
+            b = reference[j];
+            
+            if(abs((int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF)) > GOLDEN_CHANNEL_TOLERANCE ||
+               abs((int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF)) > GOLDEN_CHANNEL_TOLERANCE ||
+               abs((int)(a & 0xFF) - (int)(b & 0xFF)) > GOLDEN_CHANNEL_TOLERANCE)
+                bad++;
         }
-
-        //If we hit case 0 both times above, all points on this
-        //triangle lie in the drawable area and we can leave this
-        //clipping loop and flow down to do the drawing of the 
-        //processed triangle         
-        if(on_second_iteration)
-            break;
         
-        on_second_iteration = 1;
-        plane_z = SCREEN_DEPTH;
-    }    
-    
-    //If we got this far, the triangle is drawable. So we should do that. Or whatever.
-    draw_triangle(r, tri);   
-}
-
-void render_triangle(SDL_Renderer *rend, triangle* tri) {
-
-    clip_and_render(rend, tri);
-}
-
-void render_object(SDL_Renderer *r, object *obj) {
-    
-    node* item;
-    int i;
-    
-    list_for_each(&(obj->tri_list), item, i) {
+        free(reference);
+        limit = screen.pixels * tolerance;
         
-        render_triangle(r, (triangle*)item->payload);
+#ifndef LESTER_FIXED
+        if(golden_scenes[i].debug_view != DEBUG_VIEW_NONE)
+            limit = screen.pixels * GOLDEN_LINE_PIXEL_TOLERANCE;
+#endif
+        
+        if(bad > limit) {
+            
+            printf("[golden] %-20s FAIL: %d pixels differ (%.3f%%)\n", golden_scenes[i].name, bad, (bad * 100.0) / screen.pixels);
+            sprintf(filename, "%s/%s.actual.ppm", dir, golden_scenes[i].name);
+            write_ppm(filename, screen.fbuf, screen.width, screen.height);
+            failures++;
+        } else {
+            
+            printf("[golden] %-20s pass: %d pixels differ (%.3f%%)\n", golden_scenes[i].name, bad, (bad * 100.0) / screen.pixels);
+        }
     }
+    
+#ifndef LESTER_FIXED
+    if(!update && set_depth_format(DEPTH_LINEAR16))
+        failures += check_keyed_runs(&c);
+#endif
+    free(golden_keyed.runs);
+    set_depth_format(depth);
+    
+    return failures;
 }
 
+//bench.c pulls this file in for its kernels and brings its own main
+#ifndef LESTER_NO_MAIN
 int main(int argc, char* argv[]) {
 
     SDL_Window* window = NULL;
     SDL_Renderer* renderer = NULL;
+    SDL_Texture* screen_texture = NULL;
     SDL_Event e;
-    int fov_angle, player_angle = 90, chg_angle = 0;
-    float i = 0.0, step = 0.001, rstep = 0, fps, walkspeed = 0.04;
+    SDL_Rect drawn;
+    int chg_angle = 0, chg_pitch = 0;
+    float step = 0, rstep = 0, fps, walkspeed = 0.04;
+    camera cam;
     color *c;
-    object *cube1, *cube2;
+    object *level, *pillar;
+    bsp_node *level_bsp;
     triangle test_tri[2];
-    int done = 0;
+    int done = 0, i;
     int numFrames = 0; 
-    Uint32 startTime = SDL_GetTicks(), frame_start;
+    Uint32 startTime = SDL_GetTicks();
+    Uint64 frame_counter;
     char title[255] = "LESTER";
+    char *trace_file = NULL, *golden_dir = NULL;
+    int golden_update = 0, no_pipeline = 0, threads = 0, span = -1;
+    int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT, depth = DEPTH_LINEAR16;
+    float budget = 0.0;
+    int debug_view = DEBUG_VIEW_NONE;
+    
+    //-trace <file> writes the profiler history out when we quit
+    //-golden <dir> checks the rasterizer against the reference images
+    //in dir and -golden-update <dir> rewrites them, both without a window.
+    //The checked in references are in tests/golden, make test runs them
+    //-nopipeline draws each frame as soon as it is submitted, trading 
+    //the geometry thread's overlap for a frame less latency
+    //-threads <n> sizes the job system, one worker per core by default
+    //-span <scalar|sse2|avx2> forces a span kernel instead of the widest
+    //one the CPU supports
+    //-res <w>x<h> sets the window size, 640x480 by default
+    //-dynres <ms> scales the resolution down when frames take longer
+    //than ms and back up when there's time to spare
+    //-depth <linear16|float32|reversed> picks the depth buffer format
+    //-debug <wireframe|bounds> starts in a debug view, F3 cycles them
+    for(i = 1; i < argc; i++) {
+        
+        if(!strcmp(argv[i], "-trace") && i + 1 < argc)
+            trace_file = argv[++i];
+        else if(!strcmp(argv[i], "-golden") && i + 1 < argc)
+            golden_dir = argv[++i];
+        else if(!strcmp(argv[i], "-golden-update") && i + 1 < argc)
+            golden_dir = argv[++i], golden_update = 1;
+        else if(!strcmp(argv[i], "-nopipeline"))
+            no_pipeline = 1;
+        else if(!strcmp(argv[i], "-threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-span") && i + 1 < argc)
+            for(span = 0, i++; span < SPAN_KERNELS && strcmp(argv[i], span_names[span]); span++);
+        else if(!strcmp(argv[i], "-res") && i + 1 < argc && sscanf(argv[i + 1], "%dx%d", &width, &height) == 2)
+            i++;
+        else if(!strcmp(argv[i], "-dynres") && i + 1 < argc)
+            budget = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-depth") && i + 1 < argc)
+            for(depth = 0, i++; depth < DEPTH_FORMATS && strcmp(argv[i], depth_names[depth]); depth++);
+        else if(!strcmp(argv[i], "-debug") && i + 1 < argc)
+            for(debug_view = 0, i++; debug_view < DEBUG_VIEWS && strcmp(argv[i], debug_names[debug_view]); debug_view++);
+    }
+    
+    if(!init_span_kernel(span))
+        return -1;
+
+    //The reference images are all at the default size
+    if(golden_dir)
+        width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
 
-    if(!init_zbuf()) {
+    if(!init_screen(width, height, depth)) {
         
-        printf("Could not init the z-buffer\n");
+        printf("Could not init the screen buffers\n");
         return -1;
     }
+    
+    init_profiler();
+    frame_commands.sort_by_texture = 1;
+    frame_commands.pipelined = !no_pipeline;
+    
+    if(!init_jobs(threads))
+        printf("Could not start the job system, rasterizing on the main thread\n");
+    
+    //The golden scenes build their own geometry, so check them before
+    //anything else gets allocated
+    if(golden_dir) {
+        
+        i = run_golden(golden_dir, golden_update);
+        delete_command_buffer();
+        shutdown_jobs();
+        
+        return i ? 1 : 0;
+    }
+
+    set_frame_budget(budget);
 
     if(!(c = new_color(50, 200, 255, 255))) {
         
@@ -968,8 +6983,27 @@ int main(int argc, char* argv[]) {
 
     printf("Cube created successfully\n");
 */
-    fov_angle = 50;
-    focal_length = 1.0 / (2.0 * tan(DEG_TO_RAD(fov_angle)/2.0));
+    //Compile the environment up front so each frame only has to walk it
+    if(!(level = new_box(-3.0, -1.0, -3.0, 3.0, 1.5, 6.0, 1, new_texture("none"), c)) ||
+       !(pillar = new_box(-2.0, -1.0, 2.0, -1.0, 1.5, 3.0, 0, new_texture("none"), c))) {
+        
+        printf("Could not allocate the level geometry\n");
+        return -1;
+    }
+    
+    merge_object(level, pillar);
+    
+    if(!(level_bsp = build_bsp(level))) {
+        
+        printf("Could not build the level BSP\n");
+        return -1;
+    }
+    
+    delete_object(level);
+    printf("Level compiled successfully\n");
+    
+    init_camera(&cam, 50);
+    update_camera(&cam);
 
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
 
@@ -977,7 +7011,7 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    window = SDL_CreateWindow("LESTER", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+    window = SDL_CreateWindow("LESTER", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen.full_width, screen.full_height, SDL_WINDOW_SHOWN);
 
     if(window == NULL) {
 
@@ -992,6 +7026,14 @@ int main(int argc, char* argv[]) {
         printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
         return -1;
     }
+    
+    screen_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, screen.full_width, screen.full_height);
+    
+    if(screen_texture == NULL) {
+
+        printf("Screen texture could not be created! SDL_Error: %s\n", SDL_GetError());
+        return -1;
+    }
 
     //SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
     SDL_SetRelativeMouseMode(SDL_TRUE);
@@ -1003,6 +7045,8 @@ int main(int argc, char* argv[]) {
     //rotate_object_z_local(cube, 45);
     
     test_tri[0].t = new_texture("none");
+    test_tri[0].has_plane = 0;
+    test_tri[0].state = STATE_DEFAULT;
     test_tri[0].v[0].x = 0.5;
     test_tri[0].v[0].y = 0.5;
     test_tri[0].v[0].z = 1.0;
@@ -1022,6 +7066,8 @@ int main(int argc, char* argv[]) {
     test_tri[0].v[2].v = 1.0;
     test_tri[0].v[2].c = c;
     test_tri[1].t = new_texture("none");
+    test_tri[1].has_plane = 0;
+    test_tri[1].state = STATE_DEFAULT;
     test_tri[1].v[0].x = -0.5;
     test_tri[1].v[0].y = 0.5;
     test_tri[1].v[0].z = 1.0;
@@ -1072,6 +7118,21 @@ int main(int argc, char* argv[]) {
                         rstep = walkspeed;
                     break;
                     
+                    case SDLK_F1:
+                    
+                        prof.show_overlay = !prof.show_overlay;
+                    break;
+                    
+                    case SDLK_F2:
+                    
+                        dump_profile_trace("lester_trace.json");
+                    break;
+                    
+                    case SDLK_F3:
+                    
+                        debug_view = (debug_view + 1) % DEBUG_VIEWS;
+                    break;
+                    
                     default:
                         done = 1;
                         break;
@@ -1097,58 +7158,77 @@ int main(int argc, char* argv[]) {
             if(e.type == SDL_MOUSEMOTION) {
                                 
                 chg_angle += e.motion.xrel;
+                chg_pitch -= e.motion.yrel;
             } 
         }
 
-        frame_start = SDL_GetTicks();
-        i += step;
-        //translate_object(cube1, 0.0, 0.0, step);
+        frame_counter = SDL_GetPerformanceCounter();
+        profile_begin_frame();
         //rotate_object_y_local(cube1, 1);
         //rotate_object_x_local(cube1, 1);
         //rotate_object_z_local(cube1, 1);       
-  /*      rotate_object_y_global(cube2, -chg_angle);    
-        translate_object(cube2, -rstep, 0.0, -step);
-        rotate_object_y_global(cube1, -chg_angle);
-        translate_object(cube1, -rstep, 0.0, -step); */
         //rotate_object_x_local(cube2, 1);
         //rotate_object_z_local(cube2, 1);
 
-        player_angle += chg_angle;
-        chg_angle = 0;
+        //The player only moves the camera, the world stays put
+        cam.yaw += chg_angle;
+        cam.pitch += chg_pitch;
+        chg_angle = chg_pitch = 0;
 
-        if(player_angle == 360)
-            player_angle = 0;
+        if(cam.yaw >= 360)
+            cam.yaw -= 360;
+            
+        if(cam.yaw < 0)
+            cam.yaw += 360;
             
-        if(player_angle == -1)
-            player_angle = 359;
+        cam.pitch = cam.pitch > 89 ? 89 : cam.pitch < -89 ? -89 : cam.pitch;
+        move_camera(&cam, step, rstep);
+        update_camera(&cam);
 
-        SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF);
-        SDL_RenderClear(renderer);
-        clear_zbuf();
+        begin_frame(&cam, 0xFFFFFF00);
+        frame_commands.debug_view = debug_view % DEBUG_VIEWS;
+        //submit_object(cube1, NULL, NULL);
+        //submit_object(cube2, NULL, NULL);  
+        submit_bsp(level_bsp, NULL);
+        submit_triangle(&test_tri[0], NULL, NULL);
+        submit_triangle(&test_tri[1], NULL, NULL);
+        end_frame();
+        
+        PROFILE_BEGIN(PROF_PRESENT);
+        //Whatever size the frame was drawn at gets stretched to the window
+        drawn.x = drawn.y = 0;
+        drawn.w = screen.width;
+        drawn.h = screen.height;
+        SDL_UpdateTexture(screen_texture, &drawn, screen.fbuf, screen.width * 4);
+        SDL_RenderCopy(renderer, screen_texture, &drawn, NULL);
         
-        //render_object(renderer, cube1);
-        //render_object(renderer, cube2);  
-        test_tri[0].v[2].z += step;
-        test_tri[1].v[0].z += step;
-        test_tri[1].v[2].z += step;
-        render_triangle(renderer, &test_tri[0]);
-        render_triangle(renderer, &test_tri[1]);
+        if(prof.show_overlay)
+            draw_profile_overlay(renderer);
         
         SDL_RenderPresent(renderer);
+        PROFILE_END();
+        profile_end_frame();
+        update_dynamic_resolution(((SDL_GetPerformanceCounter() - frame_counter) * 1000.0) / SDL_GetPerformanceFrequency());
         numFrames++;        
         fps = ( numFrames/(float)(SDL_GetTicks() - startTime) )*1000;
-        sprintf(&title, "LESTER %f FPS", fps);
-        SDL_SetWindowTitle(window, &title);
-        
-        if((step < 0 && i <= 0.0) || (step > 0 && i >= 1.0))
-            step = -step;
+        sprintf(title, "LESTER %f FPS", fps);
+        SDL_SetWindowTitle(window, title);
                
         //while((SDL_GetTicks() - frame_start) <= 14);
     }
 
+    if(trace_file)
+        dump_profile_trace(trace_file);
+    
+    //The geometry thread may still be walking the level
+    delete_command_buffer();
+    shutdown_jobs();
+    delete_bsp(level_bsp);
+    SDL_DestroyTexture(screen_texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 
     return 0;
 }
+#endif
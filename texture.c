@@ -354,6 +354,10 @@ int main(int argc, char* argv[]) {
     int done = 0, draw_orig = 1;
     point points[3];
     
+    //SDL_main needs the arguments declared either way
+    (void)argc;
+    (void)argv;
+    
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
 
         printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());